@@ -39,9 +39,13 @@
 #     * see the included README.txt file for documentation of the program (chatclient.c)
 #
 
+import getopt                   # Command-line option parsing
 import os                       # Miscellaneous operating system interfaces
 import re                       # Regular expressions
 import sys                      # System-specific parameters
+import threading                # Thread-based parallelism
+import time                     # Time access and conversions
+import zlib                     # Compression compatible with gzip
 from socket import (            # Sockets API
     socket,
     gethostbyname,
@@ -52,37 +56,139 @@ from socket import (            # Sockets API
 )
 from struct import pack, unpack # Structured binary data
 
-BACKLOG = 5 # Arbitrary queue size for connection requests
+BACKLOG = 128 # Queue size for connection requests; the data listener is reused per request
 TAG_LEN = 8 # Number of bytes reserved for tag field of packet header
+MIN_CHUNK_LEN = 4096 # Smallest GET chunk size ftserver accepts
+MAX_CHUNK_LEN = 8 << 20 # Largest GET chunk size ftserver accepts
+DEFAULT_CHUNK_LEN = 65536 # GET chunk size requested when -c is not given
+USAGE = (
+    "usage: python2 ftclient [-c <chunk-size>] [-p] [-m] [-a] [-j <connections>] [-z] [-s] [-x] " +
+    "[-n <page-size>] " +
+    "[-r <cursor>] [-d <generation>] [-w] <server-hostname> <server-port> " +
+    "-l [<pattern>]|-g [<filename> ...] [<data-port>]"
+)
+BODY_CHUNK_LEN = 65536 # Max number of file body bytes per recv()
+READ_BUF_LEN = 262144 # Size of each connection's receive ring buffer
+PIPELINE_DEPTH = 16 # Max number of requests sent ahead of their replies
+MAX_STREAMS = 64 # Max number of concurrent streams ftserver multiplexes (-m)
+STAT_RECORD_LEN = 34 # Number of bytes in an FSTAT record before its name (-x)
+DELTA_MARKS = {"ADDED": "+", "MODIFIED": "~", "REMOVED": "-"} # Prefix of each change (-d)
+MAX_RANGES = 64 # Max number of connections one file is fetched over (-j)
+RANGE_MIN_LEN = 1 << 20 # Smallest range worth a connection of its own (-j)
 
 def main():
     # Provide global access to commandArg-line arguments.
     global s_host
     global s_port
     global commandArg
-    global filename
+    global filenames
+    global pattern
     global dataPort
+    global protocolVersion
+    global chunkSize
+    global passive
+    global multiplex
+    global showStats
+    global extended
+    global pageSize
+    global pageCursor
+    global generation
+    global watch
+    global resume
+    global parallel
+    global compress
 
-    # Exactly five or six commandArg-line arguments are expected.
-    if len(sys.argv) not in (5, 6):
-        print (
-            "usage: python2 ftclient <server-hostname> <server-port> " +
-            "-l|-g [<filename>] <data-port>"
-        )
+    # Parse the options preceding the server hostname.
+    protocolVersion = 1
+    chunkSize = None
+    passive = False
+    multiplex = False
+    showStats = False
+    extended = False
+    pageSize = None
+    pageCursor = ""
+    generation = None
+    watch = False
+    resume = False
+    parallel = None
+    compress = False
+    try:
+        options, args = getopt.getopt(sys.argv[1:], "c:pmaj:zsxn:r:d:w")
+    except getopt.GetoptError:
+        print USAGE
         sys.exit(1)
-    s_host = gethostbyname(sys.argv[1])
-    s_port = sys.argv[2]
-    commandArg = sys.argv[3]
-    filename = sys.argv[4] if len(sys.argv) == 6 else None
-    dataPort = sys.argv[5] if len(sys.argv) == 6 else sys.argv[4]
-
-    # The -g (get) commandArg must by accompanied by a filename.
-    if commandArg == "-g" and filename is None:
-        print (
-            "usage: python2 ftclient <server-hostname> <server-port> " +
-            "-l|-g [<filename>] <data-port>"
-        )
+    for option, value in options:
+        # -c: request framed GET packets of the given size instead of a sendfile body.
+        if option == "-c":
+            if not checkPortArg(value):
+                print "ftclient: Chunk size must be an integer"
+                sys.exit(1)
+            chunkSize = int(value)
+            if chunkSize < MIN_CHUNK_LEN or chunkSize > MAX_CHUNK_LEN:
+                print ("ftclient: Chunk size must be in the range " +
+                       "[{0}, {1}]".format(MIN_CHUNK_LEN, MAX_CHUNK_LEN))
+                sys.exit(1)
+        # -p: passive mode; connect to a data port opened by the server.
+        elif option == "-p":
+            passive = True
+        # -m: fetch all files as interleaved streams on one data connection.
+        elif option == "-m":
+            multiplex = True
+        # -a: append the rest of each file to a partial local copy (RANGE).
+        elif option == "-a":
+            resume = True
+        # -j: fetch each file in byte ranges over several connections at once.
+        elif option == "-j":
+            if not checkPortArg(value) or int(value) < 1 or int(value) > MAX_RANGES:
+                print "ftclient: Connection count must be in the range [1, {0}]".format(MAX_RANGES)
+                sys.exit(1)
+            parallel = int(value)
+        # -z: accept files in compressed chunks (COMPRESS).
+        elif option == "-z":
+            compress = True
+        # -s: print the server's allocator counters once every request is done.
+        elif option == "-s":
+            showStats = True
+        # -x: list each file's size, mtime, mode and inode (LISTX).
+        elif option == "-x":
+            extended = True
+        # -n: list at most the given number of files.
+        elif option == "-n":
+            if not checkPortArg(value) or int(value) < 1:
+                print "ftclient: Page size must be a positive integer"
+                sys.exit(1)
+            pageSize = int(value)
+        # -r: continue a listing where the previous page ended.
+        elif option == "-r":
+            try:
+                pageCursor = value.decode("hex")
+            except TypeError:
+                print "ftclient: Invalid cursor"
+                sys.exit(1)
+        # -d: list only the files changed since the given generation (DELTA).
+        elif option == "-d":
+            if not checkPortArg(value):
+                print "ftclient: Generation must be an integer"
+                sys.exit(1)
+            generation = value
+        # -w: print directory changes as they happen until interrupted (WATCH).
+        elif option == "-w":
+            watch = True
+
+    # The -g (get) commandArg must by accompanied by one or more filenames, the
+    # -l (list) commandArg by at most one pattern, and active mode by a data port
+    # (watching needs no data connection).
+    numOperands = len(args) - 3 - (not passive and not watch)
+    if (numOperands < 0 or (args[2] == "-g" and numOperands < 1) or
+            (args[2] != "-g" and numOperands > 1)):
+        print USAGE
         sys.exit(1)
+    s_host = gethostbyname(args[0])
+    s_port = args[1]
+    commandArg = args[2]
+    filenames = args[3:len(args) - (not passive)] if commandArg == "-g" else [None]
+    pattern = args[3] if commandArg == "-l" and numOperands == 1 else ""
+    dataPort = None if passive or watch else args[-1]
 
     # The given server port must be an integer.
     if not checkPortArg(s_port):
@@ -100,22 +206,69 @@ def main():
         print "ftclient: Command must be either -l or -g"
         sys.exit(1)
 
-    # The given data port must be an integer.
-    if not checkPortArg(dataPort):
-        print "ftclient: Data port must be an integer"
+    # Only files can be multiplexed.
+    if multiplex and commandArg != "-g":
+        print "ftclient: -m requires -g"
+        sys.exit(1)
+
+    # Only single-stream fetches resume.
+    if resume and (commandArg != "-g" or multiplex):
+        print "ftclient: -a requires -g without -m"
+        sys.exit(1)
+
+    # Multiplexed streams are never compressed.
+    if compress and (commandArg != "-g" or multiplex):
+        print "ftclient: -z requires -g without -m"
         sys.exit(1)
-    dataPort = int(dataPort)
 
-    # The given data port must be in the range [1024, 65535].
-    if int(dataPort) < 1024 or int(dataPort) > 65535:
-        print "ftclient: Data port must be in the range [1024, 65535]"
+    # Each range connects to a data listener of its own.
+    if parallel is not None and (commandArg != "-g" or multiplex or resume or not passive):
+        print "ftclient: -j requires -g and -p without -m or -a"
         sys.exit(1)
 
-    # The given server and data ports must be distinct from eachother.
-    if s_port == dataPort:
-        print "ftclient: Server port and data port cannot match"
+    # Only listings carry file metadata, or come in pages.
+    if extended and commandArg != "-l":
+        print "ftclient: -x requires -l"
+        sys.exit(1)
+    if (pageSize is not None or pageCursor) and commandArg != "-l":
+        print "ftclient: -n and -r require -l"
+        sys.exit(1)
+
+    # Changes are reported for the whole directory, one name per packet.
+    if generation is not None and (commandArg != "-l" or pattern or extended or
+                                   pageSize is not None or pageCursor):
+        print "ftclient: -d requires -l without a pattern, -x, -n or -r"
+        sys.exit(1)
+    if watch and (commandArg != "-l" or pattern or extended or pageSize is not None or
+                  pageCursor or passive):
+        print "ftclient: -w requires -l without a pattern, -x, -n, -r or -p"
         sys.exit(1)
 
+    # Passive mode needs no data port; the server reports one.
+    if not passive and not watch:
+        # The given data port must be an integer.
+        if not checkPortArg(dataPort):
+            print "ftclient: Data port must be an integer"
+            sys.exit(1)
+        dataPort = int(dataPort)
+
+        # The given data port must be in the range [1024, 65535].
+        if int(dataPort) < 1024 or int(dataPort) > 65535:
+            print "ftclient: Data port must be in the range [1024, 65535]"
+            sys.exit(1)
+
+        # The given server and data ports must be distinct from eachother.
+        if s_port == dataPort:
+            print "ftclient: Server port and data port cannot match"
+            sys.exit(1)
+
+    # Don't allow files to be overwritten (only appended to with -a); check
+    # before anything is transferred.
+    for filename in filenames:
+        if commandArg == "-g" and not resume and os.path.exists(filename):
+            print "ftclient: File \"{0}\" already exists".format(filename)
+            sys.exit(1)
+
     # Establish a control connection between the FTP client and server.
     ftp()
 
@@ -138,34 +291,100 @@ def checkPortArg(string):
     return re.match("^[0-9]+$", string) is not None
 
 
+# FrameReader class
+#	* inputs:
+#		* socket -- socket to receive packets from
+#		* capacity -- size of the ring buffer in bytes
+#	* calls:
+#		* recv_into() -- receives into a slice of the ring without copying
+#	* purpose:
+#		* ring buffer of the bytes received from one socket; each recv_into()
+#		pulls as much as the socket has (up to the ring's free space), and
+#		recvPack() decodes every complete packet from the ring before the
+#		socket is read again. A partial packet stays in the ring until the
+#		rest of it arrives.
+#
+class FrameReader(object):
+    def __init__(self, socket, capacity = READ_BUF_LEN):
+        self.socket = socket
+        self.ring = bytearray(capacity)
+        self.view = memoryview(self.ring)
+        self.capacity = capacity
+        self.head = 0 # Count of bytes consumed
+        self.tail = 0 # Count of bytes received
+
+    # Number of received bytes not yet consumed.
+    def available(self):
+        return self.tail - self.head
+
+    # Receive whatever the socket has, up to the contiguous free space.
+    def fill(self):
+        tailIndex = self.tail % self.capacity
+        freeBytes = min(self.capacity - self.available(), self.capacity - tailIndex)
+        try:
+            received = self.socket.recv_into(self.view[tailIndex:tailIndex + freeBytes])
+        except Exception as e:
+            print e.strerror
+            sys.exit(1)
+        if received == 0:
+            print "ftclient: Connection closed by server"
+            sys.exit(1)
+        self.tail += received
+
+    # Consume numBytes (at most available()) from the front of the ring.
+    def take(self, numBytes):
+        headIndex = self.head % self.capacity
+        firstPart = min(numBytes, self.capacity - headIndex)
+        data = self.view[headIndex:headIndex + firstPart].tobytes()
+        if firstPart < numBytes:
+            data += self.view[:numBytes - firstPart].tobytes()
+        self.head += numBytes
+        return data
+
+
 # recvFile function
 #	* inputs:
-#		* sockfd -- file descriptor of socket to receive from
+#		* reader -- FrameReader of the socket to receive from
 #		* presetSize -- specified number of bytes to receive from
 #	* outputs:
 #		* data (file) received stored in dataBuffer
 #	* calls:
 #		* len()
+#		* FrameReader.fill()
+#		* FrameReader.take()
 #		* recv()
 #	* purpose:
-#		* receive specified number of bytes from data (file)
+#		* receive specified number of bytes from data (file); requests larger
+#		than the ring drain it and then receive the rest directly
 #
-def recvFile(socket, numBytes):
-    # Retrieve the given number of bytes.
-    data = "";
-    while len(data) < numBytes:
+def recvFile(reader, numBytes):
+    # Wait for the given number of bytes to arrive in the ring.
+    while reader.available() < numBytes and numBytes <= reader.capacity:
+        reader.fill()
+    if reader.available() >= numBytes:
+        return reader.take(numBytes)
+
+    # Retrieve the rest of a large request straight from the socket.
+    parts = [reader.take(reader.available())]
+    remaining = numBytes - len(parts[0])
+    while remaining > 0:
         try:
-            data += socket.recv(numBytes - len(data))
+            data = reader.socket.recv(min(remaining, BODY_CHUNK_LEN))
         except Exception as e:
             print e.strerror
             sys.exit(1);
+        if not data:
+            print "ftclient: Connection closed by server"
+            sys.exit(1)
+        parts.append(data)
+        remaining -= len(data)
 
-    return data
+    return "".join(parts)
 
 
 # recvPack function
 #	* inputs:
-#		* sockfd -- socket to receive packet from
+#		* reader -- FrameReader of the socket to receive packet from
 #	* outputs:
 #		* pair of received <COMMAND> option and data
 #	* calls:
@@ -181,17 +400,26 @@ def recvFile(socket, numBytes):
 #				have been stripped from end of string
 #	* purpose:
 #		* receive packet from the specified socket
+#			* version 1: len (2 bytes) counts the whole packet
+#			* version 2: len (8 bytes) counts the data only
+#		* a version 2 FBODY packet's data is the file body; it is left in the
+#		reader for recvBody() and its length is returned as the data
 #
 
-def recvPack(socket):
-    # Receive the packet length.
-    packetLength = unpack(">H", recvFile(socket, 2))[0]
-
-    # Receive the tag field.
-    tag = recvFile(socket, TAG_LEN).rstrip("\0")
+def recvPack(reader):
+    # Receive the packet length and the tag field.
+    if protocolVersion == 1:
+        header = recvFile(reader, 2 + TAG_LEN)
+        dataLength = unpack(">H", header[:2])[0] - TAG_LEN - 2
+    else:
+        header = recvFile(reader, 8 + TAG_LEN)
+        dataLength = unpack(">Q", header[:8])[0]
+    tag = header[-TAG_LEN:].rstrip("\0")
 
     # Receive the encapsulated data.
-    data = recvFile(socket, packetLength - TAG_LEN - 2)
+    if protocolVersion == 2 and tag == "FBODY":
+        return tag, str(dataLength)
+    data = recvFile(reader, dataLength)
 
     return tag, data
 
@@ -199,36 +427,148 @@ def recvPack(socket):
 # controlConnection function
 #	* inputs:
 #		* control_sockfd -- socket file descriptor of control connection
+#		* controlReader -- FrameReader of the control connection
+#		* requests -- filenames to get (None for -l or -m)
 #	* outputs:
-#		* on success -- 0
-#		* on failure -- -1
+#		* number of requests sent
+#	* calls:
+#		* str()
+#		* negotiateVersion()
+#		* sendRequest()
+#	* purpose:
+#		* creates control connection; negotiates the protocol version and
+#		pipelines the first PIPELINE_DEPTH requests without waiting for replies
+#
+def controlConnection(controlSocket, controlReader, requests):
+    global protocolVersion
+
+    # Negotiate binary-safe version 2 packets (and the GET chunk size).
+    print "  Negotiating protocol version ..."
+    protocolVersion = negotiateVersion(controlSocket, controlReader)
+
+    # Send the first requests back to back; ftserver answers them in order.
+    numSent = min(PIPELINE_DEPTH, len(requests))
+    for filename in requests[:numSent]:
+        sendRequest(controlSocket, filename)
+    return numSent
+
+
+# negotiateVersion function
+#	* inputs:
+#		* controlSocket -- socket of a new control connection
+#		* controlReader -- FrameReader of the control connection
+#	* outputs:
+#		* protocol version the server accepted (1 if it did not reply VERSION)
+#	* calls:
+#		* pack()
+#		* unpack()
+#		* sendall()
+#		* recvFile()
+#	* purpose:
+#		* requests version 2 packets of the -c chunk size; the exchange is
+#		framed in version 1 explicitly, so the connections of a -j fetch can
+#		negotiate after protocolVersion has already been switched to 2
+#
+def negotiateVersion(controlSocket, controlReader):
+    data = "2 {0}".format(chunkSize or DEFAULT_CHUNK_LEN)
+    try:
+        controlSocket.sendall(pack(">H", 2 + TAG_LEN + len(data)) +
+                              "VERSION".ljust(TAG_LEN, "\0") + data)
+    except Exception as e:
+        print e.strerror
+        sys.exit(1)
+    header = recvFile(controlReader, 2 + TAG_LEN)
+    data = recvFile(controlReader, unpack(">H", header[:2])[0] - TAG_LEN - 2)
+    if header[2:].rstrip("\0") == "VERSION":
+        return int(data.split()[0])
+    return 1
+
+
+# sendRequest function
+#	* inputs:
+#		* control_sockfd -- socket file descriptor of control connection
+#		* filename -- file to get, or None for -l or -m
+#	* outputs:
+#		* None
 #	* calls:
 #		* str()
-#		* recvPack()
 #		* sendPack()
 #	* purpose:
-#		* creates control connection 
+#		* sends one request: the page of a listing (PAGE, for -n or -r), the
+#		part of a file still missing locally (RANGE, for -a), the codecs the
+#		file may be compressed with (COMPRESS, for -z), the data port (or a
+#		PASV request), then the command, without waiting for the server's
+#		reply
 #
-def controlConnection(controlSocket):
-    # Send given data port to the server.
-    print "  Transmitting data port (FTP active mode) ..."
-    outtag = "DPORT"
-    outdata = str(dataPort)
-    sendPack(controlSocket, outtag, outdata)
+def sendRequest(controlSocket, filename):
+    # Limit the listing to one page, starting after the previous one.
+    if pageSize is not None or pageCursor:
+        sendPack(controlSocket, "PAGE", "{0} {1}".format(pageSize or 0, pageCursor))
+
+    # Skip the bytes a partial copy of the file already holds.
+    if resume and os.path.exists(filename) and os.path.getsize(filename) > 0:
+        print "  Requesting file from byte {0} ...".format(os.path.getsize(filename))
+        sendPack(controlSocket, "RANGE", str(os.path.getsize(filename)))
+
+    # Let the server compress the file's chunks.
+    if compress:
+        sendPack(controlSocket, "COMPRESS", "zlib")
+
+    # Send given data port to the server, or ask it to open one.
+    if passive:
+        print "  Requesting data port (FTP passive mode) ..."
+        sendPack(controlSocket, "PASV", "")
+    else:
+        print "  Transmitting data port (FTP active mode) ..."
+        outtag = "DPORT"
+        outdata = str(dataPort)
+        sendPack(controlSocket, outtag, outdata)
 
     # Send given commandArg to the server.
     print "  Transmitting commandArg ..."
     outtag = "NULL"
     outdata = ""
-    if commandArg == "-l":
-        outtag = "LIST"
+    if commandArg == "-l" and generation is not None:
+        outtag = "DELTA"
+        outdata = generation
+    elif commandArg == "-l":
+        outtag = "LISTX" if extended else "LIST"
+        outdata = pattern
+    elif multiplex:
+        outtag = "MUX"
     elif commandArg == "-g":
-        outtag = "GET"
+        outtag = "SGET" if chunkSize is None else "GET"
         outdata = filename
     sendPack(controlSocket, outtag, outdata)
 
+
+# recvResponse function
+#	* inputs:
+#		* controlReader -- FrameReader of the control connection
+#	* outputs:
+#		* on success -- 0
+#		* on failure -- -1
+#	* calls:
+#		* int()
+#		* recvPack()
+#	* purpose:
+#		* receives the server's reply to the oldest outstanding request: the
+#		port of its data listener (passive mode), then OKAY or ERROR
+#
+def recvResponse(controlReader):
+    global dataPort
+
+    # Receive the port of the server's data listener.
+    if passive:
+        intag, indata = recvPack(controlReader)
+        if intag == "PORT":
+            dataPort = int(indata)
+        elif intag == "ERROR":
+            print "ftclient: " + indata
+            return -1
+
     # Receive the server's response.
-    intag, indata = recvPack(controlSocket)
+    intag, indata = recvPack(controlReader)
 
     # In the case of a server-side error, provide feedback for the user.
     if intag == "ERROR":
@@ -237,10 +577,44 @@ def controlConnection(controlSocket):
     return 0
 
 
+# recvBody function
+#	* inputs:
+#		* reader -- FrameReader of the socket to receive the file body from
+#		* numBytes -- length of the body announced by the FBODY packet
+#		* outfile -- file the body is written to
+#	* outputs:
+#		* None
+#	* calls:
+#		* FrameReader.take()
+#		* recv()
+#		* write()
+#	* purpose:
+#		* receive the raw file body that follows an FBODY packet (SGET);
+#		the body is not packetized, so it may contain any bytes. The part of
+#		the body already in the ring is written first.
+#
+def recvBody(reader, numBytes, outfile):
+    buffered = min(numBytes, reader.available())
+    outfile.write(reader.take(buffered))
+    numBytes -= buffered
+
+    while numBytes > 0:
+        try:
+            data = reader.socket.recv(min(numBytes, BODY_CHUNK_LEN))
+        except Exception as e:
+            print e.strerror
+            sys.exit(1)
+        if not data:
+            print "ftclient: Data connection closed during transfer"
+            sys.exit(1)
+        outfile.write(data)
+        numBytes -= len(data)
+
+
 # dataConnection function
 #	* inputs:
 #		* control_sockfd -- control connection socket
-#		* data_sockfd -- data connection socket
+#		* dataReader -- FrameReader of the data connection socket
 #	* outputs:
 #		* on success -- 0
 #		* on failure -- -1
@@ -248,15 +622,17 @@ def controlConnection(controlSocket):
 #		* os.path.exists()
 #		* open()
 #		* recvPack()
+#		* recvBody()
 #		* write()
 #		* sendPack()
 #	*purpose:
 #		* creates data connection 
-def dataConnection(controlSocket, dataSocket):
+def dataConnection(controlSocket, dataReader):
     ret = 0 # Return value
+    nextPage = None # Cursor of the listing's next page
 
     # Retrieve the first packet from the server.
-    intag, indata = recvPack(dataSocket)
+    intag, indata = recvPack(dataReader)
 
     # A list of filenames is being transferred.
     if intag == "FNAME":
@@ -264,35 +640,364 @@ def dataConnection(controlSocket, dataSocket):
 
         # Print all received filenames.
         while intag != "DONE":
-            print "  " + indata
-            intag, indata = recvPack(dataSocket)
+            if intag == "NEXT":
+                nextPage = indata
+            else:
+                print "  " + indata
+            intag, indata = recvPack(dataReader)
+
+    # The files changed since a generation are being transferred.
+    elif intag == "GEN":
+        current = indata
+        print "ftclient: Changes on \"{0}\" since generation {1}".format(s_host, generation)
+
+        # Print each change; RESET means every file follows as ADDED.
+        intag, indata = recvPack(dataReader)
+        while intag != "DONE":
+            if intag == "RESET":
+                print "  (generation unknown to the server; listing every file)"
+            else:
+                print "  {0} {1}".format(DELTA_MARKS.get(intag, "?"), indata)
+            intag, indata = recvPack(dataReader)
+        print "ftclient: Now at generation {0}; continue with -d {0}".format(current)
+
+    # No file matched the listing's pattern.
+    elif intag == "DONE" and commandArg == "-l":
+        print "ftclient: File listing on \"{0}\" (no matching files)".format(s_host)
+
+    # A list of file metadata records is being transferred.
+    elif intag == "FSTAT":
+        print "ftclient: File listing on \"{0}\"".format(s_host, s_port)
+
+        # Print every record of every FSTAT packet.
+        while intag != "DONE":
+            if intag == "NEXT":
+                nextPage = indata
+            else:
+                printRecords(indata)
+            intag, indata = recvPack(dataReader)
 
     # A file is being transferred.
     elif intag == "FILE":
         # Don't allow files to be overwritten.
         filename = indata
-        if os.path.exists(filename):
+        if os.path.exists(filename) and not resume:
            print "ftclient: File \"{0}\" already exists".format(filename)
            ret = -1
 
-        # Write the received data to file.
+        # Write the received data to file (after a partial copy with -a); an
+        # FBODY packet announces a raw body of the given length instead of
+        # FILE data packets, and ZFILE packets hold compressed chunks (-z).
         else:
-            with open(filename, "w") as outfile:
+            with open(filename, "ab" if resume else "wb") as outfile:
                 while intag != "DONE":
-                    intag, indata = recvPack(dataSocket)
-                    outfile.write(indata)
+                    intag, indata = recvPack(dataReader)
+                    if intag == "FBODY":
+                        recvBody(dataReader, int(indata), outfile)
+                    elif intag == "ZFILE":
+                        outfile.write(zlib.decompress(indata))
+                    else:
+                        outfile.write(indata)
             print "ftclient: File transfer complete"
 
     # An error occurred.
     else:
         ret = -1
 
+    # The listing stopped at the end of its page.
+    if nextPage is not None:
+        print "ftclient: More files; continue with -r {0}".format(nextPage.encode("hex"))
+
     # Acknowledge receipt of all packets.
     sendPack(controlSocket, "ACK", "")
 
     return ret
 
 
+# watchConnection function
+#	* inputs:
+#		* controlSocket -- socket of the control connection
+#		* controlReader -- FrameReader of the control connection
+#	* outputs:
+#		* None
+#	* calls:
+#		* sendPack()
+#		* recvPack()
+#	* purpose:
+#		* subscribes to directory changes (WATCH, from the -d generation if
+#		given) and prints each as it arrives: + added, ~ modified, - removed;
+#		GEN packets mark the generation the changes so far bring the client
+#		up to, and RESET means changes were missed (catch up with -d)
+#		* on an interrupt (Ctrl-C), sends UNWATCH and waits for CLOSE
+#
+def watchConnection(controlSocket, controlReader):
+    print "  Transmitting watch request ..."
+    sendPack(controlSocket, "WATCH", generation or "")
+    try:
+        while True:
+            intag, indata = recvPack(controlReader)
+            if intag == "ERROR":
+                print "ftclient: " + indata
+                return
+            elif intag == "GEN":
+                print "ftclient: At generation {0}".format(indata)
+            elif intag == "RESET":
+                print "  (changes were missed; list again with -d)"
+            else:
+                print "  {0} {1}".format(DELTA_MARKS.get(intag, "?"), indata)
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+    # Unsubscribe; changes already on their way are printed first.
+    sendPack(controlSocket, "UNWATCH", "")
+    intag, indata = recvPack(controlReader)
+    while intag != "CLOSE":
+        if intag in DELTA_MARKS:
+            print "  {0} {1}".format(DELTA_MARKS[intag], indata)
+        intag, indata = recvPack(controlReader)
+
+
+# printRecords function
+#	* inputs:
+#		* records -- data of an FSTAT packet
+#	* outputs:
+#		* None
+#	* calls:
+#		* unpack()
+#		* time.strftime()
+#	* purpose:
+#		* prints one line per LISTX record: mode (octal), size, mtime, inode
+#		and name; each record is size (8 bytes) | mtime seconds (8 bytes) |
+#		mtime nanoseconds (4 bytes) | mode (4 bytes) | inode (8 bytes) |
+#		name length (2 bytes) | name, all big-endian
+#
+def printRecords(records):
+    position = 0
+    while position < len(records):
+        size, seconds, nanoseconds, mode, inode, nameLength = unpack(
+            ">QqIIQH", records[position:position + STAT_RECORD_LEN])
+        position += STAT_RECORD_LEN
+        name = records[position:position + nameLength]
+        position += nameLength
+        print "  {0:06o} {1:>12} {2} {3:>10} {4}".format(
+            mode, size, time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(seconds)),
+            inode, name)
+
+
+# muxConnection function
+#	* inputs:
+#		* control_sockfd -- control connection socket
+#		* dataReader -- FrameReader of the multiplexed data connection
+#	* outputs:
+#		* None
+#	* calls:
+#		* sendPack()
+#		* recvPack()
+#		* unpack()
+#		* open()
+#		* write()
+#	* purpose:
+#		* requests every file with MGET <stream id> <filename>, up to
+#		MAX_STREAMS at a time, and demultiplexes the interleaved packets; each
+#		packet's data begins with its 4-byte big-endian stream ID:
+#			* MFILE -- stream started; MDATA -- next chunk of the file
+#			* MEND -- file complete; MERROR -- stream failed (its partial file is
+#			deleted)
+#
+def muxConnection(controlSocket, dataReader):
+    outfiles = {} # Open output files by stream ID
+    numSent = 0   # Number of MGET requests sent
+    numDone = 0   # Number of streams ended
+
+    while numDone < len(filenames):
+        # Keep the server supplied with streams to interleave.
+        while numSent < len(filenames) and numSent - numDone < MAX_STREAMS:
+            print "  Transmitting stream {0} request ...".format(numSent)
+            sendPack(controlSocket, "MGET", "{0} {1}".format(numSent, filenames[numSent]))
+            numSent += 1
+
+        # Route the next packet to its stream.
+        intag, indata = recvPack(dataReader)
+        streamId = unpack(">I", indata[:4])[0]
+        if intag == "MFILE":
+            outfiles[streamId] = open(filenames[streamId], "wb")
+        elif intag == "MDATA":
+            outfiles[streamId].write(buffer(indata, 4))
+        elif intag == "MEND":
+            outfiles.pop(streamId).close()
+            print "ftclient: File transfer complete ({0})".format(filenames[streamId])
+            numDone += 1
+        elif intag == "MERROR":
+            print "ftclient: {0}: {1}".format(filenames[streamId], indata[4:])
+            # A stream that failed after MFILE leaves no partial file behind.
+            if streamId in outfiles:
+                outfiles.pop(streamId).close()
+                os.remove(filenames[streamId])
+            numDone += 1
+
+
+# parallelGet function
+#	* inputs:
+#		* controlSocket -- socket of the control connection
+#		* controlReader -- FrameReader of the control connection
+#		* filename -- file to get
+#	* outputs:
+#		* on success -- 0
+#		* on failure -- -1
+#	* calls:
+#		* sendPack()
+#		* recvPack()
+#		* open()
+#		* truncate()
+#		* threading.Thread()
+#		* rangeConnection()
+#	* purpose:
+#		* asks for the file's length (SIZE), splits it into up to -j ranges
+#		of at least RANGE_MIN_LEN bytes, and fetches them at once, each over
+#		a control and data connection of its own; every range is written
+#		into place in the preallocated local file
+#
+def parallelGet(controlSocket, controlReader, filename):
+    # Ask for the file's length.
+    print "  Requesting file size ..."
+    sendPack(controlSocket, "SIZE", filename)
+    intag, indata = recvPack(controlReader)
+    if intag != "SIZE":
+        print "ftclient: {0}: {1}".format(filename, indata)
+        return -1
+    size = int(indata)
+
+    # Preallocate the file, then fetch its ranges in parallel.
+    numRanges = min(parallel, (size + RANGE_MIN_LEN - 1) // RANGE_MIN_LEN)
+    rangeLength = (size + numRanges - 1) // numRanges if numRanges > 0 else 0
+    with open(filename, "wb") as outfile:
+        outfile.truncate(size)
+    results = [-1] * numRanges
+    threads = []
+    for index in range(numRanges):
+        offset = index * rangeLength
+        thread = threading.Thread(target = rangeConnection, args = (
+            filename, offset, min(rangeLength, size - offset), results, index))
+        thread.start()
+        threads.append(thread)
+    for thread in threads:
+        thread.join()
+
+    if -1 in results:
+        print "ftclient: File transfer failed ({0})".format(filename)
+        return -1
+    print "ftclient: File transfer complete ({0}, {1} connections)".format(filename, numRanges)
+    return 0
+
+
+# rangeConnection function
+#	* inputs:
+#		* filename -- file being fetched (preallocated locally)
+#		* offset -- first byte of the range
+#		* length -- number of bytes in the range
+#		* results -- status of every range of the file
+#		* index -- this range's entry in results
+#	* outputs:
+#		* results[index] set to 0 once the whole range has been written
+#	* calls:
+#		* socket()
+#		* connect()
+#		* negotiateVersion()
+#		* sendPack()
+#		* recvPack()
+#		* recvBody()
+#		* seek()
+#		* write()
+#		* close()
+#	* purpose:
+#		* fetches one range (RANGE, COMPRESS with -z, PASV, then SGET -- or
+#		GET with -c) over a control connection of its own, and writes it at
+#		its offset through a file object of its own, so ranges never share a
+#		file position; both sockets are closed however the range ends
+#
+def rangeConnection(filename, offset, length, results, index):
+    # Establish a control connection for this range.
+    controlSocket = socket(AF_INET, SOCK_STREAM, 0)
+    try:
+        try:
+            controlSocket.connect((s_host, s_port))
+        except Exception as e:
+            print e.strerror
+            return
+        controlReader = FrameReader(controlSocket)
+        if negotiateVersion(controlSocket, controlReader) != protocolVersion:
+            print "ftclient: Protocol version mismatch"
+            return
+
+        # Request the range through a passive data connection.
+        print "  Requesting bytes {0}-{1} ...".format(offset, offset + length - 1)
+        sendPack(controlSocket, "RANGE", "{0} {1}".format(offset, length))
+        if compress:
+            sendPack(controlSocket, "COMPRESS", "zlib")
+        sendPack(controlSocket, "PASV", "")
+        sendPack(controlSocket, "SGET" if chunkSize is None else "GET", filename)
+        port = None
+        intag, indata = recvPack(controlReader)
+        if intag == "PORT":
+            port = int(indata)
+            intag, indata = recvPack(controlReader)
+        if intag == "ERROR":
+            print "ftclient: " + indata
+            return
+        if intag != "OKAY" or port is None:
+            print "ftclient: Unexpected reply from ftserver ({0})".format(intag)
+            return
+
+        # Write the range into place.
+        received = 0
+        dataSocket = socket(AF_INET, SOCK_STREAM, 0)
+        try:
+            try:
+                dataSocket.connect((s_host, port))
+            except Exception as e:
+                print e.strerror
+                return
+            dataReader = FrameReader(dataSocket)
+            intag, indata = recvPack(dataReader)
+            if intag == "FILE":
+                with open(filename, "r+b") as outfile:
+                    outfile.seek(offset)
+                    while intag != "DONE":
+                        intag, indata = recvPack(dataReader)
+                        if intag == "FBODY":
+                            recvBody(dataReader, int(indata), outfile)
+                            received += int(indata)
+                        elif intag == "ZFILE":
+                            indata = zlib.decompress(indata)
+                            outfile.write(indata)
+                            received += len(indata)
+                        elif intag == "FILE":
+                            outfile.write(indata)
+                            received += len(indata)
+        finally:
+            dataSocket.close()
+
+        # Acknowledge the transfer; report errors queued on the control connection.
+        sendPack(controlSocket, "ACK", "")
+        refused = False
+        intag, indata = recvPack(controlReader)
+        while intag != "CLOSE":
+            if intag == "ERROR":
+                print "ftclient: " + indata
+                refused = True
+            intag, indata = recvPack(controlReader)
+    finally:
+        controlSocket.close()
+    if refused:
+        return
+
+    # The file may have shrunk since its length was reported.
+    if received != length:
+        print "ftclient: {0} changed during transfer".format(filename)
+        return
+    results[index] = 0
+
 # sendPack function
 #	* inputs:
 #		* sockfd -- socket file descriptor to send from 
@@ -313,14 +1018,14 @@ def dataConnection(controlSocket, dataSocket):
 #		match the values required by the format exaclty  
 #		* sendall()
 #	* purpose:
-#		* send packet from specified socket
+#		* send packet from specified socket, framed for the negotiated version
 #
 def sendPack(socket, tag = "", data = ""):
-    # Determine packet length.
-    packetLength = 2 + TAG_LEN + len(data)
-
-    # Build packet.
-    packet = pack(">H", packetLength)
+    # Build packet header.
+    if protocolVersion == 1:
+        packet = pack(">H", 2 + TAG_LEN + len(data))
+    else:
+        packet = pack(">Q", len(data))
     packet += tag.ljust(TAG_LEN, "\0")
     packet += data
 
@@ -332,6 +1037,27 @@ def sendPack(socket, tag = "", data = ""):
         sys.exit(1)
 
 
+# printStats function
+#	* inputs:
+#		* controlSocket -- socket of the control connection
+#		* controlReader -- FrameReader of the control connection
+#	* outputs:
+#		* None
+#	* calls:
+#		* sendPack()
+#		* recvPack()
+#	* purpose:
+#		* requests the server's counters (STATS) and prints one per line
+#
+def printStats(controlSocket, controlReader):
+    sendPack(controlSocket, "STATS", "")
+    intag, indata = recvPack(controlReader)
+    if intag == "STATS":
+        print "ftclient: Server statistics"
+        for counter in indata.split():
+            print "  " + counter
+
+
 # ftp function
 #	* inputs:
 #		* global variables
@@ -339,7 +1065,12 @@ def sendPack(socket, tag = "", data = ""):
 #		* on success -- none
 #		* on failure -- exit(1) 
 #	* calls:
-#		* controlConnection(int sockfd)
+#		* FrameReader()
+#		* controlConnection(int sockfd, FrameReader reader)
+#		* recvResponse()
+#		* sendRequest()
+#		* dataConnection()
+#		* muxConnection()
 #		* bind()
 #		* list()
 #		* format()
@@ -349,7 +1080,8 @@ def sendPack(socket, tag = "", data = ""):
 #		* connect()
 #		* close()
 #	* purpose:
-#		* file transfer service between client and server
+#		* file transfer service between client and server; every requested
+#		file is fetched over the one control connection
 #
 def ftp():
     # Create client-side endpoint of FTP control connection.
@@ -368,11 +1100,30 @@ def ftp():
     print ("ftclient: FTP control connection established with " +
            "\"{0}\"".format(s_host, s_port)          )
 
-    # Communicate over the control connection.
-    status = controlConnection(controlSocket)
+    # Follow directory changes over the control connection alone.
+    if watch:
+        controlReader = FrameReader(controlSocket)
+        controlConnection(controlSocket, controlReader, [])
+        watchConnection(controlSocket, controlReader)
+        controlSocket.close()
+        print "ftclient: FTP control connection closed"
+        return
 
-    # Accept FTP data services if control session was successful.
-    if status != -1:
+    # Fetch each file in ranges over several connections at once.
+    if parallel is not None:
+        controlReader = FrameReader(controlSocket)
+        controlConnection(controlSocket, controlReader, [])
+        for filename in filenames:
+            parallelGet(controlSocket, controlReader, filename)
+        if showStats:
+            printStats(controlSocket, controlReader)
+        controlSocket.close()
+        print "ftclient: FTP control connection closed"
+        return
+
+    # Listen on the given data port once; ftserver connects to it for every
+    # request (FTP active mode).
+    if not passive:
         # Create client-side socket.
         try:
             clientSocket = socket(AF_INET, SOCK_STREAM, 0)
@@ -395,25 +1146,61 @@ def ftp():
             print e.strerror
             sys.exit(1)
 
-        # Establish FTP data connection.
-        try:
-            dataSocket = clientSocket.accept()[0]
-        except Exception as e:
-            print e.strerror
-            sys.exit(1)
-        print ("ftclient: FTP data connection established with " +
-               "\"{0}\"".format(s_host)                       )
+    # Communicate over the control connection.
+    controlReader = FrameReader(controlSocket)
+    requests = [None] if multiplex else filenames
+    numSent = controlConnection(controlSocket, controlReader, requests)
 
-        # Transfer file information over FTP data connection.
-        dataConnection(controlSocket, dataSocket)
+    # Serve the replies in request order, keeping the pipeline full.
+    for request in range(len(requests)):
+        status = recvResponse(controlReader)
+        if numSent < len(requests):
+            sendRequest(controlSocket, requests[numSent])
+            numSent += 1
 
-        # Display all queued error messages sent along control connection.
-        while True:
-            intag, indata = recvPack(controlSocket)
-            if intag == "ERROR":
-                print "ftclient: " + indata
-            if intag == "CLOSE":
-                break
+        # Connect to the server's data listener (FTP passive mode).
+        if status != -1 and passive:
+            try:
+                dataSocket = socket(AF_INET, SOCK_STREAM, 0)
+                dataSocket.connect((s_host, dataPort))
+            except Exception as e:
+                print e.strerror
+                sys.exit(1)
+
+        # Accept FTP data services if control session was successful.
+        elif status != -1:
+            # Establish FTP data connection.
+            try:
+                dataSocket = clientSocket.accept()[0]
+            except Exception as e:
+                print e.strerror
+                sys.exit(1)
+
+        if status != -1:
+            print ("ftclient: FTP data connection established with " +
+                   "\"{0}\"".format(s_host)                       )
+
+        # Receive every file over the one multiplexed data connection.
+        if status != -1 and multiplex:
+            muxConnection(controlSocket, FrameReader(dataSocket))
+            dataSocket.close()
+
+        elif status != -1:
+            # Transfer file information over FTP data connection.
+            dataConnection(controlSocket, FrameReader(dataSocket))
+            dataSocket.close()
+
+            # Display all queued error messages sent along control connection.
+            while True:
+                intag, indata = recvPack(controlReader)
+                if intag == "ERROR":
+                    print "ftclient: " + indata
+                if intag == "CLOSE":
+                    break
+
+    # Report the server's counters; STATS also acknowledges the last transfer.
+    if showStats:
+        printStats(controlSocket, controlReader)
 
     # Close FTP control connection.
     try:
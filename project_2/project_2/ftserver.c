@@ -43,549 +43,5920 @@
 #include <assert.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <netdb.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#define USAGE	"usage: ftserver [-w <workers>] [-m <cache-MiB>] [-z <variant-dir>] [-Z <variant-MiB>] <server-port>\n"
 #define c_portno_min		1024
 #define c_portno_max		65535
 #define ARG_LEN			8	//number of bytes for command line <COMMAND> argument (-l or -g)
 #define MAX_PACK_PAYLOAD_LEN	512	//max number of bytes in packet payload
+#define PACK_HEADER_LEN		(2 + ARG_LEN)	//number of bytes in packet header: packet length + tag
+#define PACK2_HEADER_LEN	(8 + ARG_LEN)	//number of bytes in version 2 packet header: data length + tag
+#define FRAME_HEADER_LEN(version)	((version) == 1 ? PACK_HEADER_LEN : PACK2_HEADER_LEN)
+#define MIN_CHUNK_LEN		4096		//smallest GET chunk a version 2 client may negotiate
+#define MAX_CHUNK_LEN		(8 << 20)	//largest GET chunk a version 2 client may negotiate
+#define DEFAULT_CHUNK_LEN	65536		//version 2 GET chunk size when the client does not name one
 
 //The backlog argument specifies the maximum number of queued connections and should be at least 0; 
-//the maximum value is system-dependent (usually 5), the minimum value is forced to 0
-#define BACKLOG		5
+//the maximum value is system-dependent (capped by net.core.somaxconn), the minimum value is forced to 0
+#define BACKLOG		128
 #define MAX_CXN_ATTEMPTS 12 // Arbitrary number of connection requests
+#define CXN_RETRY_MS	50	// Delay between data connection requests
+#define MAX_EVENTS	64	// Number of epoll events dispatched per reactor wakeup
+#define IO_BUF_LEN	65536	// Number of bytes buffered per socket before waiting for the peer (power of two)
+#define LIST_BATCH	64	// Number of FNAME packets queued per data connection wakeup
+#define STAT_BATCH	1024	// Number of entries stat()ed per LISTX data connection wakeup
+#define LIST_SCAN	4096	// Max number of snapshot names a filtered LIST examines per wakeup
+#define GLOB_SPECIAL	"*?[\\"	// Characters with a meaning in LIST patterns (fnmatch())
+#define STAT_RECORD_LEN	34	// Number of bytes in an FSTAT record before its name
+#define MAX_WORKERS	256	// Upper limit for the -w <workers> option
+#define CACHE_DEFAULT_MB	64	// Content cache budget when -m is not given
+#define MAX_CACHE_MB	(1 << 20)	// Upper limit for the -m <cache-MiB> option
+#define CACHE_ENTRY_SHARE	8	// Largest cached file: 1/CACHE_ENTRY_SHARE of the budget
+#define CACHE_ADMIT_FETCHES	2	// Fetches of a file from disk before it is read into the content cache
+#define CACHE_QUEUE_LEN	64	// Max number of files waiting to be read into the content cache
+#define CACHE_BUCKETS	4096	// Number of content cache hash buckets (power of two)
+#define FILE_CACHE_LEN	256	// Number of open served files kept for reuse
+#define MISSING_CACHE_LEN	4096	// Number of missing names remembered
+#define MAX_STATS_LEN	2048	// Max number of bytes in a STATS reply
+#define COMPRESS_LEVEL	Z_BEST_SPEED	// zlib level of compressed GET chunks
+#define COMPRESS_MIN_LEN	512	// Smallest chunk worth compressing
+#define COMPRESS_MAX_BACKOFF	64	// Max number of chunks sent as is after one that did not shrink
+#define SIDECAR_MIN_FETCHES	2	// Compressed fetches of a file before a compressed variant is made for it
+#define SIDECAR_LEVEL	Z_BEST_COMPRESSION	// zlib level of compressed variants (made once, sent many times)
+#define SIDECAR_CHUNK_LEN	65536	// Number of file bytes per packet of a compressed variant
+#define SIDECAR_QUEUE_LEN	256	// Max number of files waiting for the compressor thread
+#define SIDECAR_NAME_LEN	48	// Max number of bytes in a compressed variant's filename
+#define SIDECAR_MAGIC	"FTSIDE1"	// First bytes of every compressed variant
+#define SIDECAR_DEFAULT_MB	1024	// Variant directory budget when -Z is not given
+#define SENDFILE_CHUNK	(1 << 20)	// Max number of file bytes per sendfile() call
+#define MAX_IOV		64	// Max number of segments gathered per sendmsg() call
+#define STREAM_ID_LEN	4	// Number of bytes of stream ID leading each multiplexed packet's data
+#define MAX_STREAMS	64	// Max number of concurrent file streams on a multiplexed data connection
+#define INOTIFY_BUF_LEN	65536	// Number of bytes of inotify events read at once
+#define MAX_TOMBSTONES	65536	// Number of removed names remembered for DELTA before they are dropped
+#define WATCH_LOG_LEN	4096	// Number of recent directory changes kept for WATCH sessions
+#define WATCH_BACKLOG	(256 << 10)	// Unsent control bytes at which a WATCH session stops receiving changes
+#define DIRENT_BUF_LEN	32768	// Number of bytes of directory entries read per getdents64() call
+#define ARENA_BLOCK_LEN	(512 << 10)	// Usable bytes of a session arena block (larger requests get their own)
+#define ARENA_ALIGN	16	// Alignment of every arena allocation
+
+// Role of a socket registered with the reactor's epoll instance.
+enum endpointKind {
+	WAKEUP,     // eventfd signalled when sessions are queued for the worker
+	CONTROL,    // FTP control connection (C)
+	DATA,       // FTP data connection (D)
+	LISTENER    // Passive-mode data listener (PASV)
+};
+
+// Progress of an FTP session: DPORT|PASV -> command -> data connect|accept -> transfer -> ACK,
+// then back to DPORT|PASV for the next command until the client closes connection C
+enum sessionState {
+	AWAIT_DPORT,     // Waiting for the client's data port (or PASV request)
+	AWAIT_COMMAND,   // Waiting for the client's LIST/GET command
+	DATA_RETRY,      // Data connection refused; waiting to try again
+	DATA_CONNECT,    // Non-blocking connect() to the client in progress
+	DATA_ACCEPT,     // Waiting for the client to connect to the passive listener
+	TRANSFER,        // Streaming file information on the data connection
+	MUX,             // Data connection carries interleaved file streams requested with MGET
+	WATCHING,        // Pushing directory changes on the control connection until UNWATCH
+	AWAIT_ACK,       // Transfer queued; waiting for it to drain and for the client's ACK (or next request)
+	CLOSING,         // Flushing final control packets before closing
+	CLOSED           // Sockets closed; memory released after the current event batch
+};
+
+// Memory carved up by an arena; the header is followed by size usable bytes.
+struct arenaBlock {
+	struct arenaBlock *next;    // Previously filled block
+	size_t size;                // Number of usable bytes
+	size_t used;                // Number of bytes handed out
+	max_align_t data[];         // Usable bytes
+};
+
+// Bump allocator owning all of a session's memory: the session itself, its control ring and
+// its frame writers. Nothing is freed piecemeal; arenaRelease() returns every block at once.
+struct arena {
+	struct arenaBlock *blocks;  // Block being filled, followed by earlier ones
+	char *last;                 // Most recent allocation, which may still grow in place
+};
+
+// Process-wide arena counters, reported by the STATS command.
+struct arenaStats {
+	atomic_ullong blocks;          // Blocks malloc()ed
+	atomic_ullong freedBlocks;     // Blocks free()d
+	atomic_ullong blockBytes;      // Bytes malloc()ed for blocks
+	atomic_ullong allocations;     // arenaAlloc() and arenaGrow() calls
+	atomic_ullong grownInPlace;    // arenaGrow() calls satisfied without copying
+	atomic_ullong releases;        // Arenas released
+};
+
+// Process-wide compression counters, reported by the STATS command.
+struct compressStats {
+	atomic_ullong chunks;          // Chunks sent compressed (ZFILE)
+	atomic_ullong rawChunks;       // Chunks that did not shrink enough, sent as is
+	atomic_ullong skippedChunks;   // Chunks sent as is without trying, after ones that did not shrink
+	atomic_ullong inBytes;         // File bytes of the compressed chunks
+	atomic_ullong outBytes;        // Compressed bytes sent for them
+};
+
+// How a LIST pattern is matched; simple globs are reduced to a literal comparison.
+enum filterKind {
+	MATCH_ALL,         // "" -- every name
+	MATCH_EXACT,       // "name"
+	MATCH_PREFIX,      // "literal*"
+	MATCH_SUFFIX,      // "*literal"
+	MATCH_SUBSTRING,   // "*literal*"
+	MATCH_GLOB         // anything else, matched with fnmatch()
+};
+
+// LIST/LISTX pattern compiled once per transfer.
+struct nameFilter {
+	enum filterKind kind;
+	const char *pattern;     // Whole pattern (session->filename)
+	const char *literal;     // Literal part of the pattern
+	size_t length;           // Number of bytes in literal
+	size_t prefixLength;     // Number of literal bytes every match begins with
+};
+
+// Growable byte queue holding a socket's unsent or unparsed bytes.
+struct buffer {
+	struct arena *arena;  // Owner of bytes
+	char *bytes;        // Arena storage
+	size_t start;       // Offset of the first unconsumed byte
+	size_t end;         // Offset one past the last stored byte
+	size_t capacity;    // Number of bytes allocated
+};
+
+// Fixed-size ring of received bytes; head and tail only grow and are reduced modulo the capacity.
+struct ringBuffer {
+	char *bytes;        // Storage (capacity is a power of two)
+	size_t capacity;    // Number of bytes allocated
+	size_t head;        // Count of bytes consumed
+	size_t tail;        // Count of bytes received
+};
+
+// Queued output: a run of bytes in a frameWriter's buffer, or caller-owned bytes sent in place.
+struct segment {
+	char *bytes;        // Caller-owned bytes, or NULL for bytes within the writer's buffer
+	size_t offset;      // Offset of the bytes within the writer's buffer (bytes == NULL)
+	size_t length;      // Number of unsent bytes
+};
+
+// Outgoing packet queue of a socket: headers and small data are coalesced into one buffer,
+// larger data may be referenced in place, and sendFile() gathers it all into one sendmsg().
+struct frameWriter {
+	struct buffer buffer;       // Coalesced packet bytes
+	struct segment *segments;   // Queued segments in transmission order
+	size_t first;               // First unsent segment
+	size_t count;               // Number of queued segments
+	size_t capacity;            // Number of segments allocated
+	size_t pending;             // Number of unsent bytes
+};
+
+// Name in the directory snapshot. A removed name stays behind as a tombstone, so DELTA can
+// report the removal to clients that last looked before it.
+struct snapshotEntry {
+	char *name;
+	uint64_t created;            // Generation in which the name (re)appeared
+	uint64_t changed;            // Generation of its latest creation, modification or removal
+	int removed;                 // Flag: tombstone
+};
+
+// Directory change recorded for WATCH sessions.
+struct watchEvent {
+	uint64_t generation;         // Snapshot generation the change produced
+	char *tag;                   // ADDED, MODIFIED, REMOVED, or RESET (events were lost; rescanned)
+	char name[NAME_MAX + 1];     // Changed name ("" for RESET)
+};
+
+// In-memory listing of the served directory, shared by all workers and kept current by a
+// thread reading inotify events, so requests never rescan the directory.
+struct dirSnapshot {
+	pthread_rwlock_t lock;       // Workers read; the watch thread writes
+	struct snapshotEntry *entries; // Sorted (strcmp) names of the directory's non-directory entries
+	int numEntries;              // Number of entries, tombstones included
+	int numRemoved;              // Number of tombstones
+	int capacity;                // Number of entries allocated
+	uint64_t generation;         // Incremented on every change to entries
+	uint64_t floor;              // Oldest generation DELTA can report changes since
+	int dirFd;                   // Served directory
+	atomic_int inotifyFd;        // inotify instance watching dirFd, or -1 (LIST reads the directory); set to -1 by the watch thread if it fails
+	pthread_t thread;            // Watch thread
+	struct watchEvent *events;   // Ring of the latest WATCH_LOG_LEN changes (NULL without inotify)
+	uint64_t numEvents;          // Number of changes ever recorded in events
+	atomic_int watchers;         // Number of sessions in WATCHING
+	int *wakeFds;                // Worker eventfds signalled after changes while there are watchers
+	int numWakeFds;              // Number of entries in wakeFds
+};
+
+// Contents of a served file held in memory, shared by every worker.
+struct cacheEntry {
+	char *name;
+	char *data;                  // File contents
+	off_t size;                  // Number of bytes in data
+	ino_t inode;                 // Identity and version of the file data was read from
+	struct timespec mtime;
+	int refs;                    // Transfers using data, plus one while the entry is cached
+	struct cacheEntry *hashNext; // Next entry in the same bucket
+	struct cacheEntry *newer;    // LRU neighbour used more recently
+	struct cacheEntry *older;    // LRU neighbour used less recently
+};
+
+// Size-bounded LRU cache of small, frequently fetched files, so repeat GETs skip open(), read()
+// and close(); entries are checked against the file's inode, size and mtime on every use. Files
+// are read in by a loader thread, so no reactor waits for a whole file to be read.
+struct contentCache {
+	pthread_mutex_t lock;
+	pthread_t thread;            // Loader thread
+	pthread_cond_t queued;       // Signalled when a file is queued
+	struct openFile *jobs[CACHE_QUEUE_LEN];  // Ring of files to read in (each holds a reference)
+	int firstJob;                // Index of the oldest queued file
+	int numJobs;                 // Number of queued files
+	struct cacheEntry *buckets[CACHE_BUCKETS];  // Hash table of cached names
+	struct cacheEntry *newest;   // Head of the LRU list
+	struct cacheEntry *oldest;   // Tail of the LRU list; evicted first
+	size_t budget;               // Max number of cached bytes (-m), 0 to disable the cache
+	size_t bytes;                // Number of cached bytes
+	size_t numEntries;           // Number of cached files
+	unsigned long long hits;     // Lookups answered from memory
+	unsigned long long misses;   // Lookups that had to read the file
+	unsigned long long hitBytes; // Bytes served from memory
+	unsigned long long evictions;     // Entries dropped to make room
+	unsigned long long invalidations; // Entries dropped because the file changed
+};
+
+// Read-only descriptor of a served file, shared by every transfer of the file. Reads use
+// explicit offsets (pread(), sendfile()), so transfers never disturb each other.
+struct openFile {
+	char *name;
+	int fd;
+	ino_t inode;                 // File fd refers to
+	dev_t device;
+	off_t size;                  // Size and mtime of the file when it was opened; the descriptor
+	struct timespec mtime;       // is reopened once either changes
+	int refs;                    // Transfers using fd, plus one while the file is cached
+	int cacheFetches;            // Fetches from disk since the file was last queued for the content cache
+	int cacheQueued;             // Flag: waiting for (or being read by) the content cache's loader thread
+	int sidecarFetches;          // Compressed fetches since the file was last queued for the compressor
+	int sidecarQueued;           // Flag: waiting for (or being written by) the compressor thread
+	struct openFile *hashNext;   // Next file in the same bucket
+	struct openFile *newer;      // LRU neighbour used more recently
+	struct openFile *older;      // LRU neighbour used less recently
+};
+
+// Bounded LRU cache of open served files, so repeat fetches skip path resolution, open() and
+// close(). The watch thread evicts names that are created, deleted or renamed.
+struct fileCache {
+	pthread_mutex_t lock;
+	struct openFile *buckets[CACHE_BUCKETS];  // Hash table of open names
+	struct openFile *newest;     // Head of the LRU list
+	struct openFile *oldest;     // Tail of the LRU list; closed first
+	int numFiles;                // Number of cached files
+	unsigned long long hits;     // Acquisitions that reused a descriptor
+	unsigned long long misses;   // Acquisitions that opened the file
+	unsigned long long evictions;     // Descriptors closed to stay within FILE_CACHE_LEN
+	unsigned long long invalidations; // Descriptors dropped because the name changed
+};
+
+// Name requested although it does not exist in the served directory.
+struct missingName {
+	char *name;
+	struct missingName *hashNext;  // Next name in the same bucket
+	struct missingName *newer;     // LRU neighbour requested more recently
+	struct missingName *older;     // LRU neighbour requested less recently
+};
+
+// Bounded LRU set of missing names, so repeat requests for them are refused without a system
+// call. Kept only while inotify runs: the watch thread forgets a name as soon as it appears.
+struct missingCache {
+	pthread_mutex_t lock;
+	struct missingName *buckets[CACHE_BUCKETS];  // Hash table of missing names
+	struct missingName *newest;  // Head of the LRU list
+	struct missingName *oldest;  // Tail of the LRU list; forgotten first
+	int numNames;                // Number of remembered names
+	uint64_t epoch;              // Incremented whenever names are forgotten
+	unsigned long long hits;     // Requests refused from memory
+	unsigned long long evictions;     // Names dropped to stay within MISSING_CACHE_LEN
+	unsigned long long invalidations; // Names dropped because they appeared
+};
+
+// Header of a compressed variant; the packets a compressing GET sends follow it.
+struct sidecarHeader {
+	char magic[8];               // SIDECAR_MAGIC
+	uint64_t size;               // Length of the file when the variant was made
+	int64_t mtimeSec;            // Modification time of the file when the variant was made
+	int64_t mtimeNsec;
+	uint64_t bodyLength;         // Number of packet bytes that follow, 0 if compression does not pay
+};
+
+// Compressed variant found by a sweep of the -z directory.
+struct sidecarEntry {
+	char name[SIDECAR_NAME_LEN];
+	off_t size;
+	struct timespec used;        // Last access time; the least recently read variant goes first
+};
+
+// Compressed variants of frequently fetched files, written once by a background thread into the
+// -z directory and sent with sendfile(). A variant is named after its file's device and inode,
+// and is current only while the file keeps the size and mtime recorded in its header. It is
+// deleted with its file, or when the directory outgrows its budget.
+struct sidecarCache {
+	int dirFd;                   // Directory of the variants, or -1 (-z not given)
+	off_t budget;                // Max number of variant bytes kept (-Z)
+	off_t bytes;                 // Number of variant bytes found by the latest sweep
+	pthread_t thread;            // Compressor thread
+	pthread_mutex_t lock;
+	pthread_cond_t queued;       // Signalled when a file is queued
+	struct openFile *jobs[SIDECAR_QUEUE_LEN];  // Ring of files to compress (each holds a reference)
+	int firstJob;                // Index of the oldest queued file
+	int numJobs;                 // Number of queued files
+	unsigned long long hits;     // Transfers sent from a variant
+	unsigned long long builds;   // Variants written
+	unsigned long long incompressible; // Variants recording that compression does not pay
+	unsigned long long stale;    // Variants found older than their file
+	unsigned long long removals; // Variants deleted with their file or to stay within the budget
+};
+
+// File being sent on a multiplexed data connection; streams take turns in round-robin order.
+struct stream {
+	uint32_t id;                // Client-chosen stream ID
+	struct openFile *file;      // File being sent, or NULL (cached)
+	struct cacheEntry *cached;  // Cached contents being sent, or NULL
+	off_t offset;               // Next file byte to send
+	off_t remaining;            // Number of file bytes left to send
+	struct stream *next;        // Next stream in round-robin order (or next free stream)
+};
+
+// Socket registered with epoll; event.data.ptr points at one of these.
+struct endpoint {
+	enum endpointKind kind;
+	int socket;
+	struct session *session;    // NULL for the wakeup eventfd
+};
+
+// State of one client's FTP session.
+struct session {
+	enum sessionState state;
+	struct endpoint control;                  // Control connection C
+	struct endpoint data;                     // Data connection D (socket -1 when closed)
+	struct endpoint listener;                 // Passive-mode data listener (socket -1 when closed)
+	int passive;                              // Flag: client connects to the listener (PASV)
+	struct ringBuffer controlIn;              // Received, unparsed control bytes
+	struct frameWriter controlOut;            // Queued control packets
+	struct frameWriter dataOut;               // Queued data packets
+	int dataCorked;                           // Flag: TCP_CORK set on the data connection
+	struct sockaddr_in clientAddress;         // Client address
+	char clientIPv4[INET_ADDRSTRLEN];         // Client dotted-decimal address
+	int version;                              // Packet framing in use (1, or 2 once negotiated)
+	size_t chunkSize;                         // Max number of file bytes per GET packet
+	int dataPort;                             // Client-side data connection port
+	int connectionAttempts;                   // Number of data connection requests
+	long long retryAt;                        // Time of the next data connection request
+	char commandTag[ARG_LEN + 1];             // Buffer to store command tag
+	char filename[MAX_PACK_PAYLOAD_LEN + 1];  // Buffer to store filename
+	int transferStarted;                      // Flag: command validated, transfer under way
+	struct dirSnapshot *snapshot;             // Listing of the served directory
+	char listCursor[NAME_MAX + 1];            // Last filename examined by LIST ("" before the first)
+	int listStreamed;                         // Flag: LIST reads the directory instead of the snapshot
+	int listDirFd;                            // Directory read by a streamed LIST, or -1
+	off_t listOffset;                         // Directory offset after the last entry a streamed LIST examined
+	int pageSize;                             // Max number of names the next LIST/LISTX sends (PAGE), 0 for all
+	char pageCursor[NAME_MAX + 2];            // Position the next LIST/LISTX resumes from (PAGE), "" for the start
+	int pageRemaining;                        // Number of names the current page may still send, -1 for all
+	int listing;                              // Flag: LIST, LISTX or DELTA transfer
+	int listRecords;                          // Flag: LISTX; entries are packed into FSTAT records
+	char *listTag;                            // Tag of each listed name: FNAME, or ADDED for a DELTA reset
+	int listDelta;                            // Flag: DELTA sends only names changed since deltaSince
+	uint64_t deltaSince;                      // Generation the DELTA client last listed
+	uint64_t watchNext;                       // Index of the next change to send (WATCH)
+	struct nameFilter filter;                 // Names LIST/LISTX send
+	char *recordFrame;                        // Data of the FSTAT packet being filled, or NULL
+	size_t recordBytes;                       // Number of record bytes in recordFrame
+	struct openFile *file;                    // File being sent (GET/SGET), or NULL
+	struct cacheEntry *cached;                // Cached file being sent (GET/SGET), or NULL
+	off_t rangeOffset;                        // First file byte the next GET/SGET sends (RANGE), -1 if invalid
+	off_t rangeLength;                        // Max number of bytes the next GET/SGET sends (RANGE), -1 for all
+	off_t fileOffset;                         // Next file byte to send in a GET packet
+	off_t fileRemaining;                      // Number of file bytes the GET/SGET still sends
+	int compressOffered;                      // Flag: the client accepts zlib chunks in the next GET/SGET (COMPRESS)
+	int compressing;                          // Flag: the GET/SGET in progress sends chunks that shrink as ZFILE
+	int compressSkip;                         // Number of chunks still sent as is without trying compression
+	int compressBackoff;                      // Number of chunks skipped after the last one that did not shrink
+	char *compressBuffer;                     // Compressed chunk, or NULL before the first compression
+	size_t compressBufferSize;                // Number of bytes allocated for compressBuffer
+	int sidecarFd;                            // Compressed variant being sent (GET/SGET), or -1
+	off_t bodyOffset;                         // Next file byte to send with sendfile()
+	off_t bodyRemaining;                      // Number of file bytes left to send with sendfile()
+	struct stream *streams;                   // Multiplexed streams; the head sends next (MUX)
+	struct stream *lastStream;                // Tail of the round-robin queue
+	int numStreams;                           // Number of queued streams
+	struct stream *freeStreams;               // Finished streams kept for reuse
+	struct arena arena;                       // Owner of the session's memory, including the session
+	struct session *prev, *next;              // Reactor session list
+};
+
+// epoll event loop shared by all sessions of one worker thread.
+struct reactor {
+	int epollFd;                 // epoll instance
+	struct endpoint wakeup;      // eventfd signalled by the acceptor
+	struct session *sessions;    // Active sessions
+	struct session *closed;      // Sessions to free after the current event batch
+	struct dirSnapshot *snapshot; // Listing of the served directory
+	int retrying;                // Number of sessions in DATA_RETRY
+	int watching;                // Number of sessions in WATCHING
+	int changed;                 // Flag: woken since the last pushChanges(); the directory may have changed
+};
+
+// Accepted control connection waiting to be adopted by a worker.
+struct pendingSession {
+	int socket;                          // Control connection
+	struct sockaddr_in clientAddress;    // Client address
+};
+
+// Per-worker double-ended queue of accepted control connections.
+// The owner pops the newest entry from the bottom; thieves take the oldest from the top.
+struct sessionDeque {
+	pthread_mutex_t lock;
+	struct pendingSession *items;    // Ring storage
+	size_t top;                      // Index of the oldest entry
+	size_t count;                    // Number of queued entries
+	size_t capacity;                 // Number of entries allocated
+};
+
+// Thread running its own reactor over the sessions it has adopted.
+struct worker {
+	int id;                          // Index within the pool
+	pthread_t thread;
+	struct reactor reactor;          // Event loop for this worker's sessions
+	struct sessionDeque queue;       // Sessions waiting to be adopted
+	atomic_int busy;                 // Flag: dispatching events (not waiting in epoll_wait)
+	struct pool *pool;               // Pool to steal from
+};
+
+// Fixed set of workers sharing the accepted control connections.
+struct pool {
+	struct worker *workers;
+	int numWorkers;
+	unsigned int nextWorker;         // Round-robin placement of new sessions
+};
+
+struct arenaStats arenaStats;    // Allocator counters of all sessions
+struct compressStats compressStats; // Compression counters of all sessions
+struct contentCache contentCache; // Hot files shared by all sessions
+struct fileCache fileCache;      // Open files shared by all sessions
+struct missingCache missingCache; // Missing names shared by all sessions
+struct sidecarCache sidecarCache; // Compressed variants shared by all sessions
 
 void intSigHandler(int sig);
 int checkPortArgInt(char *str, int *n);
-char **listFiles(char *dirname, int *numFiles);
-void recvFile(int socket, void *buffer, int size);
-void recvPack(int socket, char *tag, char *data);
-int controlConnection(int controlSocket, char *commandTag, int *dataPort, char* filename);
-int dataConnection(int controlSocket, int dataSocket, char *commandTag, char *filename);
-void sendFile(int socket, void *buffer, int numBytes);
-void sendPack(int socket, char *tag, char *data);
-void ftp(int port);
+int listableEntry(int dirFd, struct dirent64 *entry);
+char **listFiles(int dirFd, int *numFiles);
+int compareNames(const void *a, const void *b);
+void snapshotLoad(struct dirSnapshot *snapshot);
+int snapshotSearch(struct dirSnapshot *snapshot, const char *name, int *found);
+void snapshotInsert(struct dirSnapshot *snapshot, const char *name);
+void snapshotModify(struct dirSnapshot *snapshot, const char *name);
+void snapshotRemove(struct dirSnapshot *snapshot, const char *name);
+void snapshotPrune(struct dirSnapshot *snapshot);
+void snapshotInit(struct dirSnapshot *snapshot);
+void *watchMain(void *arg);
+void snapshotLog(struct dirSnapshot *snapshot, char *tag, const char *name);
+void notifyWatchers(struct dirSnapshot *snapshot);
+void compileFilter(struct nameFilter *filter, const char *pattern);
+int containsLiteral(const char *name, size_t nameLength, const char *literal, size_t length);
+int nameMatches(struct nameFilter *filter, const char *name);
+void setPage(struct session *session, char *request);
+void setRange(struct session *session, char *request);
+void setCompress(struct session *session, char *request);
+size_t compressChunk(struct session *session, const char *chunk, size_t numBytes);
+int startRange(struct session *session, off_t size);
+int startList(struct session *session);
+void startDelta(struct session *session);
+void sendNextPage(struct session *session);
+char *entryTag(struct session *session, struct snapshotEntry *entry);
+int snapshotList(struct session *session);
+int streamList(struct session *session);
+void listEntry(struct session *session, int dirFd, const char *name, char *tag);
+void flushRecords(struct session *session);
+int openServedFile(struct dirSnapshot *snapshot, const char *name, struct stat *info);
+void cacheInit(size_t budget);
+size_t cacheBucket(const char *name);
+void cacheUnlink(struct cacheEntry *entry);
+void cacheDrop(struct cacheEntry *entry);
+void cacheRelease(struct cacheEntry *entry);
+struct cacheEntry *cacheLoad(struct openFile *file);
+void cacheInsert(struct cacheEntry *loaded);
+struct cacheEntry *cacheLookup(struct dirSnapshot *snapshot, const char *name);
+void cacheRequest(struct openFile *file, off_t size);
+void *cacheMain(void *arg);
+void fileCacheUnlink(struct openFile *file);
+void fileCacheDrop(struct openFile *file);
+struct openFile *fileCacheAcquire(struct dirSnapshot *snapshot, const char *name, struct stat *info);
+void fileCacheRelease(struct openFile *file);
+void fileCacheEvict(const char *name);
+void missingUnlink(struct missingName *missing);
+int missingLookup(struct dirSnapshot *snapshot, const char *name);
+void missingRecord(struct dirSnapshot *snapshot, const char *name, uint64_t epoch);
+void missingForget(const char *name);
+void sidecarInit(const char *path, off_t budget);
+void sidecarName(const struct stat *info, const char *suffix, char *name);
+int sidecarOpen(const struct stat *info, off_t *bodyLength);
+void sidecarRequest(struct openFile *file);
+void sidecarForget(const struct stat *info);
+int compareVariants(const void *a, const void *b);
+void sidecarSweep(void);
+void sidecarFrameHeader(char *header, char *tag, uint64_t dataLength);
+int sidecarWrite(int fd, const char *bytes, size_t numBytes, off_t offset);
+void sidecarBuild(struct openFile *file, char *chunk, char *packet);
+void *sidecarMain(void *arg);
+long long monotonicMs();
+void *arenaAlloc(struct arena *arena, size_t numBytes);
+void *arenaGrow(struct arena *arena, void *bytes, size_t oldBytes, size_t numBytes);
+void arenaRelease(struct arena *arena);
+void sendStats(struct session *session);
+void sendSize(struct session *session, char *filename);
+void bufferReserve(struct buffer *buffer, size_t numBytes);
+void ringPeek(struct ringBuffer *ring, size_t offset, void *dest, size_t numBytes);
+int recvFile(int socket, struct ringBuffer *ring);
+int recvPack(struct ringBuffer *ring, int version, char *tag, char *data);
+char *writerReserve(struct frameWriter *writer, size_t numBytes);
+void writerQueue(struct frameWriter *writer, char *bytes, size_t offset, size_t numBytes);
+void writerCommit(struct frameWriter *writer, size_t numBytes);
+void writerReset(struct frameWriter *writer);
+int sendFile(int socket, struct frameWriter *writer, int flags);
+void sendFrameHeader(struct session *session, struct frameWriter *writer, char *tag, uint64_t dataLength);
+void sendFrame(struct session *session, struct frameWriter *writer, char *tag, char *data, size_t dataLength);
+void sendFrameRef(struct session *session, struct frameWriter *writer, char *tag, char *data, size_t dataLength);
+void sendPack(struct session *session, struct frameWriter *writer, char *tag, char *data);
+void negotiateVersion(struct session *session, char *request);
+void updateEvents(struct reactor *reactor, struct session *session);
+struct session *openSession(struct reactor *reactor, int controlSocket, struct sockaddr_in *clientAddress);
+void releaseStreams(struct session *session);
+void setCork(int socket, int enable);
+void closeDataConnection(struct session *session);
+void closeSession(struct reactor *reactor, struct session *session);
+void openDataConnection(struct reactor *reactor, struct session *session);
+void retryDataConnection(struct reactor *reactor, struct session *session);
+int openPassiveListener(struct reactor *reactor, struct session *session);
+void acceptDataConnection(struct reactor *reactor, struct session *session);
+void beginTransfer(struct session *session);
+int controlConnection(struct reactor *reactor, struct session *session);
+void clearModifiers(struct session *session);
+int finishTransfer(struct session *session);
+int startBody(struct session *session);
+int startSidecar(struct session *session, struct stat *info);
+int sendBody(struct session *session);
+int transferData(struct session *session);
+int dataConnection(struct session *session);
+void sendStreamHeader(struct session *session, char *tag, uint32_t id, size_t dataLength);
+void sendStreamFrame(struct session *session, char *tag, uint32_t id, char *data);
+void openStream(struct session *session, char *request);
+void muxConnection(struct session *session);
+void startWatch(struct reactor *reactor, struct session *session, char *request);
+void stopWatch(struct reactor *reactor, struct session *session);
+void sendChanges(struct session *session);
+void handleEvent(struct reactor *reactor, struct endpoint *endpoint, unsigned int events);
+void retryDueSessions(struct reactor *reactor);
+void pushChanges(struct reactor *reactor);
+void dequePush(struct sessionDeque *deque, struct pendingSession *pending);
+int dequePop(struct sessionDeque *deque, struct pendingSession *pending);
+int dequeSteal(struct sessionDeque *deque, struct pendingSession *stolen, int maxItems);
+void wakeWorker(struct worker *worker);
+void scheduleSession(struct pool *pool, struct pendingSession *pending);
+void adoptSessions(struct worker *worker);
+void *workerMain(void *arg);
+void ftp(int port, int numWorkers);
+
+int main(int argc, char **argv)
+{
+	int port;  // Port number on which to listen for client connections.
+	int numWorkers;  // Number of worker threads serving sessions
+	int option;      // Current command-line option
+	int cacheMiB = CACHE_DEFAULT_MB;  // Content cache budget
+	char *sidecarPath = NULL;         // Directory of compressed variants, or NULL for none
+	int sidecarMiB = SIDECAR_DEFAULT_MB;  // Variant directory budget
+
+	// Default to one worker per online processor.
+	numWorkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numWorkers < 1) {
+		numWorkers = 1;
+	}
+
+	// Parse command-line options.
+	while ((option = getopt(argc, argv, "w:m:z:Z:")) != -1) {
+		switch (option) {
+		case 'w':
+			if (!checkPortArgInt(optarg, &numWorkers) || numWorkers < 1 || numWorkers > MAX_WORKERS) {
+				fprintf(stderr, "ftserver: Number of workers must be an integer in the range [1, %d]\n", MAX_WORKERS);
+				exit(1);
+			}
+			break;
+		case 'm':
+			if (!checkPortArgInt(optarg, &cacheMiB) || cacheMiB < 0 || cacheMiB > MAX_CACHE_MB) {
+				fprintf(stderr, "ftserver: Cache size must be an integer in the range [0, %d] (MiB)\n", MAX_CACHE_MB);
+				exit(1);
+			}
+			break;
+		case 'z':
+			sidecarPath = optarg;
+			break;
+		case 'Z':
+			if (!checkPortArgInt(optarg, &sidecarMiB) || sidecarMiB < 1 || sidecarMiB > MAX_CACHE_MB) {
+				fprintf(stderr, "ftserver: Variant directory size must be an integer in the range [1, %d] (MiB)\n", MAX_CACHE_MB);
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, USAGE);
+			exit(1);
+		}
+	}
+
+	// Exactly one positional argument (the port) is expected.
+	if (argc - optind != 1) {
+		fprintf(stderr, USAGE);
+		exit(1);
+	}
+
+	// The given port number must be an integer.
+	if (!checkPortArgInt(argv[optind], &port)) {
+		fprintf(stderr, "ftserver: Port number must be an integer\n");
+		exit(1);
+	}
+
+	// The given port number must be in the range [c_portno_min, c_portno_max].
+	if (port < c_portno_min || port > c_portno_max) {
+		fprintf(stderr, "ftserver: Port number must be in the range [1024, 65535]\n");
+		exit(1);
+	}
+
+	// Run the FTP server until an interrupt signal is detected.
+	cacheInit((size_t) cacheMiB << 20);
+	pthread_mutex_init(&fileCache.lock, NULL);
+	pthread_mutex_init(&missingCache.lock, NULL);
+	sidecarInit(sidecarPath, (off_t) sidecarMiB << 20);
+	ftp(port, numWorkers);
+
+	exit(0);
+}
+
+/* void intSigHandler(int signal)
+        * inputs:
+                * int signal -- holds the signal number/id
+        * outputs:
+                * on success -- void -- restore signal handling to default behavior; send an interrup signal to force default behavior
+                * on failure -- perrer(<error_message>) exit(1)
+        * calls:
+		* sigaction(int signo, struct sigaction* newaction, struct sigaction* origaction)
+		* raise(int signal)
+        * purpose:
+		* callback function
+		* displays feedback before terminating ftserver program due to interrupt signal
+		* restore signal handling to default action; send an interrup signal to force default action
+			* via setting *sa_handler = SIG_DFL which directs handler to take default action
+
+*/
+void intSigHandler(int sig)
+{
+	int status;                   // Return status
+	struct sigaction interrupt;   // Signal action for handling interrupt
+
+	// Provide feedback to the user.
+	printf("\nftserver closed\n");
+
+	//restore signal (interrupt) handling to default action via SIG_DFL
+	interrupt.sa_handler = SIG_DFL;
+	status = sigaction(SIGINT, &interrupt, 0);
+	if (status == -1) {
+		perror("sigaction");
+		exit(1);
+	}
+
+	//send an interrupt signal to force default action -- to be acted on by the newly set default action for this signal
+	status = raise(SIGINT);
+	if (status == -1) {
+		perror("raise");
+		exit(1);
+	}
+}
+
+
+/* int checkPortArgInt function: 
+	* inputs:
+		* char* portArg -- holds the <SERVER_PORT> argument from command line
+		* int* s_portno -- pointer to variable that holds <SERVER_PORT> arugment from command line upon conversion to integer
+	* outputs:
+		* returns 1 if portArg is an integer; returns 0 if portArg is not an integer
+	* purpose:
+		* to ensure that the command line argument, portArg, is an integer and therefore can be assigned to the server socket
+*/
+int checkPortArgInt(char *str, int *n)
+{
+	// this var holds a potential trailing non-whitespace char
+	char c;
+
+	// sscanf returns the number of variables filled; in case of input failure before any data could be successfully read, EOF is returned
+	// in this case, if portno argument is an integer value 1 is returned (1 int variable filled) else 0 returned (0 variables filled)
+	int matches = sscanf(str, "%d %c", n, &c);
+
+	// A string representation of an integer will result in only one match.
+	return matches == 1;
+}
+
+
+/* int listableEntry(int dirFd, struct dirent64* entry)
+	* inputs:
+		* int dirFd -- directory containing the entry
+		* struct dirent64* entry -- entry returned by getdents64()
+	* outputs:
+		* 1 if the entry belongs in a file listing, 0 if it is a directory
+	* calls:
+		* int fstatat(int dirfd, const char* pathname, struct stat* buf, int flags)
+			* like stat(), with pathname relative to the directory dirfd
+		* S_ISDIR(mode_t m)
+			* MACRO returns non-zero if the file is a directory
+	* purpose:
+		* the entry's d_type settles most entries without a stat(); only symbolic links (which
+		are followed, so links to directories are skipped too) and filesystems that report
+		DT_UNKNOWN need fstatat(); entries that cannot be stat()ed are listed
+*/
+int listableEntry(int dirFd, struct dirent64 *entry)
+{
+	struct stat info;  // Information concerning the entry
+
+	if (entry->d_type == DT_DIR) {
+		return 0;
+	}
+	if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+		return 1;
+	}
+	return fstatat(dirFd, entry->d_name, &info, 0) == -1 || !S_ISDIR(info.st_mode);
+}
+
+
+/* char** listFiles(int dirFd, int* numFiles)
+	* inputs:
+		* int dirFd -- open directory to scan
+		* int* numFiles -- number of files in the directory
+	* outputs:
+		* char* array of filenames of the directory
+	* calls:
+		* int openat(int dirfd, const char* pathname, int flags)
+			* opens "." relative to dirFd: a new descriptor with its own directory offset
+		* ssize_t getdents64(int fd, void* dirp, size_t count)
+			* fills dirp with as many directory entries as fit; returns the number of bytes
+			read, 0 at the end of the directory, -1 and errno set on error
+		* listableEntry()
+	* purpose:
+		* lists all files in the specified directory, reading DIRENT_BUF_LEN bytes of entries
+		per system call; the array grows geometrically so building it stays O(n)
+*/
+char ** listFiles(int dirFd, int *numFiles)
+{
+	char **fileList = NULL;  // Return value
+	int capacity = 0;        // Number of entries allocated in fileList
+	char entries[DIRENT_BUF_LEN] __attribute__((aligned(__alignof__(struct dirent64))));
+	struct dirent64 *entry;  // Entry within a directory
+	ssize_t length;          // Number of entry bytes read
+	char *position;          // Next entry within entries
+	int scanFd;              // Descriptor being read
+
+	// Open the given directory.
+	scanFd = openat(dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (scanFd == -1) {
+		perror("ftserver: unable to open the served directory");
+		exit(1);
+	}
+
+	// Build a list of filenames in the given directory.
+	*numFiles = 0;
+	while ((length = getdents64(scanFd, entries, sizeof(entries))) > 0) {
+		for (position = entries; position < entries + length; position += entry->d_reclen) {
+			entry = (struct dirent64 *) position;
+
+			// Skip subdirectories.
+			if (!listableEntry(dirFd, entry)) {
+				continue;
+			}
+
+			// Append current filename to the list.
+			if (*numFiles == capacity) {
+				capacity = capacity > 0 ? capacity * 2 : 64;
+				fileList = realloc(fileList, capacity * sizeof(char *));
+				assert(fileList != NULL); // realloc() failure check
+			}
+			fileList[*numFiles] = strdup(entry->d_name);
+			assert(fileList[*numFiles] != NULL); // strdup() failure check
+			(*numFiles)++;
+		}
+	}
+	if (length == -1) {
+		perror("getdents64");
+	}
+
+	// Cleanup.
+	close(scanFd);
+
+	return fileList;
+}
+
+
+/* int compareNames(const void* a, const void* b)
+	* inputs:
+		* const void* a, b -- pointers to char* filenames
+	* outputs:
+		* strcmp() order of the filenames
+	* purpose:
+		* qsort() comparator keeping the directory snapshot sorted
+*/
+int compareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+
+/* void snapshotLoad(struct dirSnapshot* snapshot)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot to rebuild (write lock held, or not yet shared)
+	* outputs:
+		* snapshot->entries replaced by a sorted scan of the current directory; generation and
+		floor advanced
+	* calls:
+		* listFiles(), qsort()
+	* purpose:
+		* full scan at startup and after an inotify queue overflow; changes may have been missed,
+		so tombstones are dropped and DELTA clients must start over (floor)
+*/
+void snapshotLoad(struct dirSnapshot *snapshot)
+{
+	char **names;   // Names found by the scan
+	int numNames;   // Number of names
+	int i;          //for loop iterator
+
+	for (i = 0; i < snapshot->numEntries; i++) {
+		free(snapshot->entries[i].name);
+	}
+	free(snapshot->entries);
+
+	names = listFiles(snapshot->dirFd, &numNames);
+	if (numNames > 1) {
+		qsort(names, numNames, sizeof(char *), compareNames);
+	}
+	snapshot->generation++;
+	snapshot->floor = snapshot->generation;
+	snapshotLog(snapshot, "RESET", "");
+
+	snapshot->entries = malloc((numNames > 0 ? numNames : 1) * sizeof(struct snapshotEntry));
+	assert(snapshot->entries != NULL); // malloc() failure check
+	for (i = 0; i < numNames; i++) {
+		snapshot->entries[i].name = names[i];
+		snapshot->entries[i].created = snapshot->entries[i].changed = snapshot->generation;
+		snapshot->entries[i].removed = 0;
+	}
+	free(names);
+	snapshot->numEntries = snapshot->capacity = numNames;
+	snapshot->numRemoved = 0;
+}
+
+
+/* int snapshotSearch(struct dirSnapshot* snapshot, const char* name, int* found)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot to search (lock held)
+		* const char* name -- filename to look up
+		* int* found -- set to 1 if name is in the snapshot (possibly as a tombstone), 0 otherwise
+	* outputs:
+		* index of name, or of the first name after it
+	* purpose:
+		* binary search of the sorted names: O(log n) lookups, inserts and LIST resumption
+*/
+int snapshotSearch(struct dirSnapshot *snapshot, const char *name, int *found)
+{
+	int low = 0;                       // First candidate index
+	int high = snapshot->numEntries;   // One past the last candidate index
+	int middle;                        // Index being compared
+	int order;                         // strcmp() result
+
+	*found = 0;
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		order = strcmp(snapshot->entries[middle].name, name);
+		if (order == 0) {
+			*found = 1;
+			return middle;
+		}
+		if (order < 0) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+
+/* void snapshotInsert(struct dirSnapshot* snapshot, const char* name)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot to update (write lock held)
+		* const char* name -- filename created in (or moved into) the directory
+	* outputs:
+		* name stored in sorted position (or its tombstone revived); generation advanced and the
+		change logged for WATCH sessions
+	* calls:
+		* snapshotSearch(), realloc(), strdup(), snapshotLog()
+	* purpose:
+		* a name moved over an existing file replaces it, which counts as a modification
+*/
+void snapshotInsert(struct dirSnapshot *snapshot, const char *name)
+{
+	struct snapshotEntry *entry;  // Entry for name
+	int index;                    // Sorted position of name
+	int found;                    // Flag: name already present
+
+	index = snapshotSearch(snapshot, name, &found);
+	if (found) {
+		entry = &snapshot->entries[index];
+		entry->changed = ++snapshot->generation;
+		if (entry->removed) {
+			entry->removed = 0;
+			entry->created = entry->changed;
+			snapshot->numRemoved--;
+		}
+		snapshotLog(snapshot, entry->created == entry->changed ? "ADDED" : "MODIFIED", name);
+		return;
+	}
+
+	if (snapshot->numEntries == snapshot->capacity) {
+		snapshot->capacity = snapshot->capacity > 0 ? snapshot->capacity * 2 : 64;
+		snapshot->entries = realloc(snapshot->entries, snapshot->capacity * sizeof(struct snapshotEntry));
+		assert(snapshot->entries != NULL); // realloc() failure check
+	}
+	memmove(&snapshot->entries[index + 1], &snapshot->entries[index],
+	        (snapshot->numEntries - index) * sizeof(struct snapshotEntry));
+	entry = &snapshot->entries[index];
+	entry->name = strdup(name);
+	assert(entry->name != NULL); // strdup() failure check
+	entry->created = entry->changed = ++snapshot->generation;
+	entry->removed = 0;
+	snapshot->numEntries++;
+	snapshotLog(snapshot, "ADDED", name);
+}
+
+
+/* void snapshotModify(struct dirSnapshot* snapshot, const char* name)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot to update (write lock held)
+		* const char* name -- file that was written to and closed
+	* outputs:
+		* the name's change generation advanced and the change logged
+	* calls:
+		* snapshotSearch(), snapshotLog()
+*/
+void snapshotModify(struct dirSnapshot *snapshot, const char *name)
+{
+	int index;  // Position of name
+	int found;  // Flag: name present
+
+	index = snapshotSearch(snapshot, name, &found);
+	if (found && !snapshot->entries[index].removed) {
+		snapshot->entries[index].changed = ++snapshot->generation;
+		snapshotLog(snapshot, "MODIFIED", name);
+	}
+}
+
+
+/* void snapshotRemove(struct dirSnapshot* snapshot, const char* name)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot to update (write lock held)
+		* const char* name -- filename deleted from (or moved out of) the directory
+	* outputs:
+		* name turned into a tombstone; generation advanced and the change logged
+	* calls:
+		* snapshotSearch(), snapshotLog(), snapshotPrune()
+*/
+void snapshotRemove(struct dirSnapshot *snapshot, const char *name)
+{
+	int index;  // Position of name
+	int found;  // Flag: name present
+
+	index = snapshotSearch(snapshot, name, &found);
+	if (!found || snapshot->entries[index].removed) {
+		return;
+	}
+
+	snapshot->entries[index].removed = 1;
+	snapshot->entries[index].changed = ++snapshot->generation;
+	snapshot->numRemoved++;
+	snapshotLog(snapshot, "REMOVED", name);
+	if (snapshot->numRemoved > MAX_TOMBSTONES) {
+		snapshotPrune(snapshot);
+	}
+}
+
+
+/* void snapshotPrune(struct dirSnapshot* snapshot)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot to compact (write lock held)
+	* outputs:
+		* every tombstone freed; floor raised to the current generation
+	* purpose:
+		* bounds the memory held by removed names; DELTA clients that last looked before now
+		receive the whole listing again
+*/
+void snapshotPrune(struct dirSnapshot *snapshot)
+{
+	int from;     // Entry being examined
+	int to = 0;   // Number of entries kept
+
+	for (from = 0; from < snapshot->numEntries; from++) {
+		if (snapshot->entries[from].removed) {
+			free(snapshot->entries[from].name);
+		} else {
+			snapshot->entries[to++] = snapshot->entries[from];
+		}
+	}
+	snapshot->numEntries = to;
+	snapshot->numRemoved = 0;
+	snapshot->floor = snapshot->generation;
+}
+
+
+/* void snapshotInit(struct dirSnapshot* snapshot)
+	* inputs:
+		* struct dirSnapshot* snapshot -- zeroed snapshot
+	* outputs:
+		* snapshot of the current directory loaded, and a watch thread keeping it current
+	* calls:
+		* open(), inotify_init1(), inotify_add_watch(), snapshotLoad(), pthread_create()
+	* purpose:
+		* the watch is added before the initial scan so no change can fall between them; when
+		inotify is unavailable there is no snapshot to load, and LIST reads the directory itself
+*/
+void snapshotInit(struct dirSnapshot *snapshot)
+{
+	int status;     // Return status
+	int inotifyFd;  // inotify instance, or -1
+
+	pthread_rwlock_init(&snapshot->lock, NULL);
+	snapshot->dirFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (snapshot->dirFd == -1) {
+		perror("open");
+		exit(1);
+	}
+
+	inotifyFd = inotify_init1(IN_CLOEXEC);
+	if (inotifyFd != -1 &&
+	    inotify_add_watch(inotifyFd, ".", IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+	                      IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR) == -1) {
+		close(inotifyFd);
+		inotifyFd = -1;
+	}
+	atomic_init(&snapshot->inotifyFd, inotifyFd);
+	if (inotifyFd == -1) {
+		perror("ftserver: inotify unavailable; reading the directory per LIST");
+	}
+
+	if (inotifyFd != -1) {
+		// Generations count from the start time, so those handed out by an earlier run are older
+		// than this run's floor.
+		snapshot->generation = (uint64_t) time(NULL) << 24;
+		snapshotLoad(snapshot);
+		snapshot->events = malloc(WATCH_LOG_LEN * sizeof(struct watchEvent));
+		assert(snapshot->events != NULL); // malloc() failure check
+		status = pthread_create(&snapshot->thread, NULL, watchMain, snapshot);
+		if (status != 0) {
+			fprintf(stderr, "ftserver: pthread_create: %s\n", strerror(status));
+			exit(1);
+		}
+	}
+}
+
+
+/* void* watchMain(void* arg)
+	* inputs:
+		* void* arg -- struct dirSnapshot* to keep current
+	* outputs:
+		* runs until the inotify instance fails
+	* calls:
+		* read(), fstatat(), snapshotInsert(), snapshotModify(), snapshotRemove(), snapshotLoad(),
+		fileCacheEvict(), missingForget(), notifyWatchers()
+	* purpose:
+		* applies each batch of directory events under one write lock, then wakes the workers of
+		any WATCH sessions:
+			* IN_CREATE, IN_MOVED_TO -- add the name (unless it is, or links to, a directory)
+			* IN_CLOSE_WRITE -- the file was written to; advance its change generation
+			* IN_DELETE, IN_MOVED_FROM -- remove the name
+			* IN_Q_OVERFLOW -- events were lost; rescan
+		* names created, deleted or renamed lose their cached descriptor, and names that appear
+		are no longer known to be missing (all of them after IN_Q_OVERFLOW)
+*/
+void *watchMain(void *arg)
+{
+	struct dirSnapshot *snapshot = arg;  // Snapshot to keep current
+	int inotifyFd = atomic_load(&snapshot->inotifyFd); // inotify instance read by this thread
+	char events[INOTIFY_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;         // Event being applied
+	struct stat info;                    // Information concerning a new entry
+	ssize_t length;                      // Number of event bytes read
+	char *position;                      // Next event within events
+
+	while (1) {
+		length = read(inotifyFd, events, sizeof(events));
+		if (length == -1 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			perror("read");
+			break;
+		}
+
+		pthread_rwlock_wrlock(&snapshot->lock);
+		for (position = events; position < events + length;
+		     position += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *) position;
+
+			if (event->mask & IN_Q_OVERFLOW) {
+				snapshotLoad(snapshot);
+				fileCacheEvict(NULL);
+				missingForget(NULL);
+				continue;
+			}
+			if (event->len == 0 || (event->mask & IN_ISDIR)) {
+				continue;
+			}
+
+			// The name now refers to another file, or to none; its cached descriptor is stale.
+			if (event->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)) {
+				fileCacheEvict(event->name);
+			}
+
+			if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+				missingForget(event->name);
+
+				// Like listFiles(), follow symbolic links when skipping directories.
+				if (fstatat(snapshot->dirFd, event->name, &info, 0) == 0 && S_ISDIR(info.st_mode)) {
+					continue;
+				}
+				snapshotInsert(snapshot, event->name);
+			}
+			else if (event->mask & IN_CLOSE_WRITE) {
+				snapshotModify(snapshot, event->name);
+			}
+			else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				snapshotRemove(snapshot, event->name);
+			}
+		}
+		pthread_rwlock_unlock(&snapshot->lock);
+		notifyWatchers(snapshot);
+	}
+
+	// Without events the snapshot can no longer be trusted; fall back to rescanning.
+	atomic_store(&snapshot->inotifyFd, -1);
+	close(inotifyFd);
+	missingForget(NULL);
+	return NULL;
+}
+
+
+/* void snapshotLog(struct dirSnapshot* snapshot, char* tag, const char* name)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot just changed (write lock held)
+		* char* tag -- ADDED, MODIFIED, REMOVED or RESET
+		* const char* name -- changed name
+	* outputs:
+		* change stored in the event ring under the current generation
+	* purpose:
+		* every generation a change produces is logged exactly once, so a WATCH session can tell
+		from a generation alone whether the ring still holds every change since it
+*/
+void snapshotLog(struct dirSnapshot *snapshot, char *tag, const char *name)
+{
+	struct watchEvent *event;  // Slot receiving the change
+
+	// The initial scan happens before the ring exists; there is nobody to tell.
+	if (snapshot->events == NULL) {
+		return;
+	}
+
+	event = &snapshot->events[snapshot->numEvents % WATCH_LOG_LEN];
+	event->generation = snapshot->generation;
+	event->tag = tag;
+	strcpy(event->name, name);
+	snapshot->numEvents++;
+}
+
+
+/* void notifyWatchers(struct dirSnapshot* snapshot)
+	* inputs:
+		* struct dirSnapshot* snapshot -- snapshot after a batch of changes
+	* outputs:
+		* every worker woken while any session is watching
+	* calls:
+		* write() on each worker's eventfd
+	* purpose:
+		* workers only learn of changes through their eventfd; with no watchers the watch thread
+		wakes nobody
+*/
+void notifyWatchers(struct dirSnapshot *snapshot)
+{
+	uint64_t one = 1;  // eventfd increment
+	int i;             //for loop iterator
+
+	if (atomic_load(&snapshot->watchers) == 0) {
+		return;
+	}
+	for (i = 0; i < snapshot->numWakeFds; i++) {
+		if (write(snapshot->wakeFds[i], &one, sizeof(one)) == -1 && errno != EAGAIN) {
+			perror("write");
+		}
+	}
+}
+
+
+/* void compileFilter(struct nameFilter* filter, const char* pattern)
+	* inputs:
+		* struct nameFilter* filter -- receives the compiled pattern
+		* const char* pattern -- LIST/LISTX data: an fnmatch() pattern, or "" for every name
+	* outputs:
+		* filter->kind and the literal part of the pattern (pointing into pattern)
+	* calls:
+		* strlen(), strcspn()
+	* purpose:
+		* the common shapes "name", "literal*", "*literal" and "*literal*" are matched by comparing
+		bytes instead of running fnmatch() per name; every pattern's leading literal bytes are kept
+		so the sorted snapshot can be searched for them
+*/
+void compileFilter(struct nameFilter *filter, const char *pattern)
+{
+	size_t length = strlen(pattern);                     // Number of bytes in pattern
+	size_t inner = length > 1 ? length - 2 : 0;          // Number of bytes between the outer characters
+
+	filter->pattern = pattern;
+	filter->prefixLength = strcspn(pattern, GLOB_SPECIAL);
+	filter->literal = pattern;
+	filter->length = filter->prefixLength;
+
+	if (length == 0) {
+		filter->kind = MATCH_ALL;
+	} else if (filter->prefixLength == length) {
+		filter->kind = MATCH_EXACT;
+	} else if (filter->prefixLength == length - 1 && pattern[length - 1] == '*') {
+		filter->kind = MATCH_PREFIX;
+	} else if (pattern[0] == '*' && strcspn(pattern + 1, GLOB_SPECIAL) == length - 1) {
+		filter->kind = MATCH_SUFFIX;
+		filter->literal = pattern + 1;
+		filter->length = length - 1;
+	} else if (length >= 2 && pattern[0] == '*' && pattern[length - 1] == '*' &&
+	           strcspn(pattern + 1, GLOB_SPECIAL) == inner) {
+		filter->kind = inner > 0 ? MATCH_SUBSTRING : MATCH_ALL;
+		filter->literal = pattern + 1;
+		filter->length = inner;
+	} else {
+		filter->kind = MATCH_GLOB;
+	}
+}
+
+
+/* int containsLiteral(const char* name, size_t nameLength, const char* literal, size_t length)
+	* inputs:
+		* const char* name -- filename
+		* size_t nameLength -- number of bytes in name
+		* const char* literal -- bytes to look for (length > 0)
+		* size_t length -- number of bytes in literal
+	* outputs:
+		* 1 if literal occurs within name, 0 otherwise
+	* calls:
+		* _mm_loadu_si128(), _mm_cmpeq_epi8(), _mm_movemask_epi8() (SSE2), memcmp()
+	* purpose:
+		* substring search 16 positions at a time: a position is a candidate only when both the
+		literal's first and last bytes match there, which rules out nearly every position with two
+		vector compares; candidates are confirmed with memcmp(), and positions too close to the
+		end of the name for a full 16-byte load are checked one by one
+*/
+int containsLiteral(const char *name, size_t nameLength, const char *literal, size_t length)
+{
+	size_t position = 0;  // First candidate position not yet checked
+
+	if (length > nameLength) {
+		return 0;
+	}
+
+#ifdef __SSE2__
+	{
+		__m128i first = _mm_set1_epi8(literal[0]);          // First byte of literal, 16 times
+		__m128i last = _mm_set1_epi8(literal[length - 1]);  // Last byte of literal, 16 times
+		unsigned int candidates;                            // Bit i set: position + i may match
+
+		for (; position + length - 1 + 16 <= nameLength; position += 16) {
+			candidates = _mm_movemask_epi8(_mm_and_si128(
+			    _mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *) (name + position))),
+			    _mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *) (name + position + length - 1)))));
+			while (candidates != 0) {
+				if (memcmp(name + position + __builtin_ctz(candidates), literal, length) == 0) {
+					return 1;
+				}
+				candidates &= candidates - 1;
+			}
+		}
+	}
+#endif
+
+	for (; position + length <= nameLength; position++) {
+		if (name[position] == literal[0] && memcmp(name + position, literal, length) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/* int nameMatches(struct nameFilter* filter, const char* name)
+	* inputs:
+		* struct nameFilter* filter -- compiled LIST pattern
+		* const char* name -- filename
+	* outputs:
+		* 1 if the name should be listed, 0 otherwise
+	* calls:
+		* strcmp(), memcmp(), containsLiteral(), fnmatch()
+*/
+int nameMatches(struct nameFilter *filter, const char *name)
+{
+	size_t nameLength;  // Number of bytes in name
+
+	switch (filter->kind) {
+	case MATCH_ALL:
+		return 1;
+	case MATCH_EXACT:
+		return strcmp(name, filter->literal) == 0;
+	case MATCH_PREFIX:
+		return strncmp(name, filter->literal, filter->length) == 0;
+	case MATCH_SUFFIX:
+		nameLength = strlen(name);
+		return nameLength >= filter->length &&
+		       memcmp(name + nameLength - filter->length, filter->literal, filter->length) == 0;
+	case MATCH_SUBSTRING:
+		return containsLiteral(name, strlen(name), filter->literal, filter->length);
+	default:
+		return fnmatch(filter->pattern, name, 0) == 0;
+	}
+}
+
+
+/* void setPage(struct session* session, char* request)
+	* inputs:
+		* struct session* session -- session that sent PAGE
+		* char* request -- PAGE data: "<page size>[ <cursor>]"
+	* outputs:
+		* session->pageSize, session->pageCursor set for the session's next LIST or LISTX
+	* calls:
+		* strtol(), strlen()
+	* purpose:
+		* a page size that is not a positive integer lists everything; a cursor too long to have
+		come from ftserver is kept as an invalid one, so the listing reports it
+*/
+void setPage(struct session *session, char *request)
+{
+	char *cursor;  // Cursor within request
+	long size;     // Requested page size
+
+	size = strtol(request, &cursor, 10);
+	session->pageSize = size > 0 && size <= INT_MAX ? size : 0;
+	if (*cursor == ' ') {
+		cursor++;
+	}
+	if (strlen(cursor) < sizeof(session->pageCursor)) {
+		strcpy(session->pageCursor, cursor);
+	} else {
+		strcpy(session->pageCursor, "?");
+	}
+}
+
+
+/* void setRange(struct session* session, char* request)
+	* inputs:
+		* struct session* session -- session that sent RANGE
+		* char* request -- RANGE data: "<offset>[ <length>]"
+	* outputs:
+		* session->rangeOffset, session->rangeLength set for the session's next GET or SGET
+	* calls:
+		* strtoll()
+	* purpose:
+		* a malformed range (or a length below 1) is kept as an invalid one, so the transfer
+		reports it instead of sending the whole file
+*/
+void setRange(struct session *session, char *request)
+{
+	char *end;               // End of a number within request
+	long long offset;        // Requested first byte
+	long long length = -1;   // Requested number of bytes
+
+	errno = 0;
+	offset = strtoll(request, &end, 10);
+	if (end != request && *end == ' ') {
+		request = end + 1;
+		length = strtoll(request, &end, 10);
+		if (length < 1) {
+			offset = -1;
+		}
+	}
+	if (end == request || *end != '\0' || errno != 0 || offset < 0) {
+		offset = -1;
+	}
+	session->rangeOffset = offset;
+	session->rangeLength = length;
+}
+
+
+/* int startRange(struct session* session, off_t size)
+	* inputs:
+		* struct session* session -- session beginning a GET or SGET
+		* off_t size -- length of the requested file
+	* outputs:
+		* 0 -- session->fileOffset, session->fileRemaining set to the bytes to send
+		* -1 -- the RANGE is invalid, or starts beyond the end of the file
+	* purpose:
+		* a RANGE given before the command applies to it alone; without one the whole file is
+		sent. A range may end beyond the end of the file and is then cut short, and a range
+		starting exactly at the end sends nothing, so a complete file can be "resumed"
+*/
+int startRange(struct session *session, off_t size)
+{
+	off_t offset = session->rangeOffset;  // First byte to send
+	off_t length = session->rangeLength;  // Max number of bytes to send, -1 for all
+
+	if (offset < 0 || offset > size) {
+		return -1;
+	}
+	session->fileOffset = offset;
+	session->fileRemaining = length == -1 || length > size - offset ? size - offset : length;
+	return 0;
+}
+
+
+/* void setCompress(struct session* session, char* request)
+	* inputs:
+		* struct session* session -- session that sent COMPRESS
+		* char* request -- COMPRESS data: comma-separated codecs the client can decode
+	* outputs:
+		* session->compressOffered set for the session's next GET or SGET
+	* purpose:
+		* ftserver speaks "zlib" only; any other list leaves the next transfer uncompressed,
+		which every client can read
+*/
+void setCompress(struct session *session, char *request)
+{
+	char *codec;     // Next codec within request
+	char *position;  // Rest of request
+
+	session->compressOffered = 0;
+	for (codec = strtok_r(request, ",", &position); codec != NULL; codec = strtok_r(NULL, ",", &position)) {
+		if (strcmp(codec, "zlib") == 0) {
+			session->compressOffered = 1;
+		}
+	}
+}
+
+
+/* size_t compressChunk(struct session* session, const char* chunk, size_t numBytes)
+	* inputs:
+		* struct session* session -- session compressing a GET/SGET (session->compressing)
+		* const char* chunk -- file bytes about to be sent
+		* size_t numBytes -- number of bytes in chunk
+	* outputs:
+		* number of compressed bytes stored in session->compressBuffer, or 0 when the chunk is
+		to be sent as is
+	* calls:
+		* arenaAlloc(), compress2()
+	* purpose:
+		* each chunk is compressed on its own (a complete zlib stream), so the client can
+		decompress every ZFILE packet as it arrives, and chunks that stay raw need no state
+		* adaptive: a chunk is sent compressed only if it shrinks by at least 1/16; otherwise
+		the next 1, 2, 4, ... COMPRESS_MAX_BACKOFF chunks are sent without trying, so an
+		already-compressed file costs little CPU, yet compressible parts are still found
+*/
+size_t compressChunk(struct session *session, const char *chunk, size_t numBytes)
+{
+	uLongf compressedLength = numBytes - numBytes / 16;  // Largest useful compressed length
+
+	if (numBytes < COMPRESS_MIN_LEN) {
+		return 0;
+	}
+	if (session->compressSkip > 0) {
+		session->compressSkip--;
+		atomic_fetch_add_explicit(&compressStats.skippedChunks, 1, memory_order_relaxed);
+		return 0;
+	}
+	if (session->compressBufferSize < numBytes) {
+		session->compressBuffer = arenaAlloc(&session->arena, session->chunkSize);
+		session->compressBufferSize = session->chunkSize;
+	}
+
+	// compress2() fails with Z_BUF_ERROR once the output outgrows compressedLength.
+	if (compress2((Bytef *) session->compressBuffer, &compressedLength, (const Bytef *) chunk, numBytes,
+	              COMPRESS_LEVEL) != Z_OK) {
+		session->compressBackoff = session->compressBackoff == 0 ? 1 :
+		                           session->compressBackoff < COMPRESS_MAX_BACKOFF ? session->compressBackoff * 2 :
+		                           COMPRESS_MAX_BACKOFF;
+		session->compressSkip = session->compressBackoff;
+		atomic_fetch_add_explicit(&compressStats.rawChunks, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	session->compressBackoff = 0;
+	atomic_fetch_add_explicit(&compressStats.chunks, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&compressStats.inBytes, numBytes, memory_order_relaxed);
+	atomic_fetch_add_explicit(&compressStats.outBytes, compressedLength, memory_order_relaxed);
+	return compressedLength;
+}
+
+
+/* int startList(struct session* session)
+	* inputs:
+		* struct session* session -- session beginning a LIST or LISTX
+	* outputs:
+		* 0 -- listing positioned at the start of the page
+		* -1 -- the PAGE cursor is not one this listing can resume from
+		* -2 -- the served directory could not be opened for reading (errno set)
+	* calls:
+		* compileFilter(), startDelta(), openat(), lseek(), strtoll()
+	* purpose:
+		* settles how the listing is read and where it starts; a page size and cursor given with
+		PAGE apply to this listing only (DELTA ignores them)
+		* cursors are opaque to clients; they name the last entry examined, so pages never
+		overlap or skip entries, and they keep their meaning while the directory changes:
+			* "n<name>" -- snapshot listings, in name order; the next page resumes after <name>
+			* "d<offset>" -- listings read straight from the directory (no inotify), in directory
+			order; the next page resumes at that getdents64() offset
+*/
+int startList(struct session *session)
+{
+	char *cursor = session->pageCursor;  // PAGE cursor, "" for the start
+	char *end;                           // End of the offset within cursor
+	long long offset = 0;                // Directory offset to resume from
+	int valid = 1;                       // Flag: cursor understood
+
+	session->pageRemaining = session->pageSize > 0 ? session->pageSize : -1;
+	session->pageSize = 0;
+	session->listCursor[0] = '\0';
+	session->listStreamed = atomic_load(&session->snapshot->inotifyFd) == -1;
+	session->listTag = "FNAME";
+	session->listDelta = 0;
+
+	// DELTA data is a generation rather than a pattern.
+	if (strcmp(session->commandTag, "DELTA") == 0) {
+		compileFilter(&session->filter, "");
+		session->pageRemaining = -1;
+		cursor = "";
+		startDelta(session);
+	} else {
+		compileFilter(&session->filter, session->filename);
+	}
+
+	if (!session->listStreamed) {
+		if (cursor[0] == 'n' && cursor[1] != '\0' && strlen(cursor + 1) <= NAME_MAX) {
+			strcpy(session->listCursor, cursor + 1);
+		} else if (cursor[0] != '\0') {
+			valid = 0;
+		}
+	} else {
+		if (cursor[0] == 'd') {
+			errno = 0;
+			offset = strtoll(cursor + 1, &end, 10);
+			valid = end != cursor + 1 && *end == '\0' && errno == 0 && offset >= 0;
+		} else if (cursor[0] != '\0') {
+			valid = 0;
+		}
+
+		// Open a descriptor with its own directory offset.
+		if (valid) {
+			session->listDirFd = openat(session->snapshot->dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (session->listDirFd == -1) {
+				session->pageCursor[0] = '\0';
+				return -2;
+			} else if (offset > 0 && lseek(session->listDirFd, offset, SEEK_SET) == -1) {
+				perror("lseek");
+				valid = 0;
+			}
+		}
+		session->listOffset = offset;
+	}
+
+	session->pageCursor[0] = '\0';
+	return valid ? 0 : -1;
+}
+
+
+/* void startDelta(struct session* session)
+	* inputs:
+		* struct session* session -- session beginning a DELTA (session->filename: generation)
+	* outputs:
+		* GEN <generation> queued on session->dataOut, followed by RESET when the client's
+		generation cannot be brought up to date
+	* calls:
+		* strtoull(), snprintf(), sendFrame()
+	* purpose:
+		* GEN names the generation the reply brings the client up to; the client sends it with its
+		next DELTA. Changes made while the reply is being sent may be reported again next time.
+		* a generation older than the snapshot's floor (tombstones dropped, or a rescan after
+		lost events), newer than the snapshot, or from an earlier run is answered with RESET and
+		every name as ADDED; without inotify there are no generations, so every DELTA is a RESET
+*/
+void startDelta(struct session *session)
+{
+	struct dirSnapshot *snapshot = session->snapshot;  // Listing of the served directory
+	char generation[32];  // Packet data
+	uint64_t current = 0; // Snapshot generation
+	uint64_t floor = 0;   // Oldest generation the snapshot can bring up to date
+	char *end;            // End of the client's generation
+
+	if (!session->listStreamed) {
+		pthread_rwlock_rdlock(&snapshot->lock);
+		current = snapshot->generation;
+		floor = snapshot->floor;
+		pthread_rwlock_unlock(&snapshot->lock);
+	}
+
+	snprintf(generation, sizeof(generation), "%llu", (unsigned long long) current);
+	sendFrame(session, &session->dataOut, "GEN", generation, strlen(generation));
+
+	errno = 0;
+	session->deltaSince = strtoull(session->filename, &end, 10);
+	if (session->listStreamed || end == session->filename || *end != '\0' || errno != 0 ||
+	    session->deltaSince < floor || session->deltaSince > current) {
+		sendFrame(session, &session->dataOut, "RESET", "", 0);
+		session->listTag = "ADDED";
+	} else {
+		session->listDelta = 1;
+	}
+}
+
+
+/* void sendNextPage(struct session* session)
+	* inputs:
+		* struct session* session -- session whose listing has filled its page
+	* outputs:
+		* NEXT <cursor> packet queued on session->dataOut
+	* calls:
+		* snprintf(), sendFrame()
+	* purpose:
+		* only sent when another matching entry exists; the client passes the cursor back with
+		PAGE to fetch the next page
+*/
+void sendNextPage(struct session *session)
+{
+	char cursor[NAME_MAX + 2];  // Packet data
+
+	if (session->listStreamed) {
+		snprintf(cursor, sizeof(cursor), "d%lld", (long long) session->listOffset);
+	} else {
+		snprintf(cursor, sizeof(cursor), "n%s", session->listCursor);
+	}
+	sendFrame(session, &session->dataOut, "NEXT", cursor, strlen(cursor));
+}
+
+
+/* char* entryTag(struct session* session, struct snapshotEntry* entry)
+	* inputs:
+		* struct session* session -- session transferring a listing
+		* struct snapshotEntry* entry -- snapshot entry (lock held)
+	* outputs:
+		* tag to send the entry's name with, or NULL to leave it out
+	* purpose:
+		* listings send the names present; DELTA sends names whose latest change is newer than
+		the client's generation: ADDED if the name appeared since, REMOVED if it is now a tombstone
+		(unless it also appeared since), MODIFIED otherwise
+*/
+char *entryTag(struct session *session, struct snapshotEntry *entry)
+{
+	if (!session->listDelta) {
+		return entry->removed ? NULL : session->listTag;
+	}
+	if (entry->changed <= session->deltaSince) {
+		return NULL;
+	}
+	if (entry->removed) {
+		return entry->created > session->deltaSince ? NULL : "REMOVED";
+	}
+	return entry->created > session->deltaSince ? "ADDED" : "MODIFIED";
+}
+
+
+/* int snapshotList(struct session* session)
+	* inputs:
+		* struct session* session -- session transferring a LIST
+	* outputs:
+		* 0 -- up to LIST_BATCH filenames (STAT_BATCH for LISTX) queued on session->dataOut; call
+		again once they drain
+		* 1 -- every filename has been queued, or the page is full (NEXT queued)
+	* calls:
+		* streamList(), snapshotSearch(), nameMatches(), listEntry(), flushRecords(), sendNextPage()
+	* purpose:
+		* streams the snapshot in name order; each batch resumes after the last name examined
+		(session->listCursor) rather than at an index, so names added or removed while the
+		listing is under way never shift it; names are copied, as the watch thread may free them
+		* names sharing a pattern's literal prefix are contiguous in the sorted snapshot, so a
+		filtered listing starts at the first of them and stops after the last; at most LIST_SCAN
+		names are examined per call, keeping the read lock short when few names match
+		* without inotify the snapshot cannot be trusted, so the listing is read straight from
+		the directory by streamList() instead
+*/
+int snapshotList(struct session *session)
+{
+	struct dirSnapshot *snapshot = session->snapshot;  // Listing of the served directory
+	int index;      // Next name to send
+	int found;      // Flag: cursor name still present
+	int numSent;    // Number of names queued by this call
+	int numScanned; // Number of names examined by this call
+	int batch;      // Max number of names queued by this call
+	int finished;   // Return value
+	int pageFull;   // Flag: a match was found after the page filled up
+	int prefixIndex;            // First name sharing the pattern's literal prefix
+	char prefix[NAME_MAX + 1];  // Literal prefix of the pattern
+	struct snapshotEntry *entry;  // Entry being examined
+	char *tag;                  // Tag entry is sent with, or NULL
+
+	if (session->listStreamed) {
+		return streamList(session);
+	}
+
+	pthread_rwlock_rdlock(&snapshot->lock);
+	index = 0;
+	if (session->listCursor[0] != '\0') {
+		index = snapshotSearch(snapshot, session->listCursor, &found);
+		index += found;
+	}
+	if (session->filter.prefixLength > 0 && session->filter.prefixLength <= NAME_MAX) {
+		memcpy(prefix, session->filter.pattern, session->filter.prefixLength);
+		prefix[session->filter.prefixLength] = '\0';
+		prefixIndex = snapshotSearch(snapshot, prefix, &found);
+		index = prefixIndex > index ? prefixIndex : index;
+	}
+	batch = session->listRecords ? STAT_BATCH : LIST_BATCH;
+	finished = pageFull = 0;
+	for (numSent = 0, numScanned = 0; numSent < batch && numScanned < LIST_SCAN; numScanned++, index++) {
+		if (index >= snapshot->numEntries) {
+			finished = 1;
+			break;
+		}
+		entry = &snapshot->entries[index];
+		if (strncmp(entry->name, session->filter.pattern, session->filter.prefixLength) != 0) {
+			finished = 1;
+			break;
+		}
+		tag = entryTag(session, entry);
+		if (tag != NULL && nameMatches(&session->filter, entry->name)) {
+			if (session->pageRemaining == 0) {
+				finished = pageFull = 1;
+				break;
+			}
+			listEntry(session, snapshot->dirFd, entry->name, tag);
+			numSent++;
+			if (session->pageRemaining > 0) {
+				session->pageRemaining--;
+			}
+		}
+	}
+	flushRecords(session);
+	if (numScanned > 0) {
+		strcpy(session->listCursor, snapshot->entries[index - 1].name);
+	}
+	finished = finished || index >= snapshot->numEntries;
+	pthread_rwlock_unlock(&snapshot->lock);
+
+	if (pageFull) {
+		sendNextPage(session);
+	}
+
+	return finished;
+}
+
+
+/* int streamList(struct session* session)
+	* inputs:
+		* struct session* session -- session transferring a LIST
+	* outputs:
+		* 0 -- one getdents64() batch of filenames queued on session->dataOut; call again
+		once they drain
+		* 1 -- every filename has been queued, the page is full (NEXT queued), or the directory
+		could not be read
+	* calls:
+		* getdents64(), listableEntry(), nameMatches(), listEntry(), flushRecords(), sendNextPage(),
+		close()
+	* purpose:
+		* LIST without a snapshot: each call reads one DIRENT_BUF_LEN batch of entries from
+		session->listDirFd and frames it at once, so the first names leave before the rest of
+		the directory has been read and memory use does not grow with the directory; names
+		arrive in directory order rather than sorted
+*/
+int streamList(struct session *session)
+{
+	char entries[DIRENT_BUF_LEN] __attribute__((aligned(__alignof__(struct dirent64))));
+	struct dirent64 *entry;  // Entry within the directory
+	ssize_t length;          // Number of entry bytes read
+	char *position;          // Next entry within entries
+
+	if (session->listDirFd == -1) {
+		return 1;
+	}
+
+	length = getdents64(session->listDirFd, entries, sizeof(entries));
+	if (length <= 0) {
+		if (length == -1) {
+			perror("getdents64");
+		}
+		close(session->listDirFd);
+		session->listDirFd = -1;
+		return 1;
+	}
+
+	for (position = entries; position < entries + length; position += entry->d_reclen) {
+		entry = (struct dirent64 *) position;
+		if (nameMatches(&session->filter, entry->d_name) && listableEntry(session->snapshot->dirFd, entry)) {
+			// The page is full: the next page starts with this entry.
+			if (session->pageRemaining == 0) {
+				flushRecords(session);
+				sendNextPage(session);
+				close(session->listDirFd);
+				session->listDirFd = -1;
+				return 1;
+			}
+			listEntry(session, session->snapshot->dirFd, entry->d_name, session->listTag);
+			if (session->pageRemaining > 0) {
+				session->pageRemaining--;
+			}
+		}
+		session->listOffset = entry->d_off;
+	}
+	flushRecords(session);
+	return 0;
+}
+
+
+/* void listEntry(struct session* session, int dirFd, const char* name, char* tag)
+	* inputs:
+		* struct session* session -- session transferring a LIST, LISTX or DELTA
+		* int dirFd -- served directory
+		* const char* name -- file to list
+		* char* tag -- FNAME (LIST), or ADDED, MODIFIED or REMOVED (DELTA)
+	* outputs:
+		* LIST, DELTA -- <tag> <name> packet queued on session->dataOut
+		* LISTX -- FSTAT record appended to session->recordFrame (a new FSTAT packet is begun
+		when the record would not fit within session->chunkSize)
+	* calls:
+		* int statx(int dirfd, const char* pathname, int flags, unsigned int mask, struct statx* buf)
+			* like fstatat(), filling in only the fields named by mask
+		* writerReserve(), flushRecords()
+	* purpose:
+		* LISTX record (all fields big-endian):
+			size (8 bytes) | mtime seconds (8 bytes) | mtime nanoseconds (4 bytes) | mode (4 bytes)
+			| inode (8 bytes) | name length (2 bytes) | name
+		* records are built in place within one reserved packet, so a batch of entries costs one
+		header and no copies; entries removed (or replaced by a directory) since they were read
+		are left out
+*/
+void listEntry(struct session *session, int dirFd, const char *name, char *tag)
+{
+	struct statx info;   // Metadata of the entry
+	size_t nameLength;   // Number of bytes in name
+	char *record;        // Record storage within session->recordFrame
+	uint64_t field64;    // Big-endian 8-byte field
+	uint32_t field32;    // Big-endian 4-byte field
+	uint16_t field16;    // Big-endian 2-byte field
+
+	nameLength = strlen(name);
+	if (!session->listRecords) {
+		sendFrame(session, &session->dataOut, tag, (char *) name, nameLength);
+		return;
+	}
+
+	if (statx(dirFd, name, AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE |
+	          STATX_MTIME, &info) == -1 || S_ISDIR(info.stx_mode)) {
+		return;
+	}
+
+	// Start a new packet when the record would overflow the current one.
+	if (session->recordFrame != NULL && session->recordBytes + STAT_RECORD_LEN + nameLength > session->chunkSize) {
+		flushRecords(session);
+	}
+	if (session->recordFrame == NULL) {
+		session->recordFrame = writerReserve(&session->dataOut, PACK2_HEADER_LEN + session->chunkSize) +
+		                       PACK2_HEADER_LEN;
+		session->recordBytes = 0;
+	}
+
+	record = session->recordFrame + session->recordBytes;
+	field64 = htobe64(info.stx_size);
+	memcpy(record, &field64, 8);
+	field64 = htobe64((uint64_t) info.stx_mtime.tv_sec);
+	memcpy(record + 8, &field64, 8);
+	field32 = htonl(info.stx_mtime.tv_nsec);
+	memcpy(record + 16, &field32, 4);
+	field32 = htonl(info.stx_mode);
+	memcpy(record + 20, &field32, 4);
+	field64 = htobe64(info.stx_ino);
+	memcpy(record + 24, &field64, 8);
+	field16 = htons(nameLength);
+	memcpy(record + 32, &field16, 2);
+	memcpy(record + STAT_RECORD_LEN, name, nameLength);
+	session->recordBytes += STAT_RECORD_LEN + nameLength;
+}
+
+
+/* void flushRecords(struct session* session)
+	* inputs:
+		* struct session* session -- session transferring a LISTX
+	* outputs:
+		* the FSTAT packet being filled (if any) is queued on session->dataOut
+	* calls:
+		* sendFrameHeader(), writerCommit()
+	* purpose:
+		* ends an FSTAT packet; its header goes in the space reserved ahead of the records
+*/
+void flushRecords(struct session *session)
+{
+	if (session->recordFrame == NULL) {
+		return;
+	}
+	sendFrameHeader(session, &session->dataOut, "FSTAT", session->recordBytes);
+	writerCommit(&session->dataOut, session->recordBytes);
+	session->recordFrame = NULL;
+}
+
+
+/* int openServedFile(struct dirSnapshot* snapshot, const char* name, struct stat* info)
+	* inputs:
+		* struct dirSnapshot* snapshot -- served directory (snapshot->dirFd)
+		* const char* name -- filename requested by the client
+		* struct stat* info -- receives the file's metadata
+	* outputs:
+		* on success -- read-only file descriptor of a regular file
+		* on failure -- -1; errno is ENOENT if the name is not a file of the served directory
+	* calls:
+		* openat(), fstat()
+	* purpose:
+		* resolves GET, SGET and MGET filenames in O(1) directory operations instead of scanning
+		the directory, with the same reach as the old listFiles() check:
+			* only entries of the served directory itself: names containing '/' are refused,
+			and "." and ".." are directories
+			* symbolic links are followed, as fopen() did, but must lead to a regular file;
+			directories are "not found", and devices, FIFOs and sockets cannot be sent
+		* O_NONBLOCK keeps open() of a FIFO from stalling the reactor; it has no effect on the
+		regular files that pass the check
+*/
+int openServedFile(struct dirSnapshot *snapshot, const char *name, struct stat *info)
+{
+	int fd;  // Return value
+
+	if (name[0] == '\0' || strchr(name, '/') != NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	fd = openat(snapshot->dirFd, name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ELOOP || errno == ENAMETOOLONG) {
+			errno = ENOENT;
+		}
+		return -1;
+	}
+
+	if (fstat(fd, info) == -1) {
+		close(fd);
+		errno = EIO;
+		return -1;
+	}
+	if (!S_ISREG(info->st_mode)) {
+		close(fd);
+		errno = S_ISDIR(info->st_mode) ? ENOENT : EACCES;
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* void cacheInit(size_t budget)
+	* inputs:
+		* size_t budget -- max number of bytes of file contents to keep in memory (0: no cache)
+	* outputs:
+		* empty content cache, and its loader thread started unless the cache is disabled
+	* calls:
+		* pthread_create()
+*/
+void cacheInit(size_t budget)
+{
+	int status;  // Return status
+
+	memset(&contentCache, 0, sizeof(contentCache));
+	pthread_mutex_init(&contentCache.lock, NULL);
+	pthread_cond_init(&contentCache.queued, NULL);
+	contentCache.budget = budget;
+	if (budget == 0) {
+		return;
+	}
+
+	status = pthread_create(&contentCache.thread, NULL, cacheMain, NULL);
+	if (status != 0) {
+		fprintf(stderr, "ftserver: pthread_create: %s\n", strerror(status));
+		exit(1);
+	}
+}
+
+
+/* size_t cacheBucket(const char* name)
+	* inputs:
+		* const char* name -- filename
+	* outputs:
+		* index of name's hash bucket (FNV-1a)
+*/
+size_t cacheBucket(const char *name)
+{
+	uint32_t hash = 2166136261u;  // FNV offset basis
+
+	while (*name != '\0') {
+		hash = (hash ^ (unsigned char) *name++) * 16777619u;
+	}
+	return hash & (CACHE_BUCKETS - 1);
+}
+
+
+/* void cacheUnlink(struct cacheEntry* entry)
+	* inputs:
+		* struct cacheEntry* entry -- cached entry (cache lock held)
+	* outputs:
+		* entry removed from the hash table and the LRU list; freed once no transfer uses it
+	* calls:
+		* cacheDrop()
+*/
+void cacheUnlink(struct cacheEntry *entry)
+{
+	struct cacheEntry **link;  // Pointer to entry within its bucket
+
+	for (link = &contentCache.buckets[cacheBucket(entry->name)]; *link != entry; link = &(*link)->hashNext) {
+	}
+	*link = entry->hashNext;
+
+	if (entry->newer != NULL) {
+		entry->newer->older = entry->older;
+	} else {
+		contentCache.newest = entry->older;
+	}
+	if (entry->older != NULL) {
+		entry->older->newer = entry->newer;
+	} else {
+		contentCache.oldest = entry->newer;
+	}
+	contentCache.bytes -= entry->size;
+	contentCache.numEntries--;
+	cacheDrop(entry);
+}
+
+
+/* void cacheDrop(struct cacheEntry* entry)
+	* inputs:
+		* struct cacheEntry* entry -- entry losing a reference (cache lock held)
+	* outputs:
+		* entry freed when neither the cache nor any transfer refers to it
+	* purpose:
+		* frame writers reference cached bytes in place, so an entry evicted mid-transfer stays
+		alive until the last data connection using it closes
+*/
+void cacheDrop(struct cacheEntry *entry)
+{
+	if (--entry->refs == 0) {
+		free(entry->data);
+		free(entry->name);
+		free(entry);
+	}
+}
+
+
+/* void cacheRelease(struct cacheEntry* entry)
+	* inputs:
+		* struct cacheEntry* entry -- entry returned by cacheLookup() that a transfer is done with
+	* outputs:
+		* the transfer's reference dropped
+	* calls:
+		* cacheDrop()
+*/
+void cacheRelease(struct cacheEntry *entry)
+{
+	pthread_mutex_lock(&contentCache.lock);
+	cacheDrop(entry);
+	pthread_mutex_unlock(&contentCache.lock);
+}
+
+
+/* struct cacheEntry* cacheLoad(struct openFile* file)
+	* inputs:
+		* struct openFile* file -- frequently fetched file missing from the cache
+	* outputs:
+		* on success -- new entry holding the whole file, not yet in the cache (refs 0)
+		* on failure -- NULL (the file changed or could not be read; it is sent from disk)
+	* calls:
+		* fstat(), malloc(), pread()
+	* purpose:
+		* called by the loader thread, outside the cache lock; the metadata recorded is that of
+		the open file after the read, so a file that changed while being read is not cached
+*/
+struct cacheEntry *cacheLoad(struct openFile *file)
+{
+	struct cacheEntry *entry;  // Return value
+	struct stat before;        // Metadata before the read
+	struct stat after;         // Metadata after the read
+	ssize_t bytesRead;         // Number of bytes read by one pread()
+	off_t offset = 0;          // Number of bytes read
+	off_t size;                // Number of bytes to read
+
+	if (fstat(file->fd, &before) == -1 || before.st_nlink == 0 ||
+	    (size_t) before.st_size > contentCache.budget / CACHE_ENTRY_SHARE) {
+		return NULL;
+	}
+	size = before.st_size;
+
+	entry = calloc(1, sizeof(struct cacheEntry));
+	assert(entry != NULL); // calloc() failure check
+	entry->data = malloc(size > 0 ? size : 1);
+	assert(entry->data != NULL); // malloc() failure check
+	while (offset < size) {
+		bytesRead = pread(file->fd, entry->data + offset, size - offset, offset);
+		if (bytesRead == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytesRead <= 0) {
+			break;
+		}
+		offset += bytesRead;
+	}
+
+	if (offset != size || fstat(file->fd, &after) == -1 || after.st_size != size ||
+	    after.st_mtim.tv_sec != before.st_mtim.tv_sec || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec) {
+		free(entry->data);
+		free(entry);
+		return NULL;
+	}
+
+	entry->name = strdup(file->name);
+	assert(entry->name != NULL); // strdup() failure check
+	entry->size = size;
+	entry->inode = after.st_ino;
+	entry->mtime = after.st_mtim;
+	return entry;
+}
+
+
+/* void cacheInsert(struct cacheEntry* loaded)
+	* inputs:
+		* struct cacheEntry* loaded -- entry returned by cacheLoad()
+	* outputs:
+		* entry at the head of the LRU list, replacing any entry of the same name; the least
+		recently used entries are evicted from the tail to stay within budget
+	* calls:
+		* cacheBucket(), cacheUnlink()
+*/
+void cacheInsert(struct cacheEntry *loaded)
+{
+	struct cacheEntry *entry;                 // Entry being examined
+	size_t bucket = cacheBucket(loaded->name); // Hash bucket of the name
+
+	pthread_mutex_lock(&contentCache.lock);
+	for (entry = contentCache.buckets[bucket]; entry != NULL; entry = entry->hashNext) {
+		if (strcmp(entry->name, loaded->name) == 0) {
+			cacheUnlink(entry);
+			break;
+		}
+	}
+	while (contentCache.oldest != NULL && contentCache.bytes + loaded->size > contentCache.budget) {
+		cacheUnlink(contentCache.oldest);
+		contentCache.evictions++;
+	}
+
+	loaded->refs = 1;
+	loaded->hashNext = contentCache.buckets[bucket];
+	contentCache.buckets[bucket] = loaded;
+	loaded->older = contentCache.newest;
+	if (contentCache.newest != NULL) {
+		contentCache.newest->newer = loaded;
+	} else {
+		contentCache.oldest = loaded;
+	}
+	contentCache.newest = loaded;
+	contentCache.bytes += loaded->size;
+	contentCache.numEntries++;
+	pthread_mutex_unlock(&contentCache.lock);
+}
+
+
+/* struct cacheEntry* cacheLookup(struct dirSnapshot* snapshot, const char* name)
+	* inputs:
+		* struct dirSnapshot* snapshot -- served directory
+		* const char* name -- filename requested by a whole-file GET, compressing SGET, or MGET
+	* outputs:
+		* the file's contents, current as of this call, with a reference the caller must drop
+		with cacheRelease(); or NULL when the file is to be sent from disk (cache disabled, file
+		not cached, missing or unreadable -- openServedFile() then reports the error)
+	* calls:
+		* fstatat(), cacheBucket(), cacheUnlink()
+	* purpose:
+		* a hit costs one fstatat() and no open(), read() or close(): the entry is used only if
+		the file still has the inode, size and mtime its contents were read with
+		* a miss never reads the file here; the caller sends it from disk and counts the fetch
+		with cacheRequest()
+*/
+struct cacheEntry *cacheLookup(struct dirSnapshot *snapshot, const char *name)
+{
+	struct cacheEntry *entry;  // Return value
+	struct stat info;          // Current metadata of the file
+
+	if (contentCache.budget == 0 || name[0] == '\0' || strchr(name, '/') != NULL ||
+	    fstatat(snapshot->dirFd, name, &info, 0) == -1 || !S_ISREG(info.st_mode)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&contentCache.lock);
+	for (entry = contentCache.buckets[cacheBucket(name)]; entry != NULL; entry = entry->hashNext) {
+		if (strcmp(entry->name, name) == 0) {
+			break;
+		}
+	}
+
+	// Hit: move the entry to the head of the LRU list.
+	if (entry != NULL && entry->inode == info.st_ino && entry->size == info.st_size &&
+	    entry->mtime.tv_sec == info.st_mtim.tv_sec && entry->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+		if (entry != contentCache.newest) {
+			entry->newer->older = entry->older;
+			if (entry->older != NULL) {
+				entry->older->newer = entry->newer;
+			} else {
+				contentCache.oldest = entry->newer;
+			}
+			entry->newer = NULL;
+			entry->older = contentCache.newest;
+			contentCache.newest->newer = entry;
+			contentCache.newest = entry;
+		}
+		entry->refs++;
+		contentCache.hits++;
+		contentCache.hitBytes += entry->size;
+		pthread_mutex_unlock(&contentCache.lock);
+		return entry;
+	}
+
+	// The file changed since it was cached.
+	if (entry != NULL) {
+		cacheUnlink(entry);
+		contentCache.invalidations++;
+	}
+	contentCache.misses++;
+	pthread_mutex_unlock(&contentCache.lock);
+	return NULL;
+}
+
+
+/* void cacheRequest(struct openFile* file, off_t size)
+	* inputs:
+		* struct openFile* file -- file a cacheLookup() miss is about to send from disk
+		* off_t size -- its current size
+	* outputs:
+		* the fetch counted; the file queued for the loader thread once it has been fetched
+		CACHE_ADMIT_FETCHES times
+	* purpose:
+		* files fetched once are never read into memory, and files of more than
+		1/CACHE_ENTRY_SHARE of the budget never are; popularity is counted on the open-file cache
+		entry, and a full queue leaves the file to be counted again on later fetches
+*/
+void cacheRequest(struct openFile *file, off_t size)
+{
+	if (contentCache.budget == 0 || (size_t) size > contentCache.budget / CACHE_ENTRY_SHARE) {
+		return;
+	}
+
+	pthread_mutex_lock(&fileCache.lock);
+	if (!file->cacheQueued && ++file->cacheFetches >= CACHE_ADMIT_FETCHES) {
+		pthread_mutex_lock(&contentCache.lock);
+		if (contentCache.numJobs < CACHE_QUEUE_LEN) {
+			file->cacheQueued = 1;
+			file->cacheFetches = 0;
+			file->refs++;
+			contentCache.jobs[(contentCache.firstJob + contentCache.numJobs) % CACHE_QUEUE_LEN] = file;
+			contentCache.numJobs++;
+			pthread_cond_signal(&contentCache.queued);
+		}
+		pthread_mutex_unlock(&contentCache.lock);
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+}
+
+
+/* void* cacheMain(void* arg)
+	* inputs:
+		* void* arg -- unused
+	* outputs:
+		* never returns
+	* calls:
+		* cacheLoad(), cacheInsert(), fileCacheDrop()
+	* purpose:
+		* loader thread: reads queued files into the content cache one at a time, so the reactors
+		never block on reading a whole file
+*/
+void *cacheMain(void *arg)
+{
+	struct openFile *file;      // File being read
+	struct cacheEntry *loaded;  // Its contents
+
+	(void) arg;
+	while (1) {
+		pthread_mutex_lock(&contentCache.lock);
+		while (contentCache.numJobs == 0) {
+			pthread_cond_wait(&contentCache.queued, &contentCache.lock);
+		}
+		file = contentCache.jobs[contentCache.firstJob];
+		contentCache.firstJob = (contentCache.firstJob + 1) % CACHE_QUEUE_LEN;
+		contentCache.numJobs--;
+		pthread_mutex_unlock(&contentCache.lock);
+
+		loaded = cacheLoad(file);
+		if (loaded != NULL) {
+			cacheInsert(loaded);
+		}
+
+		pthread_mutex_lock(&fileCache.lock);
+		file->cacheQueued = 0;
+		fileCacheDrop(file);
+		pthread_mutex_unlock(&fileCache.lock);
+	}
+	return NULL;
+}
+
+
+/* void fileCacheUnlink(struct openFile* file)
+	* inputs:
+		* struct openFile* file -- cached file (file cache lock held)
+	* outputs:
+		* file removed from the hash table and the LRU list; closed once no transfer uses it
+	* calls:
+		* fileCacheDrop()
+*/
+void fileCacheUnlink(struct openFile *file)
+{
+	struct openFile **link;  // Pointer to file within its bucket
+
+	for (link = &fileCache.buckets[cacheBucket(file->name)]; *link != file; link = &(*link)->hashNext) {
+	}
+	*link = file->hashNext;
+
+	if (file->newer != NULL) {
+		file->newer->older = file->older;
+	} else {
+		fileCache.newest = file->older;
+	}
+	if (file->older != NULL) {
+		file->older->newer = file->newer;
+	} else {
+		fileCache.oldest = file->newer;
+	}
+	file->newer = file->older = NULL;
+	fileCache.numFiles--;
+	fileCacheDrop(file);
+}
+
+
+/* void fileCacheDrop(struct openFile* file)
+	* inputs:
+		* struct openFile* file -- file losing a reference (file cache lock held)
+	* outputs:
+		* descriptor closed and file freed when neither the cache nor any transfer refers to it
+*/
+void fileCacheDrop(struct openFile *file)
+{
+	if (--file->refs == 0) {
+		close(file->fd);
+		free(file->name);
+		free(file);
+	}
+}
+
+
+/* struct openFile* fileCacheAcquire(struct dirSnapshot* snapshot, const char* name, struct stat* info)
+	* inputs:
+		* struct dirSnapshot* snapshot -- served directory
+		* const char* name -- filename requested by GET, SGET or MGET
+		* struct stat* info -- receives the file's current metadata
+	* outputs:
+		* on success -- open file with a reference the caller must drop with fileCacheRelease()
+		* on failure -- NULL; errno as set by openServedFile()
+	* calls:
+		* fstat(), fstatat(), cacheBucket(), openServedFile(), fileCacheUnlink(), missingRecord()
+	* purpose:
+		* a cached descriptor is revalidated before use: fstat() supplies the current size and
+		mtime, which must still be those the file was opened with (a file truncated or rewritten
+		in place is reopened), and the name must still refer to the same inode -- checked with
+		fstatat() when inotify is unavailable; otherwise the watch thread evicts renamed and
+		deleted names, and a descriptor whose file has no links left is dropped
+		* a miss opens the name as before and caches the descriptor at the head of the LRU list,
+		closing the least recently used one beyond FILE_CACHE_LEN; a name that does not exist is
+		remembered as missing
+*/
+struct openFile *fileCacheAcquire(struct dirSnapshot *snapshot, const char *name, struct stat *info)
+{
+	struct openFile *file;     // Return value
+	struct openFile *other;    // Entry cached for name by another worker meanwhile
+	struct stat current;       // Metadata of the file name now refers to
+	size_t bucket;             // Hash bucket of name
+	int valid;                 // Flag: the cached descriptor still belongs to name
+	uint64_t epoch;            // Missing-name epoch before the name was opened
+
+	if (name[0] == '\0' || strchr(name, '/') != NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+	bucket = cacheBucket(name);
+
+	pthread_mutex_lock(&fileCache.lock);
+	for (file = fileCache.buckets[bucket]; file != NULL; file = file->hashNext) {
+		if (strcmp(file->name, name) == 0) {
+			file->refs++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+
+	if (file != NULL) {
+		valid = fstat(file->fd, info) == 0 && info->st_nlink > 0 && info->st_size == file->size &&
+		        info->st_mtim.tv_sec == file->mtime.tv_sec && info->st_mtim.tv_nsec == file->mtime.tv_nsec;
+		if (valid && atomic_load(&snapshot->inotifyFd) == -1) {
+			valid = fstatat(snapshot->dirFd, name, &current, 0) == 0 &&
+			        current.st_ino == file->inode && current.st_dev == file->device;
+		}
+
+		pthread_mutex_lock(&fileCache.lock);
+		if (valid) {
+			// Move the file to the head of the LRU list, unless it was evicted meanwhile.
+			if (file != fileCache.newest && file->newer != NULL) {
+				file->newer->older = file->older;
+				if (file->older != NULL) {
+					file->older->newer = file->newer;
+				} else {
+					fileCache.oldest = file->newer;
+				}
+				file->newer = NULL;
+				file->older = fileCache.newest;
+				fileCache.newest->newer = file;
+				fileCache.newest = file;
+			}
+			fileCache.hits++;
+			pthread_mutex_unlock(&fileCache.lock);
+			return file;
+		}
+		for (other = fileCache.buckets[bucket]; other != NULL && other != file; other = other->hashNext) {
+		}
+		if (other != NULL) {
+			fileCacheUnlink(file);
+			fileCache.invalidations++;
+		}
+		fileCacheDrop(file);
+		pthread_mutex_unlock(&fileCache.lock);
+	}
+
+	pthread_mutex_lock(&missingCache.lock);
+	epoch = missingCache.epoch;
+	pthread_mutex_unlock(&missingCache.lock);
+
+	file = calloc(1, sizeof(struct openFile));
+	assert(file != NULL); // calloc() failure check
+	file->fd = openServedFile(snapshot, name, info);
+	if (file->fd == -1) {
+		free(file);
+		if (errno == ENOENT) {
+			missingRecord(snapshot, name, epoch);
+			errno = ENOENT;
+		}
+		return NULL;
+	}
+	file->name = strdup(name);
+	assert(file->name != NULL); // strdup() failure check
+	file->inode = info->st_ino;
+	file->device = info->st_dev;
+	file->size = info->st_size;
+	file->mtime = info->st_mtim;
+	file->refs = 2;
+
+	pthread_mutex_lock(&fileCache.lock);
+	fileCache.misses++;
+	for (other = fileCache.buckets[bucket]; other != NULL; other = other->hashNext) {
+		if (strcmp(other->name, name) == 0) {
+			fileCacheUnlink(other);
+			break;
+		}
+	}
+	while (fileCache.numFiles >= FILE_CACHE_LEN) {
+		fileCacheUnlink(fileCache.oldest);
+		fileCache.evictions++;
+	}
+	file->hashNext = fileCache.buckets[bucket];
+	fileCache.buckets[bucket] = file;
+	file->older = fileCache.newest;
+	if (fileCache.newest != NULL) {
+		fileCache.newest->newer = file;
+	} else {
+		fileCache.oldest = file;
+	}
+	fileCache.newest = file;
+	fileCache.numFiles++;
+	pthread_mutex_unlock(&fileCache.lock);
+	return file;
+}
+
+
+/* void fileCacheRelease(struct openFile* file)
+	* inputs:
+		* struct openFile* file -- file returned by fileCacheAcquire() that a transfer is done with
+	* outputs:
+		* the transfer's reference dropped; the descriptor stays open while cached
+	* calls:
+		* fileCacheDrop()
+*/
+void fileCacheRelease(struct openFile *file)
+{
+	pthread_mutex_lock(&fileCache.lock);
+	fileCacheDrop(file);
+	pthread_mutex_unlock(&fileCache.lock);
+}
+
+
+/* void fileCacheEvict(const char* name)
+	* inputs:
+		* const char* name -- name created, deleted or renamed in the served directory, or NULL
+		after lost events
+	* outputs:
+		* the cached descriptor of name (or every descriptor) dropped
+	* calls:
+		* cacheBucket(), fstat(), fileCacheUnlink(), sidecarForget()
+	* purpose:
+		* called by the watch thread, so a name that now refers to another file (or to none) is
+		reopened on its next fetch
+		* when the descriptor shows that its file has no links left (deleted, or replaced by a
+		rename), the file's compressed variant is deleted too
+*/
+void fileCacheEvict(const char *name)
+{
+	struct openFile *file;  // Entry being examined
+	struct stat info;       // Metadata of the evicted file
+	int gone = 0;           // Flag: the evicted file has no links left
+
+	pthread_mutex_lock(&fileCache.lock);
+	if (name == NULL) {
+		while (fileCache.oldest != NULL) {
+			fileCacheUnlink(fileCache.oldest);
+			fileCache.invalidations++;
+		}
+	} else {
+		for (file = fileCache.buckets[cacheBucket(name)]; file != NULL; file = file->hashNext) {
+			if (strcmp(file->name, name) == 0) {
+				gone = sidecarCache.dirFd != -1 && fstat(file->fd, &info) == 0 && info.st_nlink == 0;
+				fileCacheUnlink(file);
+				fileCache.invalidations++;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+
+	if (gone) {
+		sidecarForget(&info);
+	}
+}
+
+
+/* void missingUnlink(struct missingName* missing)
+	* inputs:
+		* struct missingName* missing -- remembered name (missing cache lock held)
+	* outputs:
+		* name removed from the hash table and the LRU list, and freed
+*/
+void missingUnlink(struct missingName *missing)
+{
+	struct missingName **link;  // Pointer to missing within its bucket
+
+	for (link = &missingCache.buckets[cacheBucket(missing->name)]; *link != missing;
+	     link = &(*link)->hashNext) {
+	}
+	*link = missing->hashNext;
+
+	if (missing->newer != NULL) {
+		missing->newer->older = missing->older;
+	} else {
+		missingCache.newest = missing->older;
+	}
+	if (missing->older != NULL) {
+		missing->older->newer = missing->newer;
+	} else {
+		missingCache.oldest = missing->newer;
+	}
+	missingCache.numNames--;
+	free(missing->name);
+	free(missing);
+}
+
+
+/* int missingLookup(struct dirSnapshot* snapshot, const char* name)
+	* inputs:
+		* struct dirSnapshot* snapshot -- served directory
+		* const char* name -- filename requested by GET, SGET or MGET
+	* outputs:
+		* 1 -- name is known not to exist; the request gets "File not found"
+		* 0 -- name must be looked up in the directory
+	* calls:
+		* cacheBucket()
+	* purpose:
+		* answers repeat requests for a missing name with one hash lookup and no system call,
+		so a client retrying a bad name cannot keep the file system busy
+*/
+int missingLookup(struct dirSnapshot *snapshot, const char *name)
+{
+	struct missingName *missing;  // Entry being examined
+
+	if (atomic_load(&snapshot->inotifyFd) == -1) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&missingCache.lock);
+	for (missing = missingCache.buckets[cacheBucket(name)]; missing != NULL; missing = missing->hashNext) {
+		if (strcmp(missing->name, name) == 0) {
+			break;
+		}
+	}
+
+	// Hit: move the name to the head of the LRU list.
+	if (missing != NULL) {
+		if (missing != missingCache.newest) {
+			missing->newer->older = missing->older;
+			if (missing->older != NULL) {
+				missing->older->newer = missing->newer;
+			} else {
+				missingCache.oldest = missing->newer;
+			}
+			missing->newer = NULL;
+			missing->older = missingCache.newest;
+			missingCache.newest->newer = missing;
+			missingCache.newest = missing;
+		}
+		missingCache.hits++;
+	}
+	pthread_mutex_unlock(&missingCache.lock);
+	return missing != NULL;
+}
+
+
+/* void missingRecord(struct dirSnapshot* snapshot, const char* name, uint64_t epoch)
+	* inputs:
+		* struct dirSnapshot* snapshot -- served directory
+		* const char* name -- filename openServedFile() just failed to find
+		* uint64_t epoch -- missingCache.epoch read before the name was opened
+	* outputs:
+		* name remembered at the head of the LRU list, forgetting the least recently requested
+		name beyond MISSING_CACHE_LEN
+	* calls:
+		* fstatat(), cacheBucket(), missingUnlink()
+	* purpose:
+		* only names with no directory entry at all are remembered: directories, dangling
+		symbolic links and overlong names are refused by openServedFile() in O(1) anyway, and
+		a link's target can appear without an event in the served directory
+		* if names were forgotten since epoch, the name may have appeared after it was opened,
+		and its event already handled; it is then not remembered
+*/
+void missingRecord(struct dirSnapshot *snapshot, const char *name, uint64_t epoch)
+{
+	struct missingName *missing;  // New entry
+	struct stat info;             // Unused; fstatat() must fail
+	size_t bucket;                // Hash bucket of name
+
+	if (atomic_load(&snapshot->inotifyFd) == -1 ||
+	    fstatat(snapshot->dirFd, name, &info, AT_SYMLINK_NOFOLLOW) == 0 || errno != ENOENT) {
+		return;
+	}
+	bucket = cacheBucket(name);
+
+	pthread_mutex_lock(&missingCache.lock);
+	for (missing = missingCache.buckets[bucket]; missing != NULL; missing = missing->hashNext) {
+		if (strcmp(missing->name, name) == 0) {
+			break;
+		}
+	}
+	if (missing != NULL || missingCache.epoch != epoch) {
+		pthread_mutex_unlock(&missingCache.lock);
+		return;
+	}
+
+	while (missingCache.numNames >= MISSING_CACHE_LEN) {
+		missingUnlink(missingCache.oldest);
+		missingCache.evictions++;
+	}
+	missing = calloc(1, sizeof(struct missingName));
+	assert(missing != NULL); // calloc() failure check
+	missing->name = strdup(name);
+	assert(missing->name != NULL); // strdup() failure check
+	missing->hashNext = missingCache.buckets[bucket];
+	missingCache.buckets[bucket] = missing;
+	missing->older = missingCache.newest;
+	if (missingCache.newest != NULL) {
+		missingCache.newest->newer = missing;
+	} else {
+		missingCache.oldest = missing;
+	}
+	missingCache.newest = missing;
+	missingCache.numNames++;
+	pthread_mutex_unlock(&missingCache.lock);
+}
+
+
+/* void missingForget(const char* name)
+	* inputs:
+		* const char* name -- name that appeared in the served directory, or NULL after lost
+		events (or once inotify stops)
+	* outputs:
+		* name (or every name) no longer known to be missing; missingCache.epoch advanced
+	* calls:
+		* cacheBucket(), missingUnlink()
+*/
+void missingForget(const char *name)
+{
+	struct missingName *missing;  // Entry being examined
+
+	pthread_mutex_lock(&missingCache.lock);
+	missingCache.epoch++;
+	if (name == NULL) {
+		while (missingCache.oldest != NULL) {
+			missingUnlink(missingCache.oldest);
+			missingCache.invalidations++;
+		}
+	} else {
+		for (missing = missingCache.buckets[cacheBucket(name)]; missing != NULL; missing = missing->hashNext) {
+			if (strcmp(missing->name, name) == 0) {
+				missingUnlink(missing);
+				missingCache.invalidations++;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&missingCache.lock);
+}
+
+
+/* void sidecarInit(const char* path, off_t budget)
+	* inputs:
+		* const char* path -- directory for compressed variants (-z), or NULL for none
+		* off_t budget -- max number of variant bytes kept in the directory (-Z)
+	* outputs:
+		* directory created if missing and opened; compressor thread started
+	* calls:
+		* mkdir(), open(), pthread_create()
+	* purpose:
+		* the directory should lie outside the served directory; variants found there from an
+		earlier run are reused once their header shows they are still current
+*/
+void sidecarInit(const char *path, off_t budget)
+{
+	int status;  // Return status
+
+	sidecarCache.dirFd = -1;
+	sidecarCache.budget = budget;
+	pthread_mutex_init(&sidecarCache.lock, NULL);
+	pthread_cond_init(&sidecarCache.queued, NULL);
+	if (path == NULL) {
+		return;
+	}
+
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		fprintf(stderr, "ftserver: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	sidecarCache.dirFd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (sidecarCache.dirFd == -1) {
+		fprintf(stderr, "ftserver: %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	status = pthread_create(&sidecarCache.thread, NULL, sidecarMain, NULL);
+	if (status != 0) {
+		fprintf(stderr, "ftserver: pthread_create: %s\n", strerror(status));
+		exit(1);
+	}
+}
+
+
+/* void sidecarName(const struct stat* info, const char* suffix, char* name)
+	* inputs:
+		* const struct stat* info -- metadata of a served file
+		* const char* suffix -- ".z" for a published variant, ".tmp" for one being written
+		* char* name -- receives the variant's filename (SIDECAR_NAME_LEN bytes)
+	* outputs:
+		* "<device>-<inode><suffix>" in hexadecimal
+	* purpose:
+		* keying by inode keeps a variant valid across renames of its file, and lets a file
+		rewritten in place replace its own variant; a file replaced by a rename has a new inode,
+		so the old one's variant is deleted with it (sidecarForget())
+*/
+void sidecarName(const struct stat *info, const char *suffix, char *name)
+{
+	snprintf(name, SIDECAR_NAME_LEN, "%llx-%llx%s", (unsigned long long) info->st_dev,
+	         (unsigned long long) info->st_ino, suffix);
+}
+
+
+/* int sidecarOpen(const struct stat* info, off_t* bodyLength)
+	* inputs:
+		* const struct stat* info -- current metadata of a served file
+		* off_t* bodyLength -- receives the number of packet bytes following the variant's header
+	* outputs:
+		* on success -- read-only descriptor of the file's variant; *bodyLength is 0 when the
+		file does not compress enough to be sent compressed
+		* on failure -- -1: no variant, or one made before the file's size or mtime changed
+	* calls:
+		* sidecarName(), openat(), pread()
+*/
+int sidecarOpen(const struct stat *info, off_t *bodyLength)
+{
+	char name[SIDECAR_NAME_LEN];   // Variant filename
+	struct sidecarHeader header;   // Variant header
+	int fd;                        // Return value
+
+	sidecarName(info, ".z", name);
+	fd = openat(sidecarCache.dirFd, name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header.magic, SIDECAR_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.size != (uint64_t) info->st_size || header.mtimeSec != info->st_mtim.tv_sec ||
+	    header.mtimeNsec != info->st_mtim.tv_nsec) {
+		close(fd);
+		pthread_mutex_lock(&sidecarCache.lock);
+		sidecarCache.stale++;
+		pthread_mutex_unlock(&sidecarCache.lock);
+		return -1;
+	}
+
+	*bodyLength = header.bodyLength;
+	return fd;
+}
+
+
+/* void sidecarRequest(struct openFile* file)
+	* inputs:
+		* struct openFile* file -- file fetched by a compressing GET/SGET without a current variant
+	* outputs:
+		* the fetch counted; the file queued for the compressor thread once it has been fetched
+		SIDECAR_MIN_FETCHES times
+	* purpose:
+		* popularity is counted on the open-file cache entry, so a file evicted from that cache
+		starts over; a full queue leaves the file to be counted again on later fetches
+*/
+void sidecarRequest(struct openFile *file)
+{
+	pthread_mutex_lock(&fileCache.lock);
+	if (!file->sidecarQueued && ++file->sidecarFetches >= SIDECAR_MIN_FETCHES) {
+		pthread_mutex_lock(&sidecarCache.lock);
+		if (sidecarCache.numJobs < SIDECAR_QUEUE_LEN) {
+			file->sidecarQueued = 1;
+			file->sidecarFetches = 0;
+			file->refs++;
+			sidecarCache.jobs[(sidecarCache.firstJob + sidecarCache.numJobs) % SIDECAR_QUEUE_LEN] = file;
+			sidecarCache.numJobs++;
+			pthread_cond_signal(&sidecarCache.queued);
+		}
+		pthread_mutex_unlock(&sidecarCache.lock);
+	}
+	pthread_mutex_unlock(&fileCache.lock);
+}
+
+
+/* void sidecarForget(const struct stat* info)
+	* inputs:
+		* const struct stat* info -- metadata of a served file that has no links left
+	* outputs:
+		* the file's variant, if any, deleted
+	* calls:
+		* sidecarName(), unlinkat()
+	* purpose:
+		* called by the watch thread, so a deleted or rename-replaced file does not leave its
+		variant behind; its inode may be reused by an unrelated file later
+*/
+void sidecarForget(const struct stat *info)
+{
+	char name[SIDECAR_NAME_LEN];  // Variant filename
+
+	sidecarName(info, ".z", name);
+	if (unlinkat(sidecarCache.dirFd, name, 0) == 0) {
+		pthread_mutex_lock(&sidecarCache.lock);
+		sidecarCache.removals++;
+		pthread_mutex_unlock(&sidecarCache.lock);
+	}
+}
+
+
+/* int compareVariants(const void* a, const void* b)
+	* inputs:
+		* const void* a, b -- pointers to struct sidecarEntry
+	* outputs:
+		* negative if a was read less recently than b, positive if more recently, else 0
+	* purpose:
+		* qsort() comparator putting the variants to delete first
+*/
+int compareVariants(const void *a, const void *b)
+{
+	const struct timespec *first = &((const struct sidecarEntry *) a)->used;
+	const struct timespec *second = &((const struct sidecarEntry *) b)->used;
+
+	if (first->tv_sec != second->tv_sec) {
+		return first->tv_sec < second->tv_sec ? -1 : 1;
+	}
+	return (first->tv_nsec > second->tv_nsec) - (first->tv_nsec < second->tv_nsec);
+}
+
+
+/* void sidecarSweep(void)
+	* outputs:
+		* leftover ".tmp" files deleted; the least recently read variants deleted until the rest
+		fit in sidecarCache.budget
+	* calls:
+		* openat(), getdents64(), fstatat(), qsort(), compareVariants(), unlinkat()
+	* purpose:
+		* run by the compressor thread, the only writer of the directory, so a ".tmp" file seen
+		here was left by an earlier run
+		* also bounds the variants of files deleted while the open-file cache did not hold
+		them, which sidecarForget() never hears of
+		* access times are as precise as the mount records them (relatime: about daily)
+*/
+void sidecarSweep(void)
+{
+	char entries[DIRENT_BUF_LEN] __attribute__((aligned(__alignof__(struct dirent64))));
+	struct dirent64 *entry;             // Entry within the directory
+	ssize_t length;                     // Number of entry bytes read
+	char *position;                     // Next entry within entries
+	size_t nameLength;                  // Number of bytes in the entry's name
+	struct stat info;                   // Metadata of a variant
+	struct sidecarEntry *variants = NULL; // Variants found
+	int numVariants = 0;                // Number of variants found
+	int capacity = 0;                   // Number of entries allocated in variants
+	off_t bytes = 0;                    // Number of variant bytes kept
+	unsigned long long removed = 0;     // Number of variants deleted
+	int scanFd;                         // Descriptor being read
+	int index;                          // Variant being examined
+
+	scanFd = openat(sidecarCache.dirFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (scanFd == -1) {
+		perror("openat");
+		return;
+	}
+
+	while ((length = getdents64(scanFd, entries, sizeof(entries))) > 0) {
+		for (position = entries; position < entries + length; position += entry->d_reclen) {
+			entry = (struct dirent64 *) position;
+			nameLength = strlen(entry->d_name);
+			if (nameLength >= SIDECAR_NAME_LEN) {
+				continue;
+			}
+
+			if (nameLength > 4 && strcmp(entry->d_name + nameLength - 4, ".tmp") == 0) {
+				unlinkat(sidecarCache.dirFd, entry->d_name, 0);
+				continue;
+			}
+			if (nameLength <= 2 || strcmp(entry->d_name + nameLength - 2, ".z") != 0 ||
+			    fstatat(sidecarCache.dirFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == -1 ||
+			    !S_ISREG(info.st_mode)) {
+				continue;
+			}
+
+			if (numVariants == capacity) {
+				capacity = capacity > 0 ? capacity * 2 : 64;
+				variants = realloc(variants, capacity * sizeof(struct sidecarEntry));
+				assert(variants != NULL); // realloc() failure check
+			}
+			memcpy(variants[numVariants].name, entry->d_name, nameLength + 1);
+			variants[numVariants].size = info.st_size;
+			variants[numVariants].used = info.st_atim;
+			numVariants++;
+			bytes += info.st_size;
+		}
+	}
+	if (length == -1) {
+		perror("getdents64");
+	}
+	close(scanFd);
+
+	// Delete the least recently read variants until the rest fit.
+	if (bytes > sidecarCache.budget) {
+		qsort(variants, numVariants, sizeof(struct sidecarEntry), compareVariants);
+		for (index = 0; index < numVariants && bytes > sidecarCache.budget; index++) {
+			if (unlinkat(sidecarCache.dirFd, variants[index].name, 0) == 0) {
+				bytes -= variants[index].size;
+				removed++;
+			}
+		}
+	}
+	free(variants);
+
+	pthread_mutex_lock(&sidecarCache.lock);
+	sidecarCache.bytes = bytes;
+	sidecarCache.removals += removed;
+	pthread_mutex_unlock(&sidecarCache.lock);
+}
+
+
+/* void sidecarFrameHeader(char* header, char* option, uint64_t dataLength)
+	* inputs:
+		* char* header -- receives a version 2 packet header (PACK2_HEADER_LEN bytes)
+		* char* option -- packet tag (FILE or ZFILE)
+		* uint64_t dataLength -- number of data bytes that will follow the header
+	* purpose:
+		* same layout as sendFrameHeader() in version 2, so variants hold the exact bytes a
+		compressing GET sends
+*/
+void sidecarFrameHeader(char *header, char *tag, uint64_t dataLength)
+{
+	uint64_t length = htobe64(dataLength);  // Big-endian length field
+
+	memcpy(header, &length, sizeof(length));
+	memset(header + sizeof(length), '\0', ARG_LEN);
+	memcpy(header + sizeof(length), tag, strlen(tag));
+}
+
+
+/* int sidecarWrite(int fd, const char* bytes, size_t numBytes, off_t offset)
+	* outputs:
+		* 0 -- all numBytes bytes written at offset
+		* -1 -- pwrite() failed (disk full, ...)
+*/
+int sidecarWrite(int fd, const char *bytes, size_t numBytes, off_t offset)
+{
+	ssize_t ret;  // Return value of pwrite()
+
+	while (numBytes > 0) {
+		ret = pwrite(fd, bytes, numBytes, offset);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1) {
+			perror("pwrite");
+			return -1;
+		}
+		bytes += ret;
+		numBytes -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+
+/* void sidecarBuild(struct openFile* file, char* chunk, char* packet)
+	* inputs:
+		* struct openFile* file -- frequently fetched file
+		* char* chunk -- SIDECAR_CHUNK_LEN bytes of scratch space
+		* char* packet -- PACK2_HEADER_LEN + SIDECAR_CHUNK_LEN bytes of scratch space
+	* outputs:
+		* the file's variant written to "<device>-<inode>.tmp", then renamed into place
+	* calls:
+		* fstat(), pread(), compress2(), sidecarFrameHeader(), sidecarWrite(), renameat()
+	* purpose:
+		* stores the packets a compressing GET of the whole file sends, ending with the empty
+		FILE packet, so GET and SGET can send them with sendfile(); each chunk is compressed
+		separately (as on the fly) but at SIDECAR_LEVEL, and sent as is unless it shrinks by
+		1/16
+		* a file that does not shrink by 1/16 overall gets a header without packets, so later
+		fetches send it uncompressed without trying
+		* the variant is dropped if the file changed, or was deleted, while it was read; the
+		header is written last, and the rename publishes the variant atomically
+*/
+void sidecarBuild(struct openFile *file, char *chunk, char *packet)
+{
+	char name[SIDECAR_NAME_LEN];      // Variant filename
+	char tmpName[SIDECAR_NAME_LEN];   // Filename while it is written
+	struct sidecarHeader header;      // Variant header
+	struct stat before;               // File metadata before reading
+	struct stat after;                // File metadata after reading
+	off_t offset;                     // Next file byte to read
+	off_t position;                   // Next variant byte to write
+	ssize_t bytesRead;                // Number of bytes of the current chunk
+	size_t numBytes;                  // Number of bytes to read
+	uLongf compressedLength;          // Capacity, then length, of the compressed chunk
+	size_t dataLength;                // Number of data bytes of the current packet
+	int out;                          // Variant being written
+
+	if (fstat(file->fd, &before) == -1 || before.st_nlink == 0) {
+		return;
+	}
+	sidecarName(&before, ".z", name);
+	sidecarName(&before, ".tmp", tmpName);
+	out = openat(sidecarCache.dirFd, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out == -1) {
+		perror("openat");
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SIDECAR_MAGIC, sizeof(header.magic));
+	header.size = before.st_size;
+	header.mtimeSec = before.st_mtim.tv_sec;
+	header.mtimeNsec = before.st_mtim.tv_nsec;
+
+	position = sizeof(header);
+	for (offset = 0; ; offset += bytesRead) {
+		numBytes = before.st_size - offset < SIDECAR_CHUNK_LEN ? (size_t) (before.st_size - offset) : SIDECAR_CHUNK_LEN;
+		bytesRead = 0;
+		if (numBytes > 0) {
+			bytesRead = pread(file->fd, chunk, numBytes, offset);
+		}
+		// The file shrank, or could not be read.
+		if (bytesRead <= 0 && numBytes > 0) {
+			goto discard;
+		}
+
+		compressedLength = bytesRead - bytesRead / 16;
+		if (bytesRead >= COMPRESS_MIN_LEN &&
+		    compress2((Bytef *) packet + PACK2_HEADER_LEN, &compressedLength, (const Bytef *) chunk,
+		              bytesRead, SIDECAR_LEVEL) == Z_OK) {
+			sidecarFrameHeader(packet, "ZFILE", compressedLength);
+			dataLength = compressedLength;
+		} else {
+			sidecarFrameHeader(packet, "FILE", bytesRead);
+			memcpy(packet + PACK2_HEADER_LEN, chunk, bytesRead);
+			dataLength = bytesRead;
+		}
+		if (sidecarWrite(out, packet, PACK2_HEADER_LEN + dataLength, position) == -1) {
+			goto discard;
+		}
+		position += PACK2_HEADER_LEN + dataLength;
+
+		// The empty FILE packet marks the end of the file.
+		if (bytesRead == 0) {
+			break;
+		}
+	}
+	header.bodyLength = position - sizeof(header);
+
+	// Not worth sending compressed: keep only the header.
+	if (header.bodyLength > (uint64_t) (before.st_size - before.st_size / 16)) {
+		header.bodyLength = 0;
+		if (ftruncate(out, sizeof(header)) == -1) {
+			perror("ftruncate");
+			goto discard;
+		}
+	}
+
+	// The file must not have changed, or been deleted, while it was read.
+	if (fstat(file->fd, &after) == -1 || after.st_nlink == 0 || after.st_size != before.st_size ||
+	    after.st_mtim.tv_sec != before.st_mtim.tv_sec || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec) {
+		goto discard;
+	}
+	if (sidecarWrite(out, (char *) &header, sizeof(header), 0) == -1) {
+		goto discard;
+	}
+	close(out);
+	if (renameat(sidecarCache.dirFd, tmpName, sidecarCache.dirFd, name) == -1) {
+		perror("renameat");
+		unlinkat(sidecarCache.dirFd, tmpName, 0);
+		return;
+	}
+
+	pthread_mutex_lock(&sidecarCache.lock);
+	sidecarCache.builds++;
+	if (header.bodyLength == 0) {
+		sidecarCache.incompressible++;
+	}
+	pthread_mutex_unlock(&sidecarCache.lock);
+	return;
+
+discard:
+	close(out);
+	unlinkat(sidecarCache.dirFd, tmpName, 0);
+}
+
+
+/* void* sidecarMain(void* arg)
+	* inputs:
+		* void* arg -- unused
+	* outputs:
+		* never returns
+	* calls:
+		* sidecarSweep(), sidecarBuild(), fileCacheDrop()
+	* purpose:
+		* compressor thread: writes the variants of queued files one at a time, off the workers,
+		so the CPU cost of compressing a hot file is paid once instead of on every fetch
+		* sweeps the directory on start-up and after each variant, so it stays within its budget
+*/
+void *sidecarMain(void *arg)
+{
+	struct openFile *file;   // File being compressed
+	char *chunk;             // File bytes read
+	char *packet;            // Packet written to the variant
+
+	(void) arg;
+	chunk = malloc(SIDECAR_CHUNK_LEN);
+	packet = malloc(PACK2_HEADER_LEN + SIDECAR_CHUNK_LEN);
+	assert(chunk != NULL && packet != NULL); // malloc() failure check
+
+	sidecarSweep();
+	while (1) {
+		pthread_mutex_lock(&sidecarCache.lock);
+		while (sidecarCache.numJobs == 0) {
+			pthread_cond_wait(&sidecarCache.queued, &sidecarCache.lock);
+		}
+		file = sidecarCache.jobs[sidecarCache.firstJob];
+		sidecarCache.firstJob = (sidecarCache.firstJob + 1) % SIDECAR_QUEUE_LEN;
+		sidecarCache.numJobs--;
+		pthread_mutex_unlock(&sidecarCache.lock);
+
+		sidecarBuild(file, chunk, packet);
+
+		pthread_mutex_lock(&fileCache.lock);
+		file->sidecarQueued = 0;
+		fileCacheDrop(file);
+		pthread_mutex_unlock(&fileCache.lock);
+
+		sidecarSweep();
+	}
+	return NULL;
+}
+
+
+/* long long monotonicMs()
+	* inputs:
+		* none
+	* outputs:
+		* milliseconds elapsed on the monotonic clock
+	* calls:
+		* clock_gettime(CLOCK_MONOTONIC, struct timespec* tp)
+	* purpose:
+		* timestamps used to schedule data connection retries; unaffected by changes to the wall clock
+*/
+long long monotonicMs()
+{
+	struct timespec now;  // Current monotonic time
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* void* arenaAlloc(struct arena* arena, size_t numBytes)
+	* inputs:
+		* struct arena* arena -- allocator to carve from
+		* size_t numBytes -- number of bytes needed
+	* outputs:
+		* pointer to numBytes of uninitialized memory, aligned to ARENA_ALIGN
+	* calls:
+		* malloc()
+	* purpose:
+		* bumps the current block's offset; a new block (ARENA_BLOCK_LEN bytes, or numBytes if
+		larger) is only malloc()ed when the current one is full
+*/
+void *arenaAlloc(struct arena *arena, size_t numBytes)
+{
+	struct arenaBlock *block = arena->blocks;  // Block being filled
+	size_t size;                               // Usable bytes of a new block
+
+	numBytes = (numBytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (block == NULL || block->size - block->used < numBytes) {
+		size = numBytes > ARENA_BLOCK_LEN ? numBytes : ARENA_BLOCK_LEN;
+		block = malloc(sizeof(struct arenaBlock) + size);
+		assert(block != NULL); // malloc() failure check
+		block->next = arena->blocks;
+		block->size = size;
+		block->used = 0;
+		arena->blocks = block;
+		atomic_fetch_add_explicit(&arenaStats.blocks, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&arenaStats.blockBytes, sizeof(struct arenaBlock) + size,
+		                          memory_order_relaxed);
+	}
+
+	arena->last = (char *) block->data + block->used;
+	block->used += numBytes;
+	atomic_fetch_add_explicit(&arenaStats.allocations, 1, memory_order_relaxed);
+	return arena->last;
+}
+
+
+/* void* arenaGrow(struct arena* arena, void* bytes, size_t oldBytes, size_t numBytes)
+	* inputs:
+		* struct arena* arena -- allocator that returned bytes
+		* void* bytes -- allocation to grow, or NULL
+		* size_t oldBytes -- current size of the allocation
+		* size_t numBytes -- new size (larger than oldBytes)
+	* outputs:
+		* pointer to numBytes of memory starting with the allocation's oldBytes
+	* calls:
+		* arenaAlloc(), memcpy()
+	* purpose:
+		* realloc() for arena memory: the most recent allocation is extended in place when its
+		block has room; otherwise the bytes are copied and the old space is only reclaimed with
+		the arena (buffers double, so at most half of what they use is left behind)
+*/
+void *arenaGrow(struct arena *arena, void *bytes, size_t oldBytes, size_t numBytes)
+{
+	struct arenaBlock *block = arena->blocks;  // Block being filled
+	size_t offset;                             // Position of bytes within block
+	char *grown;                               // Return value
+
+	if (bytes != NULL && bytes == arena->last) {
+		offset = (char *) bytes - (char *) block->data;
+		numBytes = (numBytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+		if (block->size - offset >= numBytes) {
+			block->used = offset + numBytes;
+			atomic_fetch_add_explicit(&arenaStats.allocations, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&arenaStats.grownInPlace, 1, memory_order_relaxed);
+			return bytes;
+		}
+	}
+
+	grown = arenaAlloc(arena, numBytes);
+	if (bytes != NULL) {
+		memcpy(grown, bytes, oldBytes);
+	}
+	return grown;
+}
+
+
+/* void arenaRelease(struct arena* arena)
+	* inputs:
+		* struct arena* arena -- allocator to release (not stored in its own memory)
+	* outputs:
+		* every block free()d; the arena is empty
+	* purpose:
+		* ends a session with one free() per block (usually a single one) instead of one per
+		buffer, list and string
+*/
+void arenaRelease(struct arena *arena)
+{
+	struct arenaBlock *block;  // Block being freed
+
+	while (arena->blocks != NULL) {
+		block = arena->blocks;
+		arena->blocks = block->next;
+		free(block);
+		atomic_fetch_add_explicit(&arenaStats.freedBlocks, 1, memory_order_relaxed);
+	}
+	arena->last = NULL;
+	atomic_fetch_add_explicit(&arenaStats.releases, 1, memory_order_relaxed);
+}
+
+
+/* void sendStats(struct session* session)
+	* inputs:
+		* struct session* session -- session that sent STATS
+	* outputs:
+		* STATS packet queued on the control connection
+	* calls:
+		* snprintf(), sendPack()
+	* purpose:
+		* reports the arena, compression, content cache, open-file cache, missing-name cache and
+		compressed-variant counters as "<name>=<value>" pairs, so the effect of the allocator, compression and the
+		caches can be checked on a running server
+*/
+void sendStats(struct session *session)
+{
+	char stats[MAX_STATS_LEN + 1];         // Packet data
+	unsigned long long blocks = atomic_load(&arenaStats.blocks);
+	unsigned long long freedBlocks = atomic_load(&arenaStats.freedBlocks);
+	int length;                            // Number of bytes in stats
+
+	length = snprintf(stats, sizeof(stats),
+	                  "arena_blocks=%llu arena_live_blocks=%llu arena_block_bytes=%llu arena_allocations=%llu "
+	                  "arena_grown_in_place=%llu arena_releases=%llu",
+	                  blocks, blocks - freedBlocks, (unsigned long long) atomic_load(&arenaStats.blockBytes),
+	                  (unsigned long long) atomic_load(&arenaStats.allocations),
+	                  (unsigned long long) atomic_load(&arenaStats.grownInPlace),
+	                  (unsigned long long) atomic_load(&arenaStats.releases));
+
+	length += snprintf(stats + length, sizeof(stats) - length,
+	                   " compress_chunks=%llu compress_raw_chunks=%llu compress_skipped_chunks=%llu "
+	                   "compress_in_bytes=%llu compress_out_bytes=%llu",
+	                   (unsigned long long) atomic_load(&compressStats.chunks),
+	                   (unsigned long long) atomic_load(&compressStats.rawChunks),
+	                   (unsigned long long) atomic_load(&compressStats.skippedChunks),
+	                   (unsigned long long) atomic_load(&compressStats.inBytes),
+	                   (unsigned long long) atomic_load(&compressStats.outBytes));
+
+	pthread_mutex_lock(&contentCache.lock);
+	snprintf(stats + length, sizeof(stats) - length,
+	         " cache_hits=%llu cache_misses=%llu cache_hit_bytes=%llu cache_entries=%zu cache_bytes=%zu "
+	         "cache_budget=%zu cache_evictions=%llu cache_invalidations=%llu",
+	         contentCache.hits, contentCache.misses, contentCache.hitBytes, contentCache.numEntries,
+	         contentCache.bytes, contentCache.budget, contentCache.evictions, contentCache.invalidations);
+	pthread_mutex_unlock(&contentCache.lock);
+
+	length = strlen(stats);
+	pthread_mutex_lock(&fileCache.lock);
+	snprintf(stats + length, sizeof(stats) - length,
+	         " fd_hits=%llu fd_misses=%llu fd_open=%d fd_evictions=%llu fd_invalidations=%llu",
+	         fileCache.hits, fileCache.misses, fileCache.numFiles, fileCache.evictions,
+	         fileCache.invalidations);
+	pthread_mutex_unlock(&fileCache.lock);
+
+	length = strlen(stats);
+	pthread_mutex_lock(&missingCache.lock);
+	snprintf(stats + length, sizeof(stats) - length,
+	         " missing_hits=%llu missing_names=%d missing_evictions=%llu missing_invalidations=%llu",
+	         missingCache.hits, missingCache.numNames, missingCache.evictions, missingCache.invalidations);
+	pthread_mutex_unlock(&missingCache.lock);
+
+	length = strlen(stats);
+	pthread_mutex_lock(&sidecarCache.lock);
+	snprintf(stats + length, sizeof(stats) - length,
+	         " sidecar_hits=%llu sidecar_builds=%llu sidecar_incompressible=%llu sidecar_stale=%llu "
+	         "sidecar_queued=%d sidecar_bytes=%lld sidecar_removals=%llu",
+	         sidecarCache.hits, sidecarCache.builds, sidecarCache.incompressible, sidecarCache.stale,
+	         sidecarCache.numJobs, (long long) sidecarCache.bytes, sidecarCache.removals);
+	pthread_mutex_unlock(&sidecarCache.lock);
+	sendPack(session, &session->controlOut, "STATS", stats);
+}
+
+
+/* void sendSize(struct session* session, char* filename)
+	* inputs:
+		* struct session* session -- session that sent SIZE
+		* char* filename -- requested filename
+	* outputs:
+		* SIZE "<length>" packet queued on the control connection, or ERROR
+	* calls:
+		* missingLookup(), fileCacheAcquire(), fileCacheRelease(), snprintf(), sendPack()
+	* purpose:
+		* lets a client split a file into RANGEs fetched over several connections at once; the
+		name is resolved as GET resolves it, and its descriptor stays cached for the ranges
+*/
+void sendSize(struct session *session, char *filename)
+{
+	struct openFile *file;  // Requested file
+	struct stat info;       // Information concerning the requested file
+	char sizeText[32];      // File length in decimal
+
+	printf("  Transmitting file size ...\n");
+	if (missingLookup(session->snapshot, filename)) {
+		file = NULL;
+		errno = ENOENT;
+	} else {
+		file = fileCacheAcquire(session->snapshot, filename, &info);
+	}
+	if (file == NULL) {
+		sendPack(session, &session->controlOut, "ERROR", errno == ENOENT ? "File not found" : "Unable to open file");
+		return;
+	}
+	fileCacheRelease(file);
+
+	snprintf(sizeText, sizeof(sizeText), "%lld", (long long) info.st_size);
+	sendPack(session, &session->controlOut, "SIZE", sizeText);
+}
+
+
+/* void bufferReserve(struct buffer* buffer, size_t numBytes)
+	* inputs:
+		* struct buffer* buffer -- byte queue to grow
+		* size_t numBytes -- number of bytes that must fit after buffer->end
+	* outputs:
+		* buffer->bytes holds at least numBytes of free space past buffer->end
+	* calls:
+		* memmove(), arenaGrow()
+	* purpose:
+		* reclaims consumed bytes at the front of the queue before growing it, so a session's
+		buffers stay near IO_BUF_LEN no matter how many packets pass through them
+*/
+void bufferReserve(struct buffer *buffer, size_t numBytes)
+{
+	size_t capacity;  // New allocation size
+
+	// Enough free space already exists past the last stored byte.
+	if (buffer->end + numBytes <= buffer->capacity) {
+		return;
+	}
+
+	// Slide unconsumed bytes to the front of the buffer.
+	if (buffer->start > 0) {
+		memmove(buffer->bytes, buffer->bytes + buffer->start, buffer->end - buffer->start);
+		buffer->end -= buffer->start;
+		buffer->start = 0;
+	}
+
+	// Double the allocation until the requested space fits.
+	if (buffer->end + numBytes > buffer->capacity) {
+		capacity = buffer->capacity > 0 ? buffer->capacity : IO_BUF_LEN;
+		while (capacity < buffer->end + numBytes) {
+			capacity *= 2;
+		}
+		buffer->bytes = arenaGrow(buffer->arena, buffer->bytes, buffer->capacity, capacity);
+		buffer->capacity = capacity;
+	}
+}
+
+
+/* void ringPeek(struct ringBuffer* ring, size_t offset, void* dest, size_t numBytes)
+	* inputs:
+		* struct ringBuffer* ring -- received bytes
+		* size_t offset -- position relative to the first unconsumed byte
+		* void* dest -- receives the bytes
+		* size_t numBytes -- number of bytes to copy
+	* outputs:
+		* dest holds the bytes, even when they wrap around the end of the ring
+	* calls:
+		* memcpy()
+	* purpose:
+		* reads a packet field without consuming it
+*/
+void ringPeek(struct ringBuffer *ring, size_t offset, void *dest, size_t numBytes)
+{
+	size_t index = (ring->head + offset) & (ring->capacity - 1);  // Position within storage
+	size_t firstPart;                                              // Bytes before the wrap
+
+	firstPart = ring->capacity - index < numBytes ? ring->capacity - index : numBytes;
+	memcpy(dest, ring->bytes + index, firstPart);
+	memcpy((char *) dest + firstPart, ring->bytes, numBytes - firstPart);
+}
+
+
+/* int recvFile(int sockfd, struct ringBuffer* ring)
+	* inputs:
+		* int sockfd -- file descriptor of a non-blocking socket
+		* struct ringBuffer* ring -- receives the client's data
+	* outputs:
+		* 1 -- connection open; all currently available data (up to the ring's free space) stored
+		* 0 -- client closed the connection
+		* -1 -- readv() failed
+	* calls:
+		* ssize_t readv(int fd, const struct iovec* iov, int iovcnt)
+			* scatters the received bytes over the ring's free space, which is split in two
+			when it wraps around the end of the storage
+			* returns -- on success number of bytes received ; on failure -1
+				* a non-blocking socket fails with EAGAIN/EWOULDBLOCK instead of blocking when
+				no data is available
+	* purpose:
+		* receive whatever the client has sent so far without blocking the reactor; packets are
+		decoded from the ring by recvPack() once they are complete, many per readv() when the
+		client sends them back to back
+*/
+int recvFile(int socket, struct ringBuffer *ring)
+{
+	struct iovec iov[2];   // Free space of the ring
+	size_t freeBytes;      // Number of bytes the ring can still hold
+	size_t tailIndex;      // Position of the next received byte within storage
+	ssize_t ret;           // Return value for 'readv'
+
+	while ((freeBytes = ring->capacity - (ring->tail - ring->head)) > 0) {
+		tailIndex = ring->tail & (ring->capacity - 1);
+		iov[0].iov_base = ring->bytes + tailIndex;
+		iov[0].iov_len = ring->capacity - tailIndex < freeBytes ? ring->capacity - tailIndex : freeBytes;
+		iov[1].iov_base = ring->bytes;
+		iov[1].iov_len = freeBytes - iov[0].iov_len;
+		ret = readv(socket, iov, iov[1].iov_len > 0 ? 2 : 1);
+
+		// Data received; a short read means the socket has been drained.
+		if (ret > 0) {
+			ring->tail += ret;
+			if ((size_t) ret < freeBytes) {
+				return 1;
+			}
+		}
+
+		// Client closed the connection.
+		else if (ret == 0) {
+			return 0;
+		}
+
+		// No more data is available right now.
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 1;
+		}
+
+		// Error encountered.
+		else if (errno != EINTR) {
+			perror("readv");
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+
+/* int recvPack(struct ringBuffer* ring, int version, char* option, char* data){
+	* inputs:
+		* struct ringBuffer* ring -- bytes received from the client so far
+		* int version -- framing negotiated for the connection (1 or 2)
+		* char* option -- a string that holds an option from client command line to be received
+		* char* data -- a string that holds the data from the client command line to be received
+	* outputs:
+		* 1 -- one packet consumed from the ring; option, data modified and now hold data read in from client
+		* 0 -- the ring does not yet hold a complete packet (the partial packet stays in the ring)
+		* -1 -- malformed packet length
+	* calls:
+		* ringPeek()
+	* purpose:
+		* decodes data packets received from a client socket connection: ref: Beej's Guide to Network Programming: section 7.5, page 53
+			* version 1:
+				* len (2 bytes, unsigned) -- total length of the packet, counting the 8-byte command option (-l || -g) and n-bytes data
+				* command option (8-bytes)
+				* client data (n-bytes)
+			* version 2:
+				* len (8 bytes, unsigned) -- number of data bytes
+				* command option (8-bytes)
+				* client data (n-bytes)
+		* control packets carry commands, so their data is limited to MAX_PACK_PAYLOAD_LEN
+		bytes and null-terminated in either version
+
+*/
+int recvPack(struct ringBuffer *ring, int version, char *tag, char *data)
+{
+	uint64_t dataLength;               // Number of bytes in encapsulated data
+	size_t headerLength;               // Number of bytes in packet header
+
+	// Wait until the packet length has arrived.
+	headerLength = FRAME_HEADER_LEN(version);
+	if (ring->tail - ring->head < headerLength) {
+		return 0;
+	}
+
+	//ntohs(uint16_t netshort)/be64toh(uint64_t): functions that convert integers from network byte (Big Endian) order to host byte order (little Endian)
+	if (version == 1) {
+		unsigned short packetLength;       // Number of bytes in packet
+		ringPeek(ring, 0, &packetLength, sizeof(packetLength));
+		packetLength = ntohs(packetLength);
+		if (packetLength < PACK_HEADER_LEN) {
+			return -1;
+		}
+		dataLength = packetLength - PACK_HEADER_LEN;
+	} else {
+		ringPeek(ring, 0, &dataLength, sizeof(dataLength));
+		dataLength = be64toh(dataLength);
+	}
+	if (dataLength > MAX_PACK_PAYLOAD_LEN) {
+		return -1;
+	}
+
+	// Wait until the rest of the packet has arrived.
+	if (ring->tail - ring->head < headerLength + dataLength) {
+		return 0;
+	}
+
+	//copy client command; set string terminator character to end of tag to mark end of option string
+	if (tag != NULL) {
+		ringPeek(ring, headerLength - ARG_LEN, tag, ARG_LEN);
+		tag[ARG_LEN] = '\0';
+	}
+
+	//copy data payload; set string terminator character to end of data to mark end of data string
+	if (data != NULL) {
+		ringPeek(ring, headerLength, data, dataLength);
+		data[dataLength] = '\0';
+	}
+
+	ring->head += headerLength + dataLength;
+	return 1;
+}
+
+
+/* char* writerReserve(struct frameWriter* writer, size_t numBytes)
+	* inputs:
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* size_t numBytes -- number of bytes the caller is about to store
+	* outputs:
+		* pointer to numBytes of free space at the end of the writer's buffer
+	* calls:
+		* bufferReserve()
+	* purpose:
+		* lets packets be built in place; writerCommit() queues the bytes once they are filled in
+*/
+char *writerReserve(struct frameWriter *writer, size_t numBytes)
+{
+	bufferReserve(&writer->buffer, numBytes);
+	return writer->buffer.bytes + writer->buffer.end;
+}
+
+
+/* void writerQueue(struct frameWriter* writer, char* bytes, size_t offset, size_t numBytes)
+	* inputs:
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* char* bytes -- caller-owned bytes, or NULL for bytes within the writer's buffer
+		* size_t offset -- offset of the bytes within the writer's buffer (bytes == NULL)
+		* size_t numBytes -- number of bytes
+	* outputs:
+		* segment appended to the writer's transmission order
+	* calls:
+		* arenaGrow()
+	* purpose:
+		* consecutive bytes of the writer's buffer share one segment, so a run of small packets
+		costs a single iovec no matter how many packets it holds
+*/
+void writerQueue(struct frameWriter *writer, char *bytes, size_t offset, size_t numBytes)
+{
+	struct segment *last;  // Most recently queued segment
+
+	writer->pending += numBytes;
+
+	// Extend the previous segment when the new bytes directly follow it in the buffer.
+	last = writer->count > 0 ? &writer->segments[writer->count - 1] : NULL;
+	if (bytes == NULL && last != NULL && last->bytes == NULL && last->offset + last->length == offset) {
+		last->length += numBytes;
+		return;
+	}
+
+	if (writer->count == writer->capacity) {
+		writer->segments = arenaGrow(writer->buffer.arena, writer->segments,
+		                             writer->capacity * sizeof(struct segment),
+		                             (writer->capacity > 0 ? writer->capacity * 2 : 16) * sizeof(struct segment));
+		writer->capacity = writer->capacity > 0 ? writer->capacity * 2 : 16;
+	}
+	writer->segments[writer->count].bytes = bytes;
+	writer->segments[writer->count].offset = offset;
+	writer->segments[writer->count].length = numBytes;
+	writer->count++;
+}
+
+
+/* void writerCommit(struct frameWriter* writer, size_t numBytes)
+	* inputs:
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* size_t numBytes -- number of bytes stored at the pointer returned by writerReserve()
+	* outputs:
+		* the bytes are queued for transmission
+	* purpose:
+		* second half of writerReserve()
+*/
+void writerCommit(struct frameWriter *writer, size_t numBytes)
+{
+	writerQueue(writer, NULL, writer->buffer.end, numBytes);
+	writer->buffer.end += numBytes;
+}
+
+
+/* void writerReset(struct frameWriter* writer)
+	* inputs:
+		* struct frameWriter* writer -- outgoing packet queue
+	* outputs:
+		* all queued bytes discarded; memory kept for reuse
+	* purpose:
+		* empties a writer once everything has been sent, or when its connection is closed
+*/
+void writerReset(struct frameWriter *writer)
+{
+	writer->buffer.start = writer->buffer.end = 0;
+	writer->first = writer->count = 0;
+	writer->pending = 0;
+}
+
+
+/* int sendFile(int sockfd, struct frameWriter* writer, int flags){
+	* inputs:
+                * int sockfd -- file descriptor of a non-blocking socket
+                * struct frameWriter* writer -- queued packets waiting to be sent
+                * int flags -- MSG_MORE when more data will follow the queued packets
+	* outputs:
+		* 0 -- as many bytes as the socket would accept have been sent (consumed from writer)
+		* -1 -- sendmsg() failed
+	* calls:
+		* sendmsg() -- gathers the queued segments into one transmission, like writev(), while
+		still accepting send() flags
+			* returns number of bytes sent on success, -1 on failure
+			* MSG_NOSIGNAL -- report EPIPE instead of raising SIGPIPE when the client has gone away
+			* MSG_MORE -- hold a partial segment back because more data will follow
+	* purpose:
+		* send queued data until the writer is empty or the socket's send buffer is full; every
+		packet queued since the last flush (headers, copied data, and referenced data) leaves in a
+		single system call
+
+*/
+int sendFile(int socket, struct frameWriter *writer, int flags)
+{
+	struct iovec iov[MAX_IOV];       // Segments gathered for one sendmsg()
+	struct msghdr message;           // sendmsg() arguments
+	struct segment *segment;         // Segment being gathered or consumed
+	ssize_t ret;                     //holds return value of sendmsg()
+	size_t numIov;                   // Number of entries in iov
+	size_t i;                        //for loop iterator
+
+	while (writer->pending > 0) {
+		// Gather the unsent segments.
+		numIov = 0;
+		for (i = writer->first; i < writer->count && numIov < MAX_IOV; i++) {
+			segment = &writer->segments[i];
+			iov[numIov].iov_base = segment->bytes != NULL ? segment->bytes
+			                                              : writer->buffer.bytes + segment->offset;
+			iov[numIov].iov_len = segment->length;
+			numIov++;
+		}
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = numIov;
+
+		ret = sendmsg(socket, &message, MSG_NOSIGNAL | flags);
+
+		// Socket cannot accept more data right now.
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+
+		// Error encountered.
+		else if (ret == -1 && errno != EINTR) {
+			perror("sendmsg");
+			return -1;
+		}
+
+		// Data sent; consume whole segments, then the sent part of a partially sent one.
+		writer->pending -= ret > 0 ? ret : 0;
+		while (ret > 0) {
+			segment = &writer->segments[writer->first];
+			if ((size_t) ret >= segment->length) {
+				ret -= segment->length;
+				writer->first++;
+			} else {
+				if (segment->bytes != NULL) {
+					segment->bytes += ret;
+				} else {
+					segment->offset += ret;
+				}
+				segment->length -= ret;
+				ret = 0;
+			}
+		}
+	}
+
+	// Everything has been sent; reuse the writer from the beginning.
+	writerReset(writer);
+	return 0;
+}
+
+
+/* void sendFrameHeader(struct session* session, struct frameWriter* writer, char* option, uint64_t dataLength);
+	* intputs:
+		* struct session* session -- session owning the connection (selects the framing version)
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* char* option -- c string for client command option
+		* uint64_t dataLength -- number of data bytes that will follow the header
+	* outputs:
+		* none
+	* calls:
+		* writerReserve(), writerCommit()
+	* purpose:
+		* queues a packet header; the caller appends exactly dataLength bytes after it, either
+		into the writer or (FBODY) straight from a file with sendfile()
+			* version 1: len (2 bytes, counts header and data) | option (8 bytes)
+			* version 2: len (8 bytes, counts data only) | option (8 bytes)
+
+*/
+void sendFrameHeader(struct session *session, struct frameWriter *writer, char *tag, uint64_t dataLength)
+{
+	size_t headerLength = FRAME_HEADER_LEN(session->version);  // Number of bytes in header
+	char *header;                                              // Header storage within writer
+
+	header = writerReserve(writer, headerLength);
+
+	//packLen
+	if (session->version == 1) {
+		unsigned short packetLength = htons(PACK_HEADER_LEN + dataLength);
+		assert(PACK_HEADER_LEN + dataLength <= 0xffff); // version 1 length field overflow check
+		memcpy(header, &packetLength, sizeof(packetLength));
+	} else {
+		uint64_t length = htobe64(dataLength);
+		memcpy(header, &length, sizeof(length));
+	}
+
+	//command option
+	memset(header + headerLength - ARG_LEN, '\0', ARG_LEN);   // Null-padding
+	memcpy(header + headerLength - ARG_LEN, tag, strlen(tag));
+
+	writerCommit(writer, headerLength);
+}
+
+
+/* void sendFrame(struct session* session, struct frameWriter* writer, char* option, char* data, size_t dataLength);
+	* intputs:
+		* struct session* session -- session owning the connection
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* char* option -- c string for client command option
+		* char* data -- data payload; may contain any bytes
+		* size_t dataLength -- number of bytes in data
+	* outputs:
+		* none
+	* calls:
+		* sendFrameHeader()
+	* purpose:
+		* queues a binary-safe packet for the specified socket; sendFile() transmits it once the socket is writable
+
+*/
+void sendFrame(struct session *session, struct frameWriter *writer, char *tag, char *data, size_t dataLength)
+{
+	writerReserve(writer, FRAME_HEADER_LEN(session->version) + dataLength);
+	sendFrameHeader(session, writer, tag, dataLength);
+	memcpy(writerReserve(writer, dataLength), data, dataLength);
+	writerCommit(writer, dataLength);
+}
+
+
+/* void sendFrameRef(struct session* session, struct frameWriter* writer, char* option, char* data, size_t dataLength);
+	* intputs:
+		* struct session* session -- session owning the connection
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* char* option -- c string for client command option
+		* char* data -- data payload; must stay valid until the writer has sent it
+		* size_t dataLength -- number of bytes in data
+	* outputs:
+		* none
+	* calls:
+		* sendFrameHeader(), writerQueue()
+	* purpose:
+		* queues a packet whose data is referenced in place rather than copied; sendFile()
+		gathers the header and the data into the same system call
+
+*/
+void sendFrameRef(struct session *session, struct frameWriter *writer, char *tag, char *data, size_t dataLength)
+{
+	sendFrameHeader(session, writer, tag, dataLength);
+	writerQueue(writer, data, 0, dataLength);
+}
+
+
+/* void sendPack(struct session* session, struct frameWriter* writer, char* option, char* data);
+	* intputs:
+		* struct session* session -- session owning the connection
+		* struct frameWriter* writer -- outgoing packet queue of a socket connection
+		* char* option -- c string for client command option
+		* char* data -- c string for client data payload
+	* outputs:
+		* none
+	* calls:
+		* sendFrame()
+	* purpose:
+		* queues a packet carrying a c string
+
+*/
+void sendPack(struct session *session, struct frameWriter *writer, char *tag, char *data)
+{
+	sendFrame(session, writer, tag, data, strlen(data));
+}
+
+
+/* void negotiateVersion(struct session* session, char* request)
+	* inputs:
+		* struct session* session -- session that received a VERSION packet
+		* char* request -- "<version> <chunk size>" requested by the client
+	* outputs:
+		* VERSION "<version> <chunk size>" reply queued in the current framing; session->version
+		and session->chunkSize updated for every packet that follows
+	* calls:
+		* sscanf(), sendPack()
+	* purpose:
+		* version 2 framing carries a 64-bit length, so payloads are binary-safe and GET chunks
+		may hold anywhere from MIN_CHUNK_LEN to MAX_CHUNK_LEN bytes
+*/
+void negotiateVersion(struct session *session, char *request)
+{
+	int version = 1;                            // Requested version
+	unsigned long chunkSize = DEFAULT_CHUNK_LEN; // Requested GET chunk size
+	char reply[MAX_PACK_PAYLOAD_LEN + 1];       // Accepted version and chunk size
+
+	printf("  Negotiating protocol version ...\n");
+	sscanf(request, "%d %lu", &version, &chunkSize);
+	if (chunkSize < MIN_CHUNK_LEN) {
+		chunkSize = MIN_CHUNK_LEN;
+	}
+	if (chunkSize > MAX_CHUNK_LEN) {
+		chunkSize = MAX_CHUNK_LEN;
+	}
+
+	// Version 1 keeps 512-byte GET chunks.
+	if (version >= 2) {
+		session->chunkSize = chunkSize;
+		snprintf(reply, sizeof(reply), "2 %lu", chunkSize);
+	} else {
+		snprintf(reply, sizeof(reply), "1 %d", MAX_PACK_PAYLOAD_LEN);
+	}
+	sendPack(session, &session->controlOut, "VERSION", reply);
+	session->version = version >= 2 ? 2 : 1;
+}
+
+
+/* void updateEvents(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session whose sockets changed state
+	* outputs:
+		* epoll interest of the session's sockets matches its state; session closed once finished
+	* calls:
+		* epoll_ctl(), closeSession()
+	* purpose:
+		* sockets are only watched for writability while they have queued output, and the control
+		connection is only read while its input buffer has room, so level-triggered epoll never
+		spins on a session that has nothing to do
+*/
+void updateEvents(struct reactor *reactor, struct session *session)
+{
+	struct epoll_event event;  // Interest registration
+
+	// A closing session is released once its final control packets are sent.
+	if (session->state == CLOSING && session->controlOut.pending == 0) {
+		closeSession(reactor, session);
+		return;
+	}
+
+	event.events = 0;
+	if (session->controlIn.tail - session->controlIn.head < session->controlIn.capacity) {
+		event.events |= EPOLLIN;
+	}
+	if (session->controlOut.pending > 0) {
+		event.events |= EPOLLOUT;
+	}
+	event.data.ptr = &session->control;
+	epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, session->control.socket, &event);
+
+	if (session->data.socket != -1) {
+		event.events = 0;
+		if (session->state == DATA_CONNECT || session->state == TRANSFER ||
+		    (session->state == MUX && session->streams != NULL) || session->dataOut.pending > 0) {
+			event.events |= EPOLLOUT;
+		}
+		event.data.ptr = &session->data;
+		epoll_ctl(reactor->epollFd, EPOLL_CTL_MOD, session->data.socket, &event);
+	}
+}
+
+
+/* struct session* openSession(struct reactor* reactor, int controlSocket, struct sockaddr_in* clientAddress)
+	* inputs:
+		* struct reactor* reactor -- reactor that will drive the session
+		* int controlSocket -- accepted, non-blocking control connection
+		* struct sockaddr_in* clientAddress -- address of the client
+	* outputs:
+		* on success -- new session registered with epoll, waiting for DPORT
+		* on failure -- NULL; controlSocket closed
+	* calls:
+		* arenaAlloc(), epoll_ctl()
+	* purpose:
+		* begins an FTP session for a newly accepted control connection; the session, its control
+		ring and its frame writers are carved from the session's own arena
+*/
+struct session *openSession(struct reactor *reactor, int controlSocket, struct sockaddr_in *clientAddress)
+{
+	struct session *session;   // Return value
+	struct epoll_event event;  // Interest registration
+	struct arena arena = {NULL, NULL};  // Session memory, moved into the session once it exists
+
+	session = arenaAlloc(&arena, sizeof(struct session));
+	memset(session, 0, sizeof(struct session));
+	session->arena = arena;
+
+	session->state = AWAIT_DPORT;
+	session->control.kind = CONTROL;
+	session->control.socket = controlSocket;
+	session->control.session = session;
+	session->data.kind = DATA;
+	session->data.socket = -1;
+	session->data.session = session;
+	session->listener.kind = LISTENER;
+	session->listener.socket = -1;
+	session->listener.session = session;
+	session->listDirFd = -1;
+	session->sidecarFd = -1;
+	session->rangeLength = -1;
+	session->snapshot = reactor->snapshot;
+	session->version = 1;
+	session->chunkSize = MAX_PACK_PAYLOAD_LEN;
+	session->controlIn.capacity = IO_BUF_LEN;
+	session->controlIn.bytes = arenaAlloc(&session->arena, IO_BUF_LEN);
+	session->controlOut.buffer.arena = &session->arena;
+	session->dataOut.buffer.arena = &session->arena;
+	session->clientAddress = *clientAddress;
+	//inet_ntop() converts the client's address to IPv4 dotted-decimal notation in a per-session buffer
+	inet_ntop(AF_INET, &clientAddress->sin_addr, session->clientIPv4, sizeof(session->clientIPv4));
+
+	event.events = EPOLLIN;
+	event.data.ptr = &session->control;
+	if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, controlSocket, &event) == -1) {
+		perror("epoll_ctl");
+		close(controlSocket);
+		arena = session->arena;
+		arenaRelease(&arena);
+		return NULL;
+	}
+
+	// Link the session into the reactor's session list.
+	session->next = reactor->sessions;
+	if (reactor->sessions != NULL) {
+		reactor->sessions->prev = session;
+	}
+	reactor->sessions = session;
+
+	return session;
+}
+
+
+/* void releaseStreams(struct session* session)
+	* inputs:
+		* struct session* session -- session with multiplexed streams
+	* outputs:
+		* every stream's file closed and the stream kept for reuse
+	* purpose:
+		* abandons the streams of a multiplexed data connection that is being closed
+*/
+void releaseStreams(struct session *session)
+{
+	struct stream *stream;  // Stream being released
+
+	while (session->streams != NULL) {
+		stream = session->streams;
+		session->streams = stream->next;
+		if (stream->cached != NULL) {
+			cacheRelease(stream->cached);
+		} else {
+			fileCacheRelease(stream->file);
+		}
+		stream->next = session->freeStreams;
+		session->freeStreams = stream;
+	}
+	session->lastStream = NULL;
+	session->numStreams = 0;
+}
+
+
+/* void setCork(int sockfd, int enable)
+	* inputs:
+		* int sockfd -- TCP socket
+		* int enable -- 1 to hold back partial segments, 0 to send them
+	* outputs:
+		* TCP_CORK option updated
+	* calls:
+		* setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, ...)
+	* purpose:
+		* while a response is being streamed, only full-sized segments leave the socket, no matter
+		how the packets are split between sendmsg() and sendfile() calls; removing the cork sends
+		the tail of the response immediately
+*/
+void setCork(int socket, int enable)
+{
+	if (setsockopt(socket, IPPROTO_TCP, TCP_CORK, &enable, sizeof(enable)) == -1) {
+		perror("setsockopt");
+	}
+}
+
+
+/* void closeDataConnection(struct session* session)
+	* inputs:
+		* struct session* session -- session whose data connection should be closed
+	* outputs:
+		* data socket and passive listener closed; any queued data discarded and any cached file
+		released
+	* purpose:
+		* ends connection D (don't leave open sockets!)
+*/
+void closeDataConnection(struct session *session)
+{
+	if (session->listener.socket != -1) {
+		if (close(session->listener.socket) == -1) {
+			perror("close");
+		}
+		session->listener.socket = -1;
+	}
+	if (session->data.socket == -1) {
+		return;
+	}
+
+	// Closing the socket also removes it from the epoll interest list.
+	if (close(session->data.socket) == -1) {
+		perror("close");
+	}
+	session->data.socket = -1;
+	writerReset(&session->dataOut);
+	session->dataCorked = 0;
+	releaseStreams(session);
+
+	// Queued packets may have referenced the cached file; nothing does any more.
+	if (session->cached != NULL) {
+		cacheRelease(session->cached);
+		session->cached = NULL;
+	}
+}
+
+
+/* void closeSession(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session to end
+	* outputs:
+		* session's sockets and files closed; session moved to the reactor's closed list
+	* calls:
+		* closeDataConnection(), close(), fileCacheRelease()
+	* purpose:
+		* ends an FTP session; its memory is released after the current batch of epoll events
+		has been dispatched, since later events in the batch may still refer to it
+*/
+void closeSession(struct reactor *reactor, struct session *session)
+{
+	if (session->state == CLOSED) {
+		return;
+	}
+
+	closeDataConnection(session);
+	if (close(session->control.socket) == -1) {
+		perror("close");
+	}
+	if (session->file != NULL) {
+		fileCacheRelease(session->file);
+	}
+	if (session->listDirFd != -1) {
+		close(session->listDirFd);
+	}
+	if (session->sidecarFd != -1) {
+		close(session->sidecarFd);
+	}
+
+	// Move the session from the active list to the closed list.
+	if (session->prev != NULL) {
+		session->prev->next = session->next;
+	} else {
+		reactor->sessions = session->next;
+	}
+	if (session->next != NULL) {
+		session->next->prev = session->prev;
+	}
+	if (session->state == DATA_RETRY) {
+		reactor->retrying--;
+	}
+	if (session->state == WATCHING) {
+		stopWatch(reactor, session);
+	}
+	session->state = CLOSED;
+	session->next = reactor->closed;
+	reactor->closed = session;
+}
+
+
+/* void openDataConnection(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session requesting a data connection
+	* outputs:
+		* non-blocking connect() to <DATA_PORT> in progress (DATA_CONNECT), or a retry scheduled
+		(DATA_RETRY) if the client is not listening yet
+	* calls:
+		* socket(), connect(), epoll_ctl()
+	* purpose:
+		* initiates FTP data connection D with the client without waiting for it to complete
+*/
+void openDataConnection(struct reactor *reactor, struct session *session)
+{
+	int status;                       // Return status
+	struct epoll_event event;         // Interest registration
+	struct sockaddr_in dataAddress;   // Client-side data connection endpoint
+
+	// Create server-side endpoint of FTP data connection.
+	session->data.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (session->data.socket == -1) {
+		perror("socket");
+		closeSession(reactor, session);
+		return;
+	}
+
+	// Establish FTP data connection; completion is reported as writability.
+	dataAddress = session->clientAddress;
+	dataAddress.sin_port = htons(session->dataPort);
+	status = connect(session->data.socket, (struct sockaddr *) &dataAddress, sizeof(dataAddress));
+	if (status == -1 && errno != EINPROGRESS) {
+		retryDataConnection(reactor, session);
+		return;
+	}
+
+	session->state = DATA_CONNECT;
+	event.events = EPOLLOUT;
+	event.data.ptr = &session->data;
+	if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, session->data.socket, &event) == -1) {
+		perror("epoll_ctl");
+		closeSession(reactor, session);
+	}
+}
+
+
+/* void retryDataConnection(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session whose data connection attempt failed
+	* outputs:
+		* session waits CXN_RETRY_MS in DATA_RETRY, or is closed after MAX_CXN_ATTEMPTS
+	* purpose:
+		* the client only listens on <DATA_PORT> after it receives the go-ahead, so the first
+		attempts are commonly refused; retries are timed by the reactor rather than spinning
+*/
+void retryDataConnection(struct reactor *reactor, struct session *session)
+{
+	closeDataConnection(session);
+
+	session->connectionAttempts++;
+	if (session->connectionAttempts >= MAX_CXN_ATTEMPTS) {
+		fprintf(stderr, "ftserver: unable to establish FTP data connection with \"%s\"\n",
+		        session->clientIPv4);
+		closeSession(reactor, session);
+		return;
+	}
+
+	session->state = DATA_RETRY;
+	session->retryAt = monotonicMs() + CXN_RETRY_MS;
+	reactor->retrying++;
+}
+
+
+/* int openPassiveListener(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session that sent PASV
+	* outputs:
+		* on success -- port number of a listener registered with epoll (session->listener)
+		* on failure -- -1
+	* calls:
+		* getsockname(), socket(), bind(), listen(), epoll_ctl()
+	* purpose:
+		* FTP passive mode: the listener is bound to an ephemeral port on the address the client
+		already reached over connection C, so the client connects to the server instead of the
+		server connecting to (and retrying) a port the client may not be listening on yet
+*/
+int openPassiveListener(struct reactor *reactor, struct session *session)
+{
+	struct sockaddr_in listenAddress;  // Server-side data listener endpoint
+	socklen_t addressLen;              // Length of listenAddress
+	struct epoll_event event;          // Interest registration
+
+	// Listen on the interface the control connection arrived on.
+	addressLen = sizeof(listenAddress);
+	if (getsockname(session->control.socket, (struct sockaddr *) &listenAddress, &addressLen) == -1) {
+		perror("getsockname");
+		return -1;
+	}
+	listenAddress.sin_port = 0;
+
+	session->listener.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (session->listener.socket == -1) {
+		perror("socket");
+		return -1;
+	}
+	if (bind(session->listener.socket, (struct sockaddr *) &listenAddress, sizeof(listenAddress)) == -1 ||
+	    listen(session->listener.socket, 1) == -1) {
+		perror("bind/listen");
+		closeDataConnection(session);
+		return -1;
+	}
+
+	// Learn the ephemeral port the kernel chose.
+	addressLen = sizeof(listenAddress);
+	if (getsockname(session->listener.socket, (struct sockaddr *) &listenAddress, &addressLen) == -1) {
+		perror("getsockname");
+		closeDataConnection(session);
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.ptr = &session->listener;
+	if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, session->listener.socket, &event) == -1) {
+		perror("epoll_ctl");
+		closeDataConnection(session);
+		return -1;
+	}
+
+	session->passive = 1;
+	return ntohs(listenAddress.sin_port);
+}
+
+
+/* void acceptDataConnection(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session whose passive listener is readable
+	* outputs:
+		* data connection D registered with epoll and the listener closed; the transfer begins at
+		once if the command has already been received (DATA_ACCEPT)
+	* calls:
+		* accept4(), close(), epoll_ctl(), beginTransfer()
+	* purpose:
+		* completes a passive-mode data connection; the client may connect before or after it
+		sends its command
+*/
+void acceptDataConnection(struct reactor *reactor, struct session *session)
+{
+	int dataSocket;                    // Accepted data connection
+	struct sockaddr_in dataAddress;    // Client-side data connection endpoint
+	socklen_t addressLen;              // Length of dataAddress
+	struct epoll_event event;          // Interest registration
+
+	addressLen = sizeof(dataAddress);
+	dataSocket = accept4(session->listener.socket, (struct sockaddr *) &dataAddress, &addressLen,
+	                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (dataSocket == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+			perror("accept4");
+			closeSession(reactor, session);
+		}
+		return;
+	}
+
+	// Only the client that sent PASV may use the listener.
+	if (dataAddress.sin_addr.s_addr != session->clientAddress.sin_addr.s_addr) {
+		fprintf(stderr, "ftserver: refused passive data connection intended for \"%s\"\n",
+		        session->clientIPv4);
+		close(dataSocket);
+		return;
+	}
+
+	// The listener serves a single data connection.
+	close(session->listener.socket);
+	session->listener.socket = -1;
+
+	session->data.socket = dataSocket;
+	event.events = 0;
+	event.data.ptr = &session->data;
+	if (epoll_ctl(reactor->epollFd, EPOLL_CTL_ADD, dataSocket, &event) == -1) {
+		perror("epoll_ctl");
+		closeSession(reactor, session);
+		return;
+	}
+
+	if (session->state == DATA_ACCEPT) {
+		beginTransfer(session);
+	}
+}
+
+
+/* void beginTransfer(struct session* session)
+	* inputs:
+		* struct session* session -- session whose data connection has just been established
+	* outputs:
+		* session in the TRANSFER (or MUX) state with its data connection corked
+	* calls:
+		* setCork()
+	* purpose:
+		* shared by the active (connect) and passive (accept) data connection paths
+*/
+void beginTransfer(struct session *session)
+{
+	printf("ftserver: FTP data connection established with \"%s\"\n", session->clientIPv4);
+	session->state = strcmp(session->commandTag, "MUX") == 0 ? MUX : TRANSFER;
+	session->transferStarted = 0;
+	setCork(session->data.socket, 1);
+	session->dataCorked = 1;
+}
+
+
+/* int controlConnection(struct reactor* reactor, struct session* session)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session with newly received control data
+	* outputs:
+		* 0 on success
+			* modifies session->dataPort, session->commandTag, session->filename, session->state
+		* -1 on failure (malformed packet; session closed)
+	* calls:
+		* recvPack()
+		* sendPack()
+		* openDataConnection()
+	* purpose:
+		* consume every complete packet the session's state is waiting for:
+			* VERSION -- optional protocol negotiation before DPORT
+			* PAGE <size> [<cursor>] -- optional, before DPORT; limits the next listing to one page
+			* RANGE <offset> [<length>] -- optional, before DPORT; the next GET/SGET sends only those bytes
+			* SIZE <FILENAME> -- in place of DPORT; replied to with the file's length
+			* COMPRESS <codecs> -- optional, before DPORT; the next GET/SGET may send zlib chunks
+			* STATS -- in place of DPORT, alongside MGET, or while watching; replied to with the server's allocator counters
+			* WATCH [<generation>] -- in place of DPORT; directory changes are pushed on the control
+			connection until UNWATCH
+			* DPORT -- data connection port (FTP active mode)
+			* PASV -- open a data listener and reply with its PORT (FTP passive mode)
+			* LIST || LISTX || DELTA || GET || SGET -- command; answered with ERROR or the data-connection go-ahead (OKAY)
+			* MUX -- command; the data connection stays open and carries the files of later MGETs
+			* MGET <id> <FILENAME> -- add a file stream to a multiplexed data connection
+			* ACK -- client received all data; the session is ready for its next command
+		* the control connection stays open across commands, so a client may pipeline several
+		requests (DPORT|PASV, command) without waiting for replies; they are served in order, and
+		a request arriving in place of an ACK acknowledges the previous transfer
+		* packets arriving in any other state stay buffered until the session is ready for them;
+		the next request is only read once the previous transfer's data connection has closed
+*/
+int controlConnection(struct reactor *reactor, struct session *session)
+{
+	int ret;                                //holds return value of recvPack()
+	int port;                               //passive-mode data listener port
+	char indata[MAX_PACK_PAYLOAD_LEN + 1];  	//holds read in client <FILENAME> argument -- input packet payload
+	char intag[ARG_LEN + 1];           			//holds read in client <COMMAND> argument
+
+	while (session->state == AWAIT_DPORT || session->state == AWAIT_COMMAND || session->state == MUX ||
+	       session->state == WATCHING || (session->state == AWAIT_ACK && session->data.socket == -1)) {
+		ret = recvPack(&session->controlIn, session->version, intag, indata);
+		if (ret == 0) {
+			break;
+		}
+		if (ret == -1) {
+			fprintf(stderr, "ftserver: malformed packet from \"%s\"\n", session->clientIPv4);
+			closeSession(reactor, session);
+			return -1;
+		}
+
+		switch (session->state) {
+
+		// Client acknowledged received data, or pipelined its next request without waiting.
+		case AWAIT_ACK:
+			session->state = AWAIT_DPORT;
+			if (strcmp(intag, "ACK") == 0) {
+				break;
+			}
+			// fall through
+
+		//read in data connection port from client
+		case AWAIT_DPORT:
+			// A late ACK belongs to a transfer the next request already acknowledged.
+			if (strcmp(intag, "ACK") == 0) {
+				break;
+			}
+			// Drop a listener left over from a request that failed.
+			closeDataConnection(session);
+			session->passive = 0;
+
+			// Protocol negotiation may precede the data port.
+			if (strcmp(intag, "VERSION") == 0) {
+				negotiateVersion(session, indata);
+				break;
+			}
+			// The next listing may be limited to a page.
+			if (strcmp(intag, "PAGE") == 0) {
+				setPage(session, indata);
+				break;
+			}
+			// The next file may be sent from an offset (resume) or in part.
+			if (strcmp(intag, "RANGE") == 0) {
+				setRange(session, indata);
+				break;
+			}
+			// The next file may be sent in compressed chunks.
+			if (strcmp(intag, "COMPRESS") == 0) {
+				setCompress(session, indata);
+				break;
+			}
+			// Allocator counters may be requested between transfers.
+			if (strcmp(intag, "STATS") == 0) {
+				sendStats(session);
+				break;
+			}
+			// A file's length may be asked for before it is fetched in ranges.
+			if (strcmp(intag, "SIZE") == 0) {
+				sendSize(session, indata);
+				break;
+			}
+			// Directory changes are pushed until the client unsubscribes.
+			if (strcmp(intag, "WATCH") == 0) {
+				startWatch(reactor, session, indata);
+				break;
+			}
+			// Passive mode: the client connects to a listener opened here.
+			if (strcmp(intag, "PASV") == 0) {
+				printf("  Opening passive data listener (FTP passive mode) ...\n");
+				port = openPassiveListener(reactor, session);
+				if (port == -1) {
+					sendPack(session, &session->controlOut, "ERROR", "Unable to open data listener");
+					session->state = CLOSING;
+					break;
+				}
+				snprintf(indata, sizeof(indata), "%d", port);
+				sendPack(session, &session->controlOut, "PORT", indata);
+				session->state = AWAIT_COMMAND;
+				break;
+			}
+			printf("  Receiving data port (FTP active mode) ...\n");
+			//if the command line option held in intag == DPORT, then convert string held in indata to integer and assign to dataPort
+			if (strcmp(intag, "DPORT") == 0) { session->dataPort = atoi(indata); }
+			session->state = AWAIT_COMMAND;
+			break;
+
+		//read in command from client
+		case AWAIT_COMMAND:
+			printf("  Receiving command ...\n");
+			strcpy(session->commandTag, intag);
+			strcpy(session->filename, indata);
+
+			//error check
+			if (strcmp(intag, "LIST") != 0 && strcmp(intag, "LISTX") != 0 && strcmp(intag, "DELTA") != 0 &&
+			    strcmp(intag, "GET") != 0 && strcmp(intag, "SGET") != 0 && strcmp(intag, "MUX") != 0) {
+				printf("  Transmitting command error ...\n");
+				sendPack(session, &session->controlOut, "ERROR", "Command must be either -l or -g");
+				clearModifiers(session);
+				session->state = AWAIT_DPORT;
+			}
+
+			// Stream IDs, file chunks and metadata records need binary-safe framing.
+			else if ((strcmp(intag, "MUX") == 0 || strcmp(intag, "LISTX") == 0) && session->version < 2) {
+				printf("  Transmitting command error ...\n");
+				snprintf(indata, sizeof(indata), "%s requires protocol version 2", intag);
+				sendPack(session, &session->controlOut, "ERROR", indata);
+				clearModifiers(session);
+				session->state = AWAIT_DPORT;
+			}
+
+			// Otherwise, indicate that it is okay to establish an FTP data connection.
+			else {
+				printf("  Transmitting data-connection go-ahead ...\n");
+				sendPack(session, &session->controlOut, "OKAY", "");
+				if (!session->passive) {
+					session->connectionAttempts = 0;
+					openDataConnection(reactor, session);
+				} else if (session->data.socket != -1) {
+					beginTransfer(session);
+				} else {
+					session->state = DATA_ACCEPT;
+				}
+			}
+			break;
+
+		// Add a file stream to the multiplexed data connection.
+		case MUX:
+			if (strcmp(intag, "MGET") == 0) {
+				openStream(session, indata);
+			} else if (strcmp(intag, "STATS") == 0) {
+				sendStats(session);
+			}
+			break;
+
+		// Only the end of the subscription (or the counters) may interrupt pushed changes.
+		case WATCHING:
+			if (strcmp(intag, "UNWATCH") == 0) {
+				stopWatch(reactor, session);
+				sendPack(session, &session->controlOut, "CLOSE", "");
+			} else if (strcmp(intag, "STATS") == 0) {
+				sendStats(session);
+			} else {
+				snprintf(indata, sizeof(indata), "%s is not accepted while watching", intag);
+				sendPack(session, &session->controlOut, "ERROR", indata);
+			}
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
+
+
+/* void clearModifiers(struct session* session)
+	* inputs:
+		* struct session* session -- session whose request is over (transferred or refused)
+	* outputs:
+		* the PAGE, RANGE and COMPRESS settings sent for that request cleared
+	* purpose:
+		* these settings precede a single command; once it is over they must not apply to the
+		session's next, unrelated request
+*/
+void clearModifiers(struct session *session)
+{
+	session->pageSize = 0;
+	session->pageCursor[0] = '\0';
+	session->rangeOffset = 0;
+	session->rangeLength = -1;
+	session->compressOffered = 0;
+	session->compressing = 0;
+}
+
+
+/* int finishTransfer(struct session* session)
+	* inputs:
+		* struct session* session -- session whose transfer is complete
+	* outputs:
+		* 1 (dataConnection() return value indicating the transfer is complete)
+	* calls:
+		* sendPack(), clearModifiers()
+	* purpose:
+		* place done tag at end of data, inform the client that the command is complete; the
+		client may then close the control connection or send its next request
+*/
+int finishTransfer(struct session *session)
+{
+	//place done tag at end of data to indicate FTP complete
+	sendPack(session, &session->dataOut, "DONE", "");
+
+	// A PAGE, RANGE or COMPRESS applies to one transfer only.
+	clearModifiers(session);
+
+	// Inform the client that the control connection can be closed.
+	printf("  Transmitting connection-termination go-ahead ...\n");
+	sendPack(session, &session->controlOut, "CLOSE", "");
+
+	// The data connection closes once drained, releasing any cached file its packets reference.
+	session->state = AWAIT_ACK;
+	return 1;
+}
+
+
+/* int startBody(struct session* session)
+	* inputs:
+		* struct session* session -- session handling an SGET command (session->file open;
+		startRange() called)
+	* outputs:
+		* 0 -- FILE and FBODY packets queued; session->bodyRemaining bytes follow them
+	* calls:
+		* sendPack(), sendFrameHeader()
+	* purpose:
+		* SGET replies with the filename, then an FBODY packet carrying the body length -- the
+		whole file, or the RANGE requested (version 1: in decimal; version 2: in the packet
+		header); exactly that many raw file bytes follow on the data connection, sent with
+		sendfile() from the range's offset so the file never passes through user space
+*/
+int startBody(struct session *session)
+{
+	char lengthText[32];              // Body length in decimal
+
+	//FT the filename and the length of the body that follows; in version 2 the body is the FBODY packet's data
+	sendPack(session, &session->dataOut, "FILE", session->filename);
+	if (session->version == 1) {
+		snprintf(lengthText, sizeof(lengthText), "%lld", (long long) session->fileRemaining);
+		sendPack(session, &session->dataOut, "FBODY", lengthText);
+	} else {
+		sendFrameHeader(session, &session->dataOut, "FBODY", session->fileRemaining);
+	}
+	session->bodyOffset = session->fileOffset;
+	session->bodyRemaining = session->fileRemaining;
+	printf("  Transmitting file (sendfile) ...\n");
+	return 0;
+}
+
+
+/* int startSidecar(struct session* session, struct stat* info)
+	* inputs:
+		* struct session* session -- session handling a compressing GET/SGET of a whole file
+		(session->file open)
+		* struct stat* info -- current metadata of the file
+	* outputs:
+		* 1 -- FILE packet queued; session->bodyRemaining bytes of the file's compressed variant
+		follow it
+		* 0 -- no current variant; the fetch was counted towards one, or compression was turned
+		off for a file that does not compress
+	* calls:
+		* sidecarOpen(), sidecarRequest(), sendPack()
+	* purpose:
+		* the variant holds the packets compressChunk() would produce, so the client sees the
+		same stream while the server pays the CPU cost of a raw sendfile()
+*/
+int startSidecar(struct session *session, struct stat *info)
+{
+	off_t bodyLength;   // Number of packet bytes in the variant
+	int fd;             // Variant
+
+	fd = sidecarOpen(info, &bodyLength);
+	if (fd == -1) {
+		sidecarRequest(session->file);
+		return 0;
+	}
+
+	// Compression does not pay for this file; send it as is without trying.
+	if (bodyLength == 0) {
+		close(fd);
+		session->compressing = 0;
+		return 0;
+	}
+
+	pthread_mutex_lock(&sidecarCache.lock);
+	sidecarCache.hits++;
+	pthread_mutex_unlock(&sidecarCache.lock);
+
+	sendPack(session, &session->dataOut, "FILE", session->filename);
+	session->sidecarFd = fd;
+	session->bodyOffset = sizeof(struct sidecarHeader);
+	session->bodyRemaining = bodyLength;
+	printf("  Transmitting file (compressed variant) ...\n");
+	return 1;
+}
+
+
+/* int sendBody(struct session* session)
+	* inputs:
+		* struct session* session -- session with an SGET body or a compressed variant in progress
+	* outputs:
+		* 1 -- body complete
+		* 0 -- data connection cannot accept more bytes right now
+		* -1 -- sendfile() failed, or the file shrank during the transfer
+	* calls:
+		* ssize_t sendfile(int out_fd, int in_fd, off_t* offset, size_t count)
+			* copies count bytes from in_fd, starting at *offset, to out_fd within the kernel;
+			*offset is advanced past the bytes sent
+	* purpose:
+		* zero-copy transfer of the file body (or its compressed variant) from the page cache to
+		the data connection
+*/
+int sendBody(struct session *session)
+{
+	ssize_t ret;  //holds return value of sendfile()
+	int fd = session->sidecarFd != -1 ? session->sidecarFd : session->file->fd;  // File sent
+
+	while (session->bodyRemaining > 0) {
+		ret = sendfile(session->data.socket, fd, &session->bodyOffset,
+		               session->bodyRemaining < SENDFILE_CHUNK ? session->bodyRemaining : SENDFILE_CHUNK);
+
+		// Data sent.
+		if (ret > 0) {
+			session->bodyRemaining -= ret;
+		}
+
+		// The file is shorter than the length already announced to the client.
+		else if (ret == 0) {
+			fprintf(stderr, "ftserver: %s was truncated during transfer\n", session->filename);
+			return -1;
+		}
+
+		// Socket cannot accept more data right now.
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+
+		// Error encountered.
+		else if (errno != EINTR) {
+			perror("sendfile");
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+
+/* int transferData(struct session* session)
+	* inputs:
+		* struct session* session -- session with an open data connection
+	* outputs:
+		* 0 -- everything possible was sent; wait for the data connection to become writable
+		* -1 -- the data connection failed, or the file being sent could not be read
+	* calls:
+		* dataConnection(), sendFile(), sendBody()
+	* purpose:
+		* alternates between producing packets, sending them, and sending an SGET body, until
+		the transfer is complete or the data connection is full
+*/
+int transferData(struct session *session)
+{
+	int ret;   // Return status
+	int more;  // Flag: more packets will follow the queued ones
+
+	while (1) {
+		// Produce packets while the data connection has room for them.
+		while (session->state == TRANSFER && session->bodyRemaining == 0 &&
+		       session->dataOut.pending < IO_BUF_LEN) {
+			if (dataConnection(session) == -1) {
+				return -1;
+			}
+		}
+
+		// Multiplexed streams take turns, one chunk each.
+		while (session->state == MUX && session->streams != NULL &&
+		       session->dataOut.pending < IO_BUF_LEN) {
+			muxConnection(session);
+		}
+		more = session->state == TRANSFER || (session->state == MUX && session->streams != NULL);
+
+		// Transfer file information over FTP data connection.
+		if (sendFile(session->data.socket, &session->dataOut, more ? MSG_MORE : 0) == -1) {
+			return -1;
+		}
+		if (session->dataOut.pending > 0) {
+			return 0;
+		}
+
+		// Packets preceding the body have been sent; the body follows them.
+		if (session->bodyRemaining > 0) {
+			ret = sendBody(session);
+			if (ret <= 0) {
+				return ret;
+			}
+		}
+		// Everything has been sent; push out the final partial segment.
+		else if (!more) {
+			if (session->dataCorked) {
+				setCork(session->data.socket, 0);
+				session->dataCorked = 0;
+			}
+			return 0;
+		}
+	}
+}
+
+
+/* int dataConnection(struct session* session)
+	* inputs:
+		* struct session* session -- session in the TRANSFER state
+	* outputs:
+		* 0 -- more packets were queued on session->dataOut; call again once they drain
+		* 1 -- transfer complete (DONE and CLOSE queued)
+		* -1 -- the file could not be read to the end; the session must be closed
+	* calls:
+		* missingLookup(), cacheLookup(), cacheRequest(), fileCacheAcquire(), snapshotList()
+		* sendPack()
+		* startRange(), startSidecar(), startBody()
+		* compressChunk()
+		* pread()
+	* purpose:
+		* allow file transfer between server and client, one batch of packets at a time, so a
+		large listing or file never holds up other sessions sharing the reactor
+		* never called while an SGET body is still being sent by sendBody()
+*/
+int dataConnection(struct session *session)
+{
+	struct stat info;  // Information concerning a requested file
+	int whole;         // Flag: the whole file is requested (no RANGE)
+	int sidecar;       // Flag: the whole file is sent compressed; a compressed variant may serve it
+	int cacheable;     // Flag: the file is sent in chunks, which may come from the content cache
+	int status;        // Return status
+	char message[MAX_PACK_PAYLOAD_LEN + 1];  // ERROR packet data
+
+	// First call: validate the command.
+	if (!session->transferStarted) {
+		session->transferStarted = 1;
+		if (session->listDirFd != -1) {
+			close(session->listDirFd);
+			session->listDirFd = -1;
+		}
+
+		//check client's command argument
+		session->listRecords = strcmp(session->commandTag, "LISTX") == 0;
+		session->listing = strcmp(session->commandTag, "LIST") == 0 || session->listRecords ||
+		                   strcmp(session->commandTag, "DELTA") == 0;
+		session->recordFrame = NULL;
+		if (session->listing) {
+			status = startList(session);
+			if (status == -2) {
+				snprintf(message, sizeof(message), "Unable to read directory: %s", strerror(errno));
+				fprintf(stderr, "ftserver: openat: %s\n", strerror(errno));
+				printf("  Transmitting directory-read error ...\n");
+				sendPack(session, &session->controlOut, "ERROR", message);
+				return finishTransfer(session);
+			}
+			if (status == -1) {
+				printf("  Transmitting list-cursor error ...\n");
+				sendPack(session, &session->controlOut, "ERROR", "Invalid list cursor");
+				return finishTransfer(session);
+			}
+			printf("  Transmitting file listing ...\n");
+		}
+
+		// The client requests transmission of a file.
+		else if (strcmp(session->commandTag, "GET") == 0 || strcmp(session->commandTag, "SGET") == 0) {
+			// A client accepting compression gets chunks (ZFILE or FILE) even for SGET, as a raw
+			// body cannot be compressed on its way through sendfile().
+			session->compressing = session->compressOffered && session->version == 2;
+			session->compressSkip = 0;
+			session->compressBackoff = 0;
+
+			// Repeat requests for a missing name are refused without a system call.
+			if (missingLookup(session->snapshot, session->filename)) {
+				printf("  Transmitting missing-file error (cached) ...\n");
+				sendPack(session, &session->controlOut, "ERROR", "File not found");
+				return finishTransfer(session);
+			}
+
+			// Hot files fetched whole in chunks are sent from memory; ranges and SGET bodies are
+			// sent from disk (the latter with sendfile()), and compressed variants, when kept,
+			// are sent in place of compressing cached chunks.
+			whole = session->rangeOffset == 0 && session->rangeLength == -1;
+			sidecar = whole && session->compressing && sidecarCache.dirFd != -1;
+			cacheable = whole && !sidecar &&
+			            (strcmp(session->commandTag, "GET") == 0 || session->compressing);
+			session->cached = cacheable ? cacheLookup(session->snapshot, session->filename) : NULL;
+			if (session->cached != NULL) {
+				startRange(session, session->cached->size);
+				sendPack(session, &session->dataOut, "FILE", session->filename);
+				printf("  Transmitting file (cached) ...\n");
+				return 0;
+			}
+
+			//open <FILENAME> if it is a file in the current directory, reusing a cached descriptor
+			session->file = fileCacheAcquire(session->snapshot, session->filename, &info);
+			if (session->file == NULL && errno == ENOENT) {
+				printf("  Transmitting missing-file error ...\n");
+				sendPack(session, &session->controlOut, "ERROR", "File not found");
+				return finishTransfer(session);
+			}
+			if (session->file == NULL) {
+				printf("  Transmitting file-read-access error ...\n");
+				sendPack(session, &session->controlOut, "ERROR", "Unable to open file");
+				return finishTransfer(session);
+			}
+
+			if (startRange(session, info.st_size) == -1) {
+				fileCacheRelease(session->file);
+				session->file = NULL;
+				printf("  Transmitting range error ...\n");
+				sendPack(session, &session->controlOut, "ERROR", "Invalid range");
+				return finishTransfer(session);
+			}
+
+			// Packets compressed in advance are sent with sendfile(), like an SGET body.
+			if (sidecar && startSidecar(session, &info)) {
+				return 0;
+			}
+
+			// A file fetched in chunks often enough is read into memory for later fetches.
+			if (cacheable) {
+				cacheRequest(session->file, info.st_size);
+			}
+
+			// SGET: the file body is sent with sendfile() once the packets queued here drain.
+			if (strcmp(session->commandTag, "SGET") == 0 && !session->compressing) {
+				return startBody(session);
+			}
+
+			//FT the filename; chunks are read with pread(), as the descriptor may be shared
+			sendPack(session, &session->dataOut, "FILE", session->filename);
+			printf("  Transmitting file ...\n");
+		}
+
+		// Given command-tag must be either "LIST", "LISTX", "DELTA", "GET" or "SGET".
+		else {
+			fprintf(stderr, "ftserver: command-tag must be \"LIST\", \"LISTX\", \"DELTA\", \"GET\" or "
+			        "\"SGET\"; received \"%s\"\n", session->commandTag  );
+			return finishTransfer(session);
+		}
+	}
+
+	// SGET body or compressed variant has been sent.
+	if ((strcmp(session->commandTag, "SGET") == 0 && !session->compressing) || session->sidecarFd != -1) {
+		if (session->sidecarFd != -1) {
+			close(session->sidecarFd);
+			session->sidecarFd = -1;
+		}
+		if (session->file != NULL) {
+			fileCacheRelease(session->file);
+			session->file = NULL;
+		}
+		return finishTransfer(session);
+	}
+
+	// Transfer the next batch of filenames, each within a separate packet (LIST, DELTA) or as
+	// records packed into FSTAT packets (LISTX).
+	if (session->listing) {
+		if (snapshotList(session)) {
+			return finishTransfer(session);
+		}
+		return 0;
+	}
+
+	// FT the next chunk of a cached file, referencing it in place where the framing allows.
+	else if (session->cached != NULL) {
+		off_t remaining = session->fileRemaining;                         // Number of bytes left to send
+		size_t numBytes = remaining < (off_t) session->chunkSize ? (size_t) remaining : session->chunkSize;
+		char *chunk = session->cached->data + session->fileOffset;        // Next chunk
+		size_t compressedLength = session->compressing ? compressChunk(session, chunk, numBytes) : 0;
+
+		// Chunks that shrink are sent compressed.
+		if (compressedLength > 0) {
+			sendFrame(session, &session->dataOut, "ZFILE", session->compressBuffer, compressedLength);
+		}
+
+		// Version 1 data is a c string, so a chunk ends at its first null byte.
+		else if (session->version == 1) {
+			sendFrame(session, &session->dataOut, "FILE", chunk, strnlen(chunk, numBytes));
+		} else {
+			sendFrameRef(session, &session->dataOut, "FILE", chunk, numBytes);
+		}
+		session->fileOffset += numBytes;
+		session->fileRemaining -= numBytes;
+		if (numBytes > 0) {
+			return 0;
+		}
+		return finishTransfer(session);
+	}
+
+	//FT the next chunk of the file (or range); an empty chunk marks the end
+	else {
+		size_t headerLength = FRAME_HEADER_LEN(session->version); // Number of bytes in packet header
+		size_t numBytes = session->fileRemaining < (off_t) session->chunkSize ?
+		                  (size_t) session->fileRemaining : session->chunkSize; // Number of bytes to read
+		ssize_t bytesRead = 0; // Number of bytes read from a file
+		size_t compressedLength = 0; // Number of bytes of the chunk once compressed, 0 if sent as is
+		char *chunk;       // Packet data storage within session->dataOut
+
+		// Read the chunk straight into the packet's data, after room for its header.
+		chunk = writerReserve(&session->dataOut, headerLength + numBytes) + headerLength;
+		if (numBytes > 0) {
+			bytesRead = pread(session->file->fd, chunk, numBytes, session->fileOffset);
+		}
+
+		// A read error, or a file that shrank below the length being sent, must not reach the
+		// client as a complete file; the data connection is aborted instead.
+		if (bytesRead == -1) {
+			perror("pread");
+			return -1;
+		}
+		if (bytesRead == 0 && numBytes > 0) {
+			fprintf(stderr, "ftserver: %s was truncated during transfer\n", session->filename);
+			return -1;
+		}
+		session->fileOffset += bytesRead;
+		session->fileRemaining -= bytesRead;
+
+		// Chunks that shrink replace their raw bytes with the compressed ones.
+		if (session->compressing && bytesRead > 0) {
+			compressedLength = compressChunk(session, chunk, bytesRead);
+		}
+		if (compressedLength > 0) {
+			memcpy(chunk, session->compressBuffer, compressedLength);
+			sendFrameHeader(session, &session->dataOut, "ZFILE", compressedLength);
+			writerCommit(&session->dataOut, compressedLength);
+		}
+
+		// Version 1 data is a c string, so a chunk ends at its first null byte.
+		else if (session->version == 1) {
+			sendFrameHeader(session, &session->dataOut, "FILE", strnlen(chunk, bytesRead));
+			writerCommit(&session->dataOut, strnlen(chunk, bytesRead));
+		} else {
+			sendFrameHeader(session, &session->dataOut, "FILE", bytesRead);
+			writerCommit(&session->dataOut, bytesRead);
+		}
+		if (bytesRead > 0) {
+			return 0;
+		}
+		fileCacheRelease(session->file);
+		session->file = NULL;
+		return finishTransfer(session);
+	}
+}
+
+
+/* void sendStreamHeader(struct session* session, char* option, uint32_t id, size_t dataLength)
+	* inputs:
+		* struct session* session -- session with a multiplexed data connection
+		* char* option -- packet tag (MFILE, MDATA, MEND or MERROR)
+		* uint32_t id -- stream the packet belongs to
+		* size_t dataLength -- number of stream data bytes that will follow the header
+	* outputs:
+		* packet header and stream ID queued on session->dataOut
+	* calls:
+		* sendFrameHeader(), writerReserve(), writerCommit()
+	* purpose:
+		* multiplexed packets are version 2 packets whose data begins with a 4-byte big-endian
+		stream ID:
+			* len (8 bytes, counts stream ID and data) | option (8 bytes) | stream ID (4 bytes) | data
+*/
+void sendStreamHeader(struct session *session, char *tag, uint32_t id, size_t dataLength)
+{
+	uint32_t streamId = htonl(id);  // Stream ID in network byte order
+
+	sendFrameHeader(session, &session->dataOut, tag, STREAM_ID_LEN + dataLength);
+	memcpy(writerReserve(&session->dataOut, STREAM_ID_LEN), &streamId, STREAM_ID_LEN);
+	writerCommit(&session->dataOut, STREAM_ID_LEN);
+}
+
+
+/* void sendStreamFrame(struct session* session, char* option, uint32_t id, char* data)
+	* inputs:
+		* struct session* session -- session with a multiplexed data connection
+		* char* option -- packet tag
+		* uint32_t id -- stream the packet belongs to
+		* char* data -- c string payload
+	* outputs:
+		* packet queued on session->dataOut
+	* calls:
+		* sendStreamHeader()
+	* purpose:
+		* queues a multiplexed packet carrying a c string (filename or error message)
+*/
+void sendStreamFrame(struct session *session, char *tag, uint32_t id, char *data)
+{
+	size_t dataLength = strlen(data);  // Number of bytes in data
+
+	sendStreamHeader(session, tag, id, dataLength);
+	memcpy(writerReserve(&session->dataOut, dataLength), data, dataLength);
+	writerCommit(&session->dataOut, dataLength);
+}
+
+
+/* void openStream(struct session* session, char* request)
+	* inputs:
+		* struct session* session -- session in the MUX state
+		* char* request -- MGET data: "<id> <FILENAME>"
+	* outputs:
+		* MFILE <FILENAME> queued and the stream appended to the round-robin queue, or MERROR
+		queued for the stream
+	* calls:
+		* strtoul(), missingLookup(), cacheLookup(), fileCacheAcquire(), cacheRequest(), arenaAlloc(),
+		setCork()
+	* purpose:
+		* starts sending a file on the multiplexed data connection alongside the streams already
+		under way; errors belong to the stream, so they travel on the data connection
+*/
+void openStream(struct session *session, char *request)
+{
+	struct stream *stream;   // New stream
+	struct stat info;        // Information concerning the requested file
+	unsigned long id;        // Client-chosen stream ID
+	char *filename;          // Requested filename within request
+	struct cacheEntry *cached; // Requested file's cached contents, or NULL
+	struct openFile *file;   // Requested file, when not cached
+
+	id = strtoul(request, &filename, 10);
+	if (*filename != ' ') {
+		fprintf(stderr, "ftserver: malformed MGET from \"%s\"\n", session->clientIPv4);
+		return;
+	}
+	filename++;
+
+	printf("  Receiving stream %lu request ...\n", id);
+	if (session->numStreams >= MAX_STREAMS) {
+		sendStreamFrame(session, "MERROR", id, "Too many concurrent streams");
+		return;
+	}
+	if (missingLookup(session->snapshot, filename)) {
+		sendStreamFrame(session, "MERROR", id, "File not found");
+		return;
+	}
+	cached = cacheLookup(session->snapshot, filename);
+	file = NULL;
+	if (cached != NULL) {
+		info.st_size = cached->size;
+	} else {
+		file = fileCacheAcquire(session->snapshot, filename, &info);
+		if (file == NULL) {
+			sendStreamFrame(session, "MERROR", id, errno == ENOENT ? "File not found" : "Unable to open file");
+			return;
+		}
+		cacheRequest(file, info.st_size);
+	}
+
+	// Reuse a finished stream; the arena holds at most MAX_STREAMS of them.
+	if (session->freeStreams != NULL) {
+		stream = session->freeStreams;
+		session->freeStreams = stream->next;
+	} else {
+		stream = arenaAlloc(&session->arena, sizeof(struct stream));
+	}
+	stream->id = id;
+	stream->file = file;
+	stream->cached = cached;
+	stream->offset = 0;
+	stream->remaining = info.st_size;
+	stream->next = NULL;
+	if (session->lastStream != NULL) {
+		session->lastStream->next = stream;
+	} else {
+		session->streams = stream;
+	}
+	session->lastStream = stream;
+	session->numStreams++;
+
+	sendStreamFrame(session, "MFILE", id, filename);
+
+	// Hold partial segments back until the streams drain.
+	if (!session->dataCorked) {
+		setCork(session->data.socket, 1);
+		session->dataCorked = 1;
+	}
+}
 
-int main(int argc, char **argv)
+
+/* void muxConnection(struct session* session)
+	* inputs:
+		* struct session* session -- session in the MUX state with at least one stream
+	* outputs:
+		* one MDATA chunk of the stream at the head of the queue queued on session->dataOut; the
+		stream moves to the back of the queue, or ends with MEND (MERROR on a read error, or
+		when the file shrank before all of it was sent)
+	* calls:
+		* writerReserve(), pread() (or memcpy() from the content cache), sendStreamHeader(),
+		writerCommit(), sendStreamFrame(), cacheRelease(), fileCacheRelease()
+	* purpose:
+		* fair scheduling: every stream gets one chunk of at most session->chunkSize bytes per
+		round, so a huge file shares the connection evenly with small ones instead of starving
+		them; the chunk is read straight into the packet's data
+*/
+void muxConnection(struct session *session)
 {
-	int port;  // Port number on which to listen for client connections.
+	size_t headerLength = FRAME_HEADER_LEN(session->version) + STREAM_ID_LEN; // Bytes before chunk
+	struct stream *stream = session->streams;  // Stream whose turn it is
+	size_t numBytes;                           // Number of bytes to send this turn
+	ssize_t bytesRead = 0;                     // Number of bytes read from the file
+	char *chunk;                               // Packet data storage within session->dataOut
 
-	// Exactly two command-line arguments are expected.
-	if (argc != 2) {
-		fprintf(stderr, "usage: ftserver <server-port>\n");
-		exit(1);
+	numBytes = stream->remaining < (off_t) session->chunkSize ? (size_t) stream->remaining
+	                                                         : session->chunkSize;
+	if (numBytes > 0) {
+		chunk = writerReserve(&session->dataOut, headerLength + numBytes) + headerLength;
+		if (stream->cached != NULL) {
+			memcpy(chunk, stream->cached->data + stream->offset, numBytes);
+			bytesRead = numBytes;
+		} else {
+			bytesRead = pread(stream->file->fd, chunk, numBytes, stream->offset);
+		}
+		if (bytesRead > 0) {
+			sendStreamHeader(session, "MDATA", stream->id, bytesRead);
+			writerCommit(&session->dataOut, bytesRead);
+			stream->offset += bytesRead;
+			stream->remaining -= bytesRead;
+		}
 	}
 
-	// The given port number must be an integer.
-	if (!checkPortArgInt(argv[1], &port)) {
-		fprintf(stderr, "ftserver: Port number must be an integer\n");
-		exit(1);
+	// Take the stream off the head of the queue.
+	session->streams = stream->next;
+	if (session->streams == NULL) {
+		session->lastStream = NULL;
 	}
+	stream->next = NULL;
 
-	// The given port number must be in the range [c_portno_min, c_portno_max].
-	if (port < c_portno_min || port > c_portno_max) {
-		fprintf(stderr, "ftserver: Port number must be in the range [1024, 65535]\n");
-		exit(1);
+	// A stream with more to send waits for its next turn at the back of the queue.
+	if (bytesRead > 0 && stream->remaining > 0) {
+		if (session->lastStream != NULL) {
+			session->lastStream->next = stream;
+		} else {
+			session->streams = stream;
+		}
+		session->lastStream = stream;
+		return;
 	}
 
-	// Run the FTP server until an interrupt signal is detected.
-	ftp(port);
-
-	exit(0);
+	// Otherwise the stream is finished; only a fully sent file ends with MEND.
+	if (bytesRead == -1) {
+		perror("pread");
+		sendStreamFrame(session, "MERROR", stream->id, "Unable to read file");
+	} else if (stream->remaining > 0) {
+		fprintf(stderr, "ftserver: stream %u was truncated during transfer\n", stream->id);
+		sendStreamFrame(session, "MERROR", stream->id, "File changed during transfer");
+	} else {
+		sendStreamFrame(session, "MEND", stream->id, "");
+	}
+	if (stream->cached != NULL) {
+		cacheRelease(stream->cached);
+	} else {
+		fileCacheRelease(stream->file);
+	}
+	stream->next = session->freeStreams;
+	session->freeStreams = stream;
+	session->numStreams--;
 }
 
-/* void intSigHandler(int signal)
-        * inputs:
-                * int signal -- holds the signal number/id
-        * outputs:
-                * on success -- void -- restore signal handling to default behavior; send an interrup signal to force default behavior
-                * on failure -- perrer(<error_message>) exit(1)
-        * calls:
-		* sigaction(int signo, struct sigaction* newaction, struct sigaction* origaction)
-		* raise(int signal)
-        * purpose:
-		* callback function
-		* displays feedback before terminating ftserver program due to interrupt signal
-		* restore signal handling to default action; send an interrup signal to force default action
-			* via setting *sa_handler = SIG_DFL which directs handler to take default action
 
+/* void startWatch(struct reactor* reactor, struct session* session, char* request)
+	* inputs:
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session that sent WATCH
+		* char* request -- WATCH data: "" for changes from now on, or the generation (GEN of a
+		DELTA or of an earlier WATCH) to report changes since
+	* outputs:
+		* GEN <generation> queued on the control connection, then RESET if the changes since the
+		client's generation are no longer all logged; session in WATCHING
+		* ERROR when the directory is not being watched (no inotify)
+	* calls:
+		* strtoull(), snprintf(), sendPack(), sendChanges()
+	* purpose:
+		* generations advance by one per logged change, so the changes since a generation are the
+		last (current - generation) entries of the ring, when it still holds that many
 */
-void intSigHandler(int sig)
+void startWatch(struct reactor *reactor, struct session *session, char *request)
 {
-	int status;                   // Return status
-	struct sigaction interrupt;   // Signal action for handling interrupt
+	struct dirSnapshot *snapshot = session->snapshot;  // Listing of the served directory
+	char generation[32];  // Packet data
+	uint64_t current;     // Snapshot generation
+	uint64_t since;       // Client's generation
+	uint64_t kept;        // Number of changes still in the ring
+	char *end;            // End of the client's generation
+	int reset = 0;        // Flag: changes since the client's generation were lost
 
-	// Provide feedback to the user.
-	printf("\nftserver closed\n");
+	if (snapshot->events == NULL || atomic_load(&snapshot->inotifyFd) == -1) {
+		sendPack(session, &session->controlOut, "ERROR", "Directory changes are not being watched");
+		return;
+	}
 
-	//restore signal (interrupt) handling to default action via SIG_DFL
-	interrupt.sa_handler = SIG_DFL;
-	status = sigaction(SIGINT, &interrupt, 0);
-	if (status == -1) {
-		perror("sigaction");
-		exit(1);
+	pthread_rwlock_rdlock(&snapshot->lock);
+	current = snapshot->generation;
+	session->watchNext = snapshot->numEvents;
+	if (request[0] != '\0') {
+		kept = snapshot->numEvents < WATCH_LOG_LEN ? snapshot->numEvents : WATCH_LOG_LEN;
+		errno = 0;
+		since = strtoull(request, &end, 10);
+		if (*end != '\0' || errno != 0 || since > current || current - since > kept) {
+			reset = 1;
+		} else {
+			session->watchNext -= current - since;
+			current = since;
+		}
 	}
+	pthread_rwlock_unlock(&snapshot->lock);
 
-	//send an interrupt signal to force default action -- to be acted on by the newly set default action for this signal
-	status = raise(SIGINT);
-	if (status == -1) {
-		perror("raise");
-		exit(1);
+	snprintf(generation, sizeof(generation), "%llu", (unsigned long long) current);
+	sendPack(session, &session->controlOut, "GEN", generation);
+	if (reset) {
+		sendPack(session, &session->controlOut, "RESET", "");
 	}
+
+	printf("  Watching the served directory for \"%s\" ...\n", session->clientIPv4);
+	session->state = WATCHING;
+	reactor->watching++;
+	atomic_fetch_add(&snapshot->watchers, 1);
+	sendChanges(session);
 }
 
 
-/* int checkPortArgInt function: 
+/* void stopWatch(struct reactor* reactor, struct session* session)
 	* inputs:
-		* char* portArg -- holds the <SERVER_PORT> argument from command line
-		* int* s_portno -- pointer to variable that holds <SERVER_PORT> arugment from command line upon conversion to integer
+		* struct reactor* reactor -- reactor owning the session
+		* struct session* session -- session in WATCHING
 	* outputs:
-		* returns 1 if portArg is an integer; returns 0 if portArg is not an integer
+		* session back in AWAIT_DPORT, no longer counted as a watcher
+*/
+void stopWatch(struct reactor *reactor, struct session *session)
+{
+	reactor->watching--;
+	atomic_fetch_sub(&session->snapshot->watchers, 1);
+	session->state = AWAIT_DPORT;
+}
+
+
+/* void sendChanges(struct session* session)
+	* inputs:
+		* struct session* session -- session in WATCHING
+	* outputs:
+		* an ADDED, MODIFIED, REMOVED or RESET packet per change not yet sent, then GEN with the
+		generation the client is now up to date with
+	* calls:
+		* sendPack(), snprintf()
 	* purpose:
-		* to ensure that the command line argument, portArg, is an integer and therefore can be assigned to the server socket
+		* stops queueing once WATCH_BACKLOG bytes wait to be sent, so a client that stops reading
+		cannot grow the session without bound; if the ring overwrites changes it never received,
+		the client gets RESET and should catch up with DELTA from the GEN that follows
 */
-int checkPortArgInt(char *str, int *n)
+void sendChanges(struct session *session)
 {
-	// this var holds a potential trailing non-whitespace char
-	char c;
+	struct dirSnapshot *snapshot = session->snapshot;  // Listing of the served directory
+	struct watchEvent *event;   // Change being sent
+	char generation[32];        // GEN packet data
+	uint64_t upTo = 0;          // Generation of the last change sent
+	int numSent = 0;            // Number of changes sent
 
-	// sscanf returns the number of variables filled; in case of input failure before any data could be successfully read, EOF is returned
-	// in this case, if portno argument is an integer value 1 is returned (1 int variable filled) else 0 returned (0 variables filled)
-	int matches = sscanf(str, "%d %c", n, &c);
+	pthread_rwlock_rdlock(&snapshot->lock);
+	while (session->watchNext < snapshot->numEvents && session->controlOut.pending < WATCH_BACKLOG) {
+		if (snapshot->numEvents - session->watchNext > WATCH_LOG_LEN) {
+			sendPack(session, &session->controlOut, "RESET", "");
+			session->watchNext = snapshot->numEvents;
+			upTo = snapshot->generation;
+		} else {
+			event = &snapshot->events[session->watchNext++ % WATCH_LOG_LEN];
+			sendPack(session, &session->controlOut, event->tag, event->name);
+			upTo = event->generation;
+		}
+		numSent++;
+	}
+	pthread_rwlock_unlock(&snapshot->lock);
 
-	// A string representation of an integer will result in only one match.
-	return matches == 1;
+	if (numSent > 0) {
+		snprintf(generation, sizeof(generation), "%llu", (unsigned long long) upTo);
+		sendPack(session, &session->controlOut, "GEN", generation);
+	}
 }
 
 
-/* char** listFiles(char* dirname, int* numFiles)
-	* inputs:
-		* char* dirname -- c string directory name
-		* int* numFiles -- number of files in the <dirname> directory
-	* outputs:
-		* char* array of filenames of <dirname> directory
-	* calls:
-		* DIR* opendir(const char* dirname)
-			* open a directory stream corresponding to the directory named by the dirname
-			arugment.The directory stream is positioned at the first entry. If the type of DIR
-			is implemented using a file descriptor, apps shall only be able to open up to a 
-			total of {OPEN_MAX} files and directories.
-			* returns a pointer to an object of type DIR; otherwise a null pointer 
-			shall be returned and errno set to indicate the error
-		* DIR* closedir(DIR* dirp)
-			* shall close the directory stream referred to by the argument dirp. Upon
-			return, the value of dirp may no longer point to an accessible object of the
-			type DIR. If a file descriptor is used to implement type DIR, that file descriptor 
-			shall be closed.
-			* returns 0 on success; -1 on failure
-		* struct dirent* readdir(DIR* dirp)
-			* returns a pointer to an object of type struct dirent on success; null pointer 
-			and errno set on error
-		* int stat(const char* restrict path, struct stat* restrict buf)
-			* shall obtain info about the named fil and write it to the area pointed to by the
-			buf argument.
-			* path -- points to a pathname naming a file
-			* buf -- is a pointer to a stat structure, into which info is placed concerning the
-			file
-		* S_ISDIR(mode_t m) 
-			* MACRO returns non-zero if the file is a directory
+/* void handleEvent(struct reactor* reactor, struct endpoint* endpoint, unsigned int events)
+	* inputs:
+		* struct reactor* reactor -- reactor that received the event
+		* struct endpoint* endpoint -- socket the event occurred on
+		* unsigned int events -- epoll event mask (EPOLLIN, EPOLLOUT, EPOLLERR, EPOLLHUP)
+	* outputs:
+		* session advanced as far as it can go without blocking
+	* calls:
+		* recvFile(), sendFile(), controlConnection(), transferData()
 	* purpose:
-		* lists all files in the specified directory
+		* routes a readiness event to the session state machine:
+			* DPORT|PASV -> command -> data connect|accept -> transfer -> ACK -> DPORT|PASV ...
 */
-char ** listFiles(char *dirname, int *numFiles)
+void handleEvent(struct reactor *reactor, struct endpoint *endpoint, unsigned int events)
 {
-	char **fileList;      // Return value
-	DIR *dir;             // Directory object
-	struct dirent *entry; // Entry within a directory
-	struct stat info;     // Information concerning a directory entry
+	int status;                  // Return status
+	int error;                   // Pending socket error
+	socklen_t errorLen;          // Length of error
+	struct session *session;     // Session owning the endpoint
 
-	// Open the given directory.
-	dir = opendir(dirname);
-	if (dir == NULL) {
-		fprintf(stderr, "ftserver: unable to open %s\n", dirname);
-		exit(1);
+	// Sessions were queued for this worker, or the directory changed; both are handled after the
+	// event batch.
+	if (endpoint->kind == WAKEUP) {
+		reactor->changed = 1;
+		uint64_t count;  // eventfd counter
+		if (read(endpoint->socket, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+			perror("read");
+		}
+		return;
 	}
 
-	// Build a list of filenames in the given directory.
-	*numFiles = 0;
-	fileList = NULL;
-	while ((entry = readdir(dir)) != NULL) {
+	session = endpoint->session;
+	if (session->state == CLOSED) {
+		return;
+	}
 
-		// Skip subdirectories.
-		stat(entry->d_name, &info);
-		if (S_ISDIR(info.st_mode)) {
-			continue;
+	// Control connection: read and act on packets, then flush replies.
+	if (endpoint->kind == CONTROL) {
+		if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			status = recvFile(session->control.socket, &session->controlIn);
+			if (status <= 0) {
+				closeSession(reactor, session);
+				return;
+			}
+			if (controlConnection(reactor, session) == -1) {
+				return;
+			}
 		}
+	}
 
-		// Append current filename to the list.
-		{
-			// Allocate memory for the new item.
-			if (fileList == NULL) {
-				fileList = malloc(sizeof(char *));
-			} else {
-				fileList = realloc(fileList, (*numFiles + 1) * sizeof(char *));
+	// Passive listener: accept the client's data connection.
+	else if (endpoint->kind == LISTENER) {
+		acceptDataConnection(reactor, session);
+		if (session->state == CLOSED) {
+			return;
+		}
+	}
+
+	// Data connection: complete the connect, or stream the next batch of packets.
+	else if (session->state == DATA_CONNECT) {
+		errorLen = sizeof(error);
+		status = getsockopt(session->data.socket, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+		if (status == -1 || error != 0) {
+			retryDataConnection(reactor, session);
+			if (session->state == CLOSED) {
+				return;
 			}
-			assert(fileList != NULL); // malloc()/realloc() failure check
-			fileList[*numFiles] = malloc((strlen(entry->d_name) + 1) * sizeof(char));
-			assert(fileList[*numFiles] != NULL); // malloc() failure check
+		} else {
+			beginTransfer(session);
+		}
+	}
+	else if (events & (EPOLLERR | EPOLLHUP)) {
+		// Client closed the data connection; only an error before the transfer completed.
+		if (session->state != AWAIT_ACK) {
+			closeSession(reactor, session);
+			return;
+		}
+		closeDataConnection(session);
+		if (controlConnection(reactor, session) == -1) {
+			return;
+		}
+	}
 
-			// Store the filename in the list.
-			strcpy(fileList[*numFiles], entry->d_name);
+	// MGETs pipelined behind MUX wait in the ring until the data connection is up.
+	if (endpoint->kind != CONTROL && session->state == MUX && controlConnection(reactor, session) == -1) {
+		return;
+	}
 
-			// Update the list length.
-			(*numFiles)++;
+	// Stream packets (and any SGET body) while the data connection has room for them.
+	if (session->data.socket != -1 && transferData(session) == -1) {
+		closeSession(reactor, session);
+		return;
+	}
+
+	// A finished transfer's data connection closes once drained; pipelined requests follow it.
+	if (session->state == AWAIT_ACK && session->data.socket != -1 &&
+	    session->dataOut.pending == 0 && session->bodyRemaining == 0) {
+		closeDataConnection(session);
+		printf("ftserver: FTP data connection closed\n");
+		if (controlConnection(reactor, session) == -1) {
+			return;
 		}
 	}
 
-	// Cleanup.
-	closedir(dir);
+	// A watcher held back by a slow reader catches up as its control connection drains.
+	if (session->state == WATCHING) {
+		sendChanges(session);
+	}
+	if (sendFile(session->control.socket, &session->controlOut, 0) == -1) {
+		closeSession(reactor, session);
+		return;
+	}
 
-	return fileList;
+	updateEvents(reactor, session);
 }
 
 
-/* void recvFile(int sockfd, void* buf, int size)
-	* inputs: 
-		* int sockfd -- file descriptor of the socket connection to be used for FTP
-		* void* buf -- this is a generic pointer type which can be converted to any other pointer type without explicit cast: must convert to complete data type before dereferencing or pointer arithmetic
-			    -- this buffer will be used to store the client's data
-		* int size -- pre determined number of bytes to accept/receive from client
-	* outputs:	
-		* on success -- client data stored in void* buf
-		* on failure -- perror(<error_message>) exit(1)
+/* void retryDueSessions(struct reactor* reactor)
+	* inputs:
+		* struct reactor* reactor -- reactor with sessions in DATA_RETRY
+	* outputs:
+		* data connections re-attempted for every session whose retry time has passed
 	* calls:
-		* ssize_t recv(int sockfd, void* buf, size_t len, int flags) 
-			* sockfd -- specifies the socket file descriptor
-			* buffer -- points to a buffer where the message should be stored
-			* length -- specifies the length in bytes of the buffer pointed to by the buffer argument
-			* flags -- specifies the type of message reception. Values of this argument are formed by logically OR'ing zero or more of specific values 
-			* returns -- on success number of bytes received ; on failure -1
-				* more data may be coming as long as the return value is greater than 0
-				* recv will block if the connection is open but no data is available
-				* this function is called until return value is 0 (i.e., all data received from client)
+		* openDataConnection(), updateEvents()
 	* purpose:
-		* receive client data (either client command of filename to retrieve)
+		* timer half of the data-connection retry logic
 */
-void recvFile(int socket, void *buffer, int numBytes)
+void retryDueSessions(struct reactor *reactor)
 {
-	int ret;               // Return value for 'recv'
-	int receivedBytes;     // Total number of bytes received
-
-	//receive passed in number of bytes from client
-	receivedBytes = 0;
-	while (receivedBytes < numBytes) {
-		ret = recv(socket, buffer + receivedBytes, numBytes - receivedBytes, 0);
+	long long now = monotonicMs();  // Current time
+	struct session *session;        // Session being inspected
+	struct session *next;           // Following session
 
-		// Error encountered.
-		if (ret == -1) {
-			perror("recv");
-			exit(1);
+	for (session = reactor->sessions; session != NULL; session = next) {
+		next = session->next;
+		if (session->state == DATA_RETRY && session->retryAt <= now) {
+			reactor->retrying--;
+			openDataConnection(reactor, session);
+			if (session->state != CLOSED) {
+				updateEvents(reactor, session);
+			}
 		}
+	}
+}
 
-		// Data received.
-		else {
-			receivedBytes += ret;
+
+/* void pushChanges(struct reactor* reactor)
+	* inputs:
+		* struct reactor* reactor -- reactor woken since its last event batch
+	* outputs:
+		* pending directory changes queued and flushed for every watching session
+	* calls:
+		* sendChanges(), sendFile(), closeSession(), updateEvents()
+*/
+void pushChanges(struct reactor *reactor)
+{
+	struct session *session;  // Session being inspected
+	struct session *next;     // Following session
+
+	for (session = reactor->sessions; session != NULL; session = next) {
+		next = session->next;
+		if (session->state != WATCHING) {
+			continue;
+		}
+		sendChanges(session);
+		if (sendFile(session->control.socket, &session->controlOut, 0) == -1) {
+			closeSession(reactor, session);
+			continue;
 		}
+		updateEvents(reactor, session);
 	}
 }
 
 
-/* void recvPack(int sockfd, char* option, char* data){
+/* void dequePush(struct sessionDeque* deque, struct pendingSession* pending)
 	* inputs:
-		* int sockfd -- file descriptor of socket connection to be used for communication
-		* char* option -- a string that holds an option from client command line to be received
-		* char* data -- a string that holds the data from the client command line to be received
+		* struct sessionDeque* deque -- worker queue receiving the session
+		* struct pendingSession* pending -- accepted control connection
 	* outputs:
-		* char* option, char* data modified and now hold data read in from client
+		* pending stored at the bottom of the deque
 	* calls:
-		* recvFile()
+		* pthread_mutex_lock(), realloc()
 	* purpose:
-		* receives data packets from given client socket connection: ref: Beej's Guide to Network Programming: section 7.5, page 53
-			* len (1 byte, unsigned) -- total length of the packet, counting the 8-byte command option (-l || -g) and n-bytes data
-			* command option (8-bytes)
-			* client data (n-bytes)
-
-*/	
-void recvPack(int socket, char *tag, char *data)
+		* hands an accepted control connection to a worker; the ring grows as needed so the
+		acceptor never blocks on a full queue
+*/
+void dequePush(struct sessionDeque *deque, struct pendingSession *pending)
 {
-	unsigned short packetLength;       // Number of bytes in packet
-	unsigned short dataLength;         // Number of bytes in encapsulated data
-	char tmpTag[ARG_LEN + 1];          // Temporary tag transfer buffer
-	char tmpData[MAX_PACK_PAYLOAD_LEN + 1]; // Temporary payload transfer buffer
+	size_t i;  //for loop iterator
+
+	pthread_mutex_lock(&deque->lock);
 
-	//read in client packet size: packLen passed by reference because this var will be modified within the recvFile()
-	recvFile(socket, &packetLength, sizeof(packetLength));
-	//ntohs(uint16_t netshort): function that converts the unsigned short integer called netshort from network byte (Big Endian) order to host byte order (little Endian)
-	packetLength = ntohs(packetLength);
+	// Grow the ring, unwrapping its entries into the new storage.
+	if (deque->count == deque->capacity) {
+		size_t capacity = deque->capacity > 0 ? deque->capacity * 2 : BACKLOG;
+		struct pendingSession *items = malloc(capacity * sizeof(struct pendingSession));
+		assert(items != NULL); // malloc() failure check
+		for (i = 0; i < deque->count; i++) {
+			items[i] = deque->items[(deque->top + i) % deque->capacity];
+		}
+		free(deque->items);
+		deque->items = items;
+		deque->top = 0;
+		deque->capacity = capacity;
+	}
 
-	//read in client command 
-	recvFile(socket, tmpTag, ARG_LEN);
-	//set string terminator character to end of optionBuf to mark end of option string
-	tmpTag[ARG_LEN] = '\0';
-	if (tag != NULL) { strcpy(tag, tmpTag); }
+	deque->items[(deque->top + deque->count) % deque->capacity] = *pending;
+	deque->count++;
 
-	//receive data payload from client: dataLen = total packet size - command option - sizeof packLen
-	dataLength = packetLength - ARG_LEN - sizeof(packetLength);
-	recvFile(socket, tmpData, dataLength);
-	//set string terminator character to end of dataBuf to mark end of data payload string
-	tmpData[dataLength] = '\0';
-	if (data != NULL) { strcpy(data, tmpData); }
+	pthread_mutex_unlock(&deque->lock);
 }
 
 
-/* int controlConnection(int c_controlfd, char* commandArg, int* dataConnPort, char* filename)
+/* int dequePop(struct sessionDeque* deque, struct pendingSession* pending)
 	* inputs:
-		* int c_controlfd -- file descriptor of control socket
-		* char* commandArg -- pointer/c string (static array) holding <COMMAND> argument from command line (-l || -g) 
-		* int* dataConnPort -- holds data connection port file descriptor
-		* char* filename -- pointer/c string (static array) holding <FILENAME> argument from command line
+		* struct sessionDeque* deque -- the calling worker's own queue
+		* struct pendingSession* pending -- receives the popped session
 	* outputs:
-		* 0 on success
-			* modifies commandArg, dataConnPort, filename
-		* -1 on failure
-	* calls:
-		* recvPack(int sockfd, char* cmdArg, char* fileArg)
-		* sendPack()
+		* 1 if a session was popped from the bottom of the deque; 0 if the deque is empty
 	* purpose:
-		* read in from client and store command arugments in appropriate static arrays 
-		* send feedback to client 
-		* establish && maintain basic control connection between server and client
+		* owner side of the deque
 */
-int controlConnection(int controlSocket, char *commandTag, int *dataPort, char* filename)
+int dequePop(struct sessionDeque *deque, struct pendingSession *pending)
 {
-	char indata[MAX_PACK_PAYLOAD_LEN + 1];  	//holds read in client <FILENAME> argument -- input packet payload
-	char intag[ARG_LEN + 1];           			//holds read in client <COMMAND> argument
-	char outdata[MAX_PACK_PAYLOAD_LEN + 1]; 	// Output packet payload
-	char outtag[ARG_LEN + 1];          			
-
-	//read in data connection port from client
-	printf("  Receiving data port (FTP active mode) ...\n");
-	recvPack(controlSocket, intag, indata);
-	//if the command line option held in readinCommand == DPORT, then convert string held in readinDataPort to integer and assign to dataConnPort
-	if (strcmp(intag, "DPORT") == 0) { *dataPort = atoi(indata); }
-
-	//read in command from client
-	printf("  Receiving command ...\n");
-	recvPack(controlSocket, intag, indata);
-	strcpy(commandTag, intag);
-	strcpy(filename, indata);
-
-	//error check
-	if (strcmp(intag, "LIST") != 0 && strcmp(intag, "GET") != 0) {
-		printf("  Transmitting command error ...\n");
-		strcpy(outtag, "ERROR");
-		strcpy(outdata, "Command must be either -l or -g");
-		sendPack(controlSocket, outtag, outdata);
-		return -1;
-	}
+	int ret = 0;  // Return value
 
-	// Otherwise, indicate that it is okay to establish an FTP data connection.
-	else {
-		printf("  Transmitting data-connection go-ahead ...\n");
-		strcpy(outtag, "OKAY");
-		sendPack(controlSocket, outtag, "");
-		return 0;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count > 0) {
+		deque->count--;
+		*pending = deque->items[(deque->top + deque->count) % deque->capacity];
+		ret = 1;
 	}
+	pthread_mutex_unlock(&deque->lock);
+
+	return ret;
 }
 
 
-/* int dataConnection(int controlfd, int datafd, char* commandAgr, char* filename)
+/* int dequeSteal(struct sessionDeque* deque, struct pendingSession* stolen, int maxItems)
 	* inputs:
-		* int controlfd -- file descriptor of control socket connection
-		* int datafd -- file descriptor of data socket connection
-		* char* commandArg -- c string that holds the client's command argument
-		* char* filename -- c string that holds the client's requested filename
+		* struct sessionDeque* deque -- another worker's queue
+		* struct pendingSession* stolen -- receives up to maxItems sessions
+		* int maxItems -- capacity of stolen
 	* outputs:
-		* on success -- 0
-		* on failure -- -1
-	* calls:
-		* listFiles()
-		* sendPack()
-		* fopen(filename, "r/w/rw")
-		* fread()
+		* number of sessions taken from the top of the deque
 	* purpose:
-		* allow file transfer between server and client
+		* thief side of the deque: takes the oldest half of the victim's queued sessions, so
+		sessions stuck behind a busy worker are picked up by an idle one
 */
-int dataConnection(int controlSocket, int dataSocket, char *commandTag, char *filename)
+int dequeSteal(struct sessionDeque *deque, struct pendingSession *stolen, int maxItems)
 {
-	int ret = 0;     // Return value
-	char **fileList; // List of filenames in the current directory
-	int numFiles;    // Number of files the current directory
-	int i;		//for loop iterator
-
-	// Get a list of filenames in the current directory.
-	fileList = listFiles(".", &numFiles);
-
-	//check client's command argument
-	if (strcmp(commandTag, "LIST") == 0) {
+	int numStolen = 0;  // Return value
 
-		// Transfer each filename within a separate packet.
-		printf("  Transmitting file listing ...\n");
-		for (i = 0; i < numFiles; i++) {
-			sendPack(dataSocket, "FNAME", fileList[i]);
-		}
+	pthread_mutex_lock(&deque->lock);
+	while (numStolen < maxItems && numStolen < (int) (deque->count + 1) / 2) {
+		stolen[numStolen++] = deque->items[deque->top];
+		deque->top = (deque->top + 1) % deque->capacity;
+		deque->count--;
 	}
+	pthread_mutex_unlock(&deque->lock);
 
-	// The client requests transmission of a file.
-	else if (strcmp(commandTag, "GET") == 0) {
-		do {
-			char buffer[MAX_PACK_PAYLOAD_LEN + 1]; // File reader storage buffer
-			int bytesRead;  // Number of bytes read from a file
-			int fileExists; // Flag indicating if given filename exists in list
-			FILE *infile;   // Reference to input file
-
-			//search the files in current dir
-			fileExists = 0;
-			for (i = 0; i < numFiles && !fileExists; i++) {
-				if (strcmp(filename, fileList[i]) == 0) {
-					fileExists = 1;
-				}
-			}
-
-			//check if <FILENAME> is in current directory
-			if (!fileExists) {
-				printf("  Transmitting missing-file error ...\n");
-				sendPack(controlSocket, "ERROR", "File not found");
-				ret = -1;
-				break;
-			}
-
-			//open file 
-			infile = fopen(filename, "r");
-			if (infile == NULL) {
-				printf("  Transmitting file-read-access error ...\n");
-				sendPack(controlSocket, "ERROR", "Unable to open file");
-				ret = -1;
-				break;
-			}
+	return numStolen;
+}
 
-			//FT the filename
-			sendPack(dataSocket, "FILE", filename);
 
-			//FT the file 
-			printf("  Transmitting file ...\n");
-			do {
-				bytesRead = fread(buffer, sizeof(char), MAX_PACK_PAYLOAD_LEN, infile);
-				buffer[bytesRead] = '\0';
-				sendPack(dataSocket, "FILE", buffer);
-			} while (bytesRead > 0);
-			if (ferror(infile)) {
-				perror("fread");
-				ret = -1;
-			}
-			fclose(infile);
+/* void wakeWorker(struct worker* worker)
+	* inputs:
+		* struct worker* worker -- worker to interrupt
+	* outputs:
+		* the worker's epoll_wait() returns
+	* calls:
+		* write() on the worker's eventfd
+	* purpose:
+		* prompts a worker to adopt (or steal) queued sessions
+*/
+void wakeWorker(struct worker *worker)
+{
+	uint64_t one = 1;  // eventfd increment
 
-		} while (0);
+	if (write(worker->reactor.wakeup.socket, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+		perror("write");
 	}
+}
 
-	// Given command-tag must be either "LIST" or "GET".
-	else {
-		fprintf(stderr, "ftserver: command-tag must be \"LIST\" or "
-		        "\"GET\"; received \"%s\"\n", commandTag            );
-		ret = -1;
-	}
 
-	//place done tag at end of data to indicate FTP complete 
-	sendPack(dataSocket, "DONE", "");
+/* void scheduleSession(struct pool* pool, struct pendingSession* pending)
+	* inputs:
+		* struct pool* pool -- worker pool
+		* struct pendingSession* pending -- accepted control connection
+	* outputs:
+		* session queued on a worker's deque; that worker (and, if it is busy, an idle one) woken
+	* calls:
+		* dequePush(), wakeWorker()
+	* purpose:
+		* spreads new sessions round-robin across the workers; when the chosen worker is still
+		dispatching events, an idle worker is woken so it can steal the session instead
+*/
+void scheduleSession(struct pool *pool, struct pendingSession *pending)
+{
+	struct worker *target;  // Worker receiving the session
+	int i;                  //for loop iterator
 
-	// Inform the client that the control connection can be closed.
-	printf("  Transmitting connection-termination go-ahead ...\n");
-	sendPack(controlSocket, "CLOSE", "");
+	target = &pool->workers[pool->nextWorker++ % pool->numWorkers];
+	dequePush(&target->queue, pending);
+	wakeWorker(target);
 
-	// Cleanup.
-	for (i = 0; i < numFiles; i++) {
-		free(fileList[i]);
+	if (atomic_load(&target->busy)) {
+		for (i = 0; i < pool->numWorkers; i++) {
+			if (!atomic_load(&pool->workers[i].busy)) {
+				wakeWorker(&pool->workers[i]);
+				break;
+			}
+		}
 	}
-	free(fileList);
-
-	return ret;
 }
 
 
-/* void sendFile(int sockfd, void* buffer, int presetSize){
+/* void adoptSessions(struct worker* worker)
 	* inputs:
-                * int sockfd -- file descriptor of the socket connection to be used for FTP
-                * void* buf -- this is a generic pointer type which can be converted to any other pointer type without explicit cast: must convert to complete data type before dereferencing or pointer arithmetic
-                            -- this buffer will be used to store the client's data
-                * int size -- pre determined number of bytes to accept/receive from client
+		* struct worker* worker -- worker between event batches
 	* outputs:
-		* none
+		* sessions opened on the worker's reactor for every queued or stolen control connection
 	* calls:
-		* send() -- shall initiate transmission of a message from the specified socket to its peer'
-			* returns number of bytes sent on success, -1 on failure 
+		* dequePop(), dequeSteal(), openSession()
 	* purpose:
-		* send data until bytes sent is = to the preset size
-
+		* drains the worker's own deque; a worker with nothing queued steals from the others,
+		starting with its neighbour so thieves spread out over the victims
 */
-void sendFile(int socket, void *buffer, int numBytes)
+void adoptSessions(struct worker *worker)
 {
-	int ret;           //holds return value of send()
-	int sentBytes;     // Total number of bytes sent
+	struct pendingSession pending[MAX_EVENTS];  // Sessions being adopted
+	struct session *session;                    // Newly opened session
+	int numPending = 0;                         // Number of entries in pending
+	int i;                                      //for loop iterator
 
-	// Send the given number of bytes.
-	sentBytes = 0;
-	while (sentBytes < numBytes) {
-		ret = send(socket, buffer + sentBytes, numBytes - sentBytes, 0);
+	while (numPending < MAX_EVENTS && dequePop(&worker->queue, &pending[numPending])) {
+		numPending++;
+	}
+	for (i = 1; numPending == 0 && i < worker->pool->numWorkers; i++) {
+		struct worker *victim = &worker->pool->workers[(worker->id + i) % worker->pool->numWorkers];
+		numPending = dequeSteal(&victim->queue, pending, MAX_EVENTS);
+	}
 
-		// Error encountered.
-		if (ret == -1) {
-			perror("send");
-			exit(1);
+	for (i = 0; i < numPending; i++) {
+		session = openSession(&worker->reactor, pending[i].socket, &pending[i].clientAddress);
+		if (session != NULL) {
+			printf("\nftserver: FTP control connection established with \"%s\"\n", session->clientIPv4);
 		}
+	}
 
-		// Data sent.
-		else {
-			sentBytes += ret;
-		}
+	// More sessions may still be queued; come back for them after the next batch.
+	if (numPending == MAX_EVENTS) {
+		wakeWorker(worker);
 	}
 }
 
 
-/* void sendPack(int sockfd, char* option, char* data);
-	* intputs: 
-		* int sockfd -- file descriptor for socket connection
-		* char* option -- c string for client command option
-		* char* data -- c string for client data payload
+/* void* workerMain(void* arg)
+	* inputs:
+		* void* arg -- struct worker* describing this thread
 	* outputs:
-		* none
+		* never returns
 	* calls:
-		* sendFile()
+		* epoll_wait(), handleEvent(), retryDueSessions(), adoptSessions(), pushChanges()
 	* purpose:
-		* sends a packet from the specified socket
-
+		* event loop of one worker thread; each worker drives its sessions independently, so
+		transfers proceed in parallel on every core
 */
-void sendPack(int socket, char *tag, char *data)
+void *workerMain(void *arg)
 {
-	unsigned short packetLength;        // Number of bytes in packet
-	char tagBuffer[ARG_LEN];            // Transmission buffer for given tag
+	struct worker *worker = arg;             // This thread's worker
+	struct reactor *reactor = &worker->reactor;
+	struct epoll_event events[MAX_EVENTS];  // Ready sockets
+	int numEvents;                          // Number of ready sockets
+	int i;                                  // for loop iterator
+
+	while (1) {
+		// Wait for socket activity, waking in time for any pending data connection retry.
+		atomic_store(&worker->busy, 0);
+		numEvents = epoll_wait(reactor->epollFd, events, MAX_EVENTS,
+		                       reactor->retrying > 0 ? CXN_RETRY_MS : -1);
+		atomic_store(&worker->busy, 1);
+		if (numEvents == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
 
-	//send packLen
-	packetLength = htons(sizeof(packetLength) + ARG_LEN + strlen(data));
-	sendFile(socket, &packetLength, sizeof(packetLength));
+		// Advance every session with a ready socket.
+		for (i = 0; i < numEvents; i++) {
+			handleEvent(reactor, events[i].data.ptr, events[i].events);
+		}
+		if (reactor->retrying > 0) {
+			retryDueSessions(reactor);
+		}
+		adoptSessions(worker);
+		if (reactor->changed) {
+			reactor->changed = 0;
+			if (reactor->watching > 0) {
+				pushChanges(reactor);
+			}
+		}
 
-	//send command option
-	memset(tagBuffer, '\0', ARG_LEN);   // Null-padding
-	strcpy(tagBuffer, tag);
-	sendFile(socket, tagBuffer, ARG_LEN);
+		// Release sessions closed during this batch; the arena holds the session itself.
+		while (reactor->closed != NULL) {
+			struct arena arena = reactor->closed->arena;
+			reactor->closed = reactor->closed->next;
+			arenaRelease(&arena);
+		}
+	}
 
-	//send data
-	sendFile(socket, data, strlen(data));
+	return NULL;
 }
 
 
-/* void ftp(int s_portno)
+/* void ftp(int s_portno, int numWorkers)
 	* inputs:
 		* int s_portno -- holds the <SERVER_PORT> argument from command line upon conversion to integer
+		* int numWorkers -- number of worker threads serving sessions
 	* outputs:
 		* on success -- 
 		* on failure -- perrer(<error_message>) exit(1)
@@ -597,9 +5968,13 @@ void sendPack(int socket, char *tag, char *data)
 		* provide FTP for client connections
 			* create/maintain Control connection
 			* create Data connection
+			* every session is a non-blocking state machine driven by a worker's epoll
+			reactor, so a slow client never stalls the clients queued behind it
+			* accepted control connections are queued on the workers' deques; idle workers
+			steal from busy ones
 		* end FTP on interrupt signal
 */
-void ftp(int port)
+void ftp(int port, int numWorkers)
 {	
 	//file descriptor for server socket
 	int serverSocket;                 // Socket for receiving client requests
@@ -607,6 +5982,9 @@ void ftp(int port)
 	//handles interrupt signals
 	struct sigaction interrupt;       // Signal action for handling interrupt
 	struct sockaddr_in serverAddress; // Server address
+	struct pool pool;                 // Worker threads driving the FTP sessions
+	struct dirSnapshot snapshot;      // Listing of the served directory
+	int i;                            // for loop iterator
 
 	// Configure the server address.
 	//The first field is short sin_family, which contains a code 
@@ -688,68 +6066,76 @@ void ftp(int port)
 		exit(1);
 	}
 
-	// Provide FTP services to clients until interrupted.
-	printf("ftserver: FTP server open on port %d\n", port);
-	while (1) {
-		char *clientIPv4;                   // Client dotted-decimal address
-		char commandTag[ARG_LEN + 1];       // Buffer to store command tag
-		char filename[MAX_PACK_PAYLOAD_LEN + 1]; // Buffer to store filename
-		int controlSocket, dataSocket;      // Server-side FTP connection endpoints
-		int dataPort;                       // Client-side data connection port
-		socklen_t addrLen;                  // Length of an address struct
-		struct sockaddr_in clientAddress;   // Client address
-
-		// Establish FTP control connection.
-		addrLen = sizeof(struct sockaddr_in);
-		controlSocket = accept(serverSocket, (struct sockaddr *) &clientAddress, &addrLen);
-		if (controlSocket == -1) {
-			perror("accept");
-			exit(1);
-		}
-		//inet_ntoa(struct in_addr in): converts the internet host address called 'in' (clientIP) given in network byte order(Big Endian), to a string in IPv4 dotted-decimal notation. 
-		//the string is returned in a statically allocated buffer which subsequent calls will overwrite
-		clientIPv4 = inet_ntoa(clientAddress.sin_addr);
-		printf("\nftserver: FTP control connection established with \"%s\"\n", clientIPv4);
-
-		// Communicate over FTP control connection.
-		status = controlConnection(controlSocket, commandTag, &dataPort, filename);
+	// Load the served directory once; inotify keeps it current from here on.
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshotInit(&snapshot);
 
-		// Provide FTP data services if control session was successful.
-		if (status != -1) {
-			int connectionAttempts;  // Number of data connection requests
+	// Start the worker pool; each worker runs its own reactor, and is woken by the watch thread
+	// when directory changes are waiting for its WATCH sessions.
+	snapshot.wakeFds = malloc(numWorkers * sizeof(int));
+	assert(snapshot.wakeFds != NULL); // malloc() failure check
+	snapshot.numWakeFds = numWorkers;
+	pool.numWorkers = numWorkers;
+	pool.nextWorker = 0;
+	pool.workers = calloc(numWorkers, sizeof(struct worker));
+	assert(pool.workers != NULL); // calloc() failure check
+	for (i = 0; i < numWorkers; i++) {
+		struct worker *worker = &pool.workers[i];
+		struct epoll_event event;   // Interest registration
 
-			// Create server-side endpoint of FTP data connection.
-			dataSocket = socket(AF_INET, SOCK_STREAM, 0);
-			if (dataSocket == -1) {
-				perror("socket");
-				exit(1);
-			}
+		worker->id = i;
+		worker->pool = &pool;
+		pthread_mutex_init(&worker->queue.lock, NULL);
+		atomic_init(&worker->busy, 0);
 
-			// Establish FTP data connection.
-			clientAddress.sin_port = htons(dataPort);
-			connectionAttempts = 0;
-			do {
-				status = connect(dataSocket, (struct sockaddr *) &clientAddress, sizeof(clientAddress));
-			} while (status == -1 && connectionAttempts < MAX_CXN_ATTEMPTS);
-			if (status == -1) {
-				perror("connect");
-				exit(1);
-			}
-			printf("ftserver: FTP data connection established with \"%s\"\n", clientIPv4);
+		worker->reactor.snapshot = &snapshot;
+		worker->reactor.epollFd = epoll_create1(0);
+		if (worker->reactor.epollFd == -1) {
+			perror("epoll_create1");
+			exit(1);
+		}
+		worker->reactor.wakeup.kind = WAKEUP;
+		worker->reactor.wakeup.socket = eventfd(0, EFD_NONBLOCK);
+		if (worker->reactor.wakeup.socket == -1) {
+			perror("eventfd");
+			exit(1);
+		}
+		snapshot.wakeFds[i] = worker->reactor.wakeup.socket;
+		event.events = EPOLLIN;
+		event.data.ptr = &worker->reactor.wakeup;
+		status = epoll_ctl(worker->reactor.epollFd, EPOLL_CTL_ADD, worker->reactor.wakeup.socket, &event);
+		if (status == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
 
-			// Transfer file information over FTP data connection.
-			dataConnection(controlSocket, dataSocket, commandTag, filename);
+		status = pthread_create(&worker->thread, NULL, workerMain, worker);
+		if (status != 0) {
+			fprintf(stderr, "ftserver: pthread_create: %s\n", strerror(status));
+			exit(1);
+		}
+	}
 
-			// Wait for client to acknowledge received data.
-			recvPack(controlSocket, NULL, NULL);
+	// Provide FTP services to clients until interrupted.
+	printf("ftserver: FTP server open on port %d (%d workers)\n", port, numWorkers);
+	while (1) {
+		struct pendingSession pending;      // Accepted control connection
+		socklen_t addrLen;                  // Length of an address struct
 
-			// Close FTP data connection.
-			status = close(dataSocket);
-			if (status == -1) {
-				perror("close");
-				exit(1);
+		// Establish FTP control connection; a worker takes it from here.
+		addrLen = sizeof(struct sockaddr_in);
+		pending.socket = accept4(serverSocket, (struct sockaddr *) &pending.clientAddress,
+		                         &addrLen, SOCK_NONBLOCK);
+		if (pending.socket == -1) {
+			// The client gave up before its connection was accepted.
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
 			}
-			printf("ftserver: FTP data connection closed\n");
+			// Out of descriptors or memory; keep serving the sessions already open.
+			perror("accept");
+			sleep(1);
+			continue;
 		}
+		scheduleSession(&pool, &pending);
 	}
 }
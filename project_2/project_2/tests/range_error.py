@@ -0,0 +1,172 @@
+# CS372: Project 2
+# FT Server: tests/range_error.py
+# description:
+        # An invalid RANGE followed by a valid GET on the same control connection:
+        # the refused request must not keep the file open, and the GET must send
+        # the whole file.
+# usage:
+#       python2 tests/range_error.py [<path to ftserver>]    (run by 'make test')
+#       * needs inotify, so the deleted file's cached descriptor is closed
+#
+
+import os                       # Miscellaneous operating system interfaces
+import shutil                   # High-level file operations
+import subprocess               # Subprocess management
+import sys                      # System-specific parameters
+import tempfile                 # Temporary directories
+import time                     # Time access and conversions
+from socket import socket, create_connection # Sockets API
+from struct import pack, unpack # Structured binary data
+
+TAG_LEN = 8 # Number of bytes reserved for tag field of packet header
+FILENAME = "big.bin" # File served by the test
+
+
+# sendPack function
+#	* inputs:
+#		* sock -- socket to send on
+#		* tag -- packet tag
+#		* data -- packet data
+#	* purpose:
+#		* sends a version 1 packet: len (2 bytes, counts header and data) | tag (8 bytes)
+#
+def sendPack(sock, tag, data = ""):
+    sock.sendall(pack(">H", 2 + TAG_LEN + len(data)) + tag.ljust(TAG_LEN, "\0") + data)
+
+
+# recvPack function
+#	* inputs:
+#		* sock -- socket to receive from
+#	* outputs:
+#		* pair of received tag and data
+#
+def recvPack(sock):
+    header = recvAll(sock, 2 + TAG_LEN)
+    dataLength = unpack(">H", header[:2])[0] - 2 - TAG_LEN
+    return header[2:].rstrip("\0"), recvAll(sock, dataLength)
+
+
+# recvAll function
+#	* inputs:
+#		* sock -- socket to receive from
+#		* numBytes -- number of bytes to receive
+#	* outputs:
+#		* exactly numBytes bytes; exits if the server closes the connection first
+#
+def recvAll(sock, numBytes):
+    parts = []
+    while numBytes > 0:
+        data = sock.recv(numBytes)
+        if not data:
+            fail("connection closed by ftserver")
+        parts.append(data)
+        numBytes -= len(data)
+    return "".join(parts)
+
+
+# fail function
+#	* inputs:
+#		* message -- reason the test failed
+#
+def fail(message):
+    print "range_error: FAIL: " + message
+    sys.exit(1)
+
+
+# fetch function
+#	* inputs:
+#		* control -- control connection
+#		* modifiers -- (tag, data) packets sent ahead of PASV, e.g. RANGE
+#	* outputs:
+#		* pair of the control packets after OKAY (up to CLOSE) and the file data received
+#	* purpose:
+#		* one passive-mode GET of FILENAME, acknowledged once complete
+#
+def fetch(control, modifiers):
+    for tag, data in modifiers:
+        sendPack(control, tag, data)
+    sendPack(control, "PASV")
+    sendPack(control, "GET", FILENAME)
+
+    tag, port = recvPack(control)
+    if tag != "PORT":
+        fail("expected PORT, received " + tag)
+    tag, data = recvPack(control)
+    if tag != "OKAY":
+        fail("expected OKAY, received {0} {1}".format(tag, data))
+
+    dataSocket = create_connection(("127.0.0.1", int(port)))
+    contents = []
+    tag, data = recvPack(dataSocket)
+    while tag != "DONE":
+        if tag == "FILE":
+            contents.append(data)
+        tag, data = recvPack(dataSocket)
+    dataSocket.close()
+
+    replies = []
+    tag, data = recvPack(control)
+    while tag != "CLOSE":
+        replies.append((tag, data))
+        tag, data = recvPack(control)
+    sendPack(control, "ACK")
+
+    # The first FILE packet carries the filename.
+    return replies, "".join(contents[1:])
+
+
+def main():
+    server = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "ftserver")
+    directory = tempfile.mkdtemp()
+    contents = "".join("{0}\n".format(i) for i in range(20000))
+    with open(os.path.join(directory, FILENAME), "w") as outfile:
+        outfile.write(contents)
+
+    # Find a free port for ftserver.
+    probe = socket()
+    probe.bind(("127.0.0.1", 0))
+    port = probe.getsockname()[1]
+    probe.close()
+
+    devnull = open(os.devnull, "w")
+    process = subprocess.Popen([server, str(port)], cwd = directory, stdout = devnull, stderr = devnull)
+    try:
+        for attempt in range(50):
+            try:
+                control = create_connection(("127.0.0.1", port))
+                break
+            except Exception:
+                time.sleep(0.1)
+        else:
+            fail("ftserver did not start")
+
+        replies, data = fetch(control, [("RANGE", str(len(contents) + 1))])
+        if replies != [("ERROR", "Invalid range")]:
+            fail("expected ERROR Invalid range, received {0}".format(replies))
+
+        replies, data = fetch(control, [])
+        if replies or data != contents:
+            fail("GET after the refused RANGE did not send the whole file")
+        control.close()
+
+        # Once the file is deleted, inotify evicts its cached descriptor; nothing else may hold it.
+        os.unlink(os.path.join(directory, FILENAME))
+        time.sleep(0.5)
+        fdDirectory = "/proc/{0}/fd".format(process.pid)
+        for fd in os.listdir(fdDirectory):
+            try:
+                target = os.readlink(os.path.join(fdDirectory, fd))
+            except OSError:
+                continue
+            if target.endswith(FILENAME + " (deleted)"):
+                fail("descriptor {0} still refers to the deleted {1}".format(fd, FILENAME))
+    finally:
+        process.terminate()
+        process.wait()
+        shutil.rmtree(directory)
+
+    print "range_error: OK"
+
+
+if __name__ == "__main__":
+    main()